@@ -0,0 +1,551 @@
+// Compares the ways we could grab the desktop from the X server.
+//
+// Every method reads the same synthetic desktop: a pixmap of the size under
+// test filled with a pattern, with a small square redrawn before each
+// capture so nothing can be cached. Sizes cover single monitors and
+// multi-monitor roots, the latter with dead area where monitors of
+// different heights don't line up. `native` benchmarks the real root window
+// and its XRandR monitors instead.
+//
+// Results go to stdout as one JSON document, progress to stderr:
+//
+//   capture_bench [--iterations N] [--warmup N] [--size NAME]...
+//                 [--method NAME]...
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xcomposite.h>
+#include <X11/extensions/Xrandr.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#ifdef HAVE_XCB_SHM
+#include <xcb/shm.h>
+#include <xcb/xcb.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+#include "../src/clock.hpp"
+
+#define BENCH_MAX_MONITORS 4
+
+struct BenchSize {
+  const char *name;
+  int width, height;
+  int monitor_count;
+  XRectangle monitors[BENCH_MAX_MONITORS];
+};
+
+static const BenchSize bench_sizes[] = {
+    {"1080p", 1920, 1080, 1, {{0, 0, 1920, 1080}}},
+    {"1440p", 2560, 1440, 1, {{0, 0, 2560, 1440}}},
+    {"4k", 3840, 2160, 1, {{0, 0, 3840, 2160}}},
+    {"2x1080p", 3840, 1080, 2, {{0, 0, 1920, 1080}, {1920, 0, 1920, 1080}}},
+    // Bottom aligned, so a quarter of the laptop column is dead area.
+    {"1080p+1440p",
+     4480,
+     1440,
+     2,
+     {{0, 360, 1920, 1080}, {1920, 0, 2560, 1440}}},
+    {"3x1440p",
+     7680,
+     1440,
+     3,
+     {{0, 0, 2560, 1440}, {2560, 0, 2560, 1440}, {5120, 0, 2560, 1440}}},
+};
+
+// What a method captures from.
+struct BenchTarget {
+  Display *dpy;
+  Visual *visual;
+  int depth;
+  // The synthetic desktop pixmap, or the root window for `native`.
+  Drawable drawable;
+  bool native;
+  int width, height;
+  std::vector<XRectangle> monitors;
+};
+
+// Per-method state, only the parts a method uses are set.
+struct Capture {
+  std::vector<XImage *> images;
+  // Where each image is read from.
+  std::vector<XRectangle> rects;
+  XShmSegmentInfo shm;
+  bool shm_attached;
+  // Bytes one capture moves.
+  size_t bytes;
+  Window window;
+  Pixmap window_pixmap;
+#ifdef HAVE_XCB_SHM
+  xcb_connection_t *conn;
+  uint32_t seg;
+#endif
+};
+
+struct BenchMethod {
+  const char *name;
+  // Returns nullptr on success, otherwise why the method can't run.
+  const char *(*init)(Capture &c, const BenchTarget &t);
+  // Returns false if the capture failed.
+  bool (*grab)(Capture &c, const BenchTarget &t);
+  void (*destroy)(Capture &c, const BenchTarget &t);
+};
+
+
+// A gradient with a grid of solid "windows", so the image isn't uniform.
+static uint32_t desktop_pattern(int x, int y) {
+  if ((x / 480 + y / 270) % 3 == 0 && x % 480 > 20 && y % 270 > 40)
+    return 0xffe8e8e8u;
+  return 0xff000000u | uint32_t((x * 255 / 3840) << 16) |
+         uint32_t((y * 255 / 2160) << 8) | uint32_t((x ^ y) & 0xff);
+}
+
+// Fills `drawable` with the pattern, a band at a time.
+static void fill_desktop(const BenchTarget &t, Drawable drawable) {
+  const int band = 64;
+  GC gc = XCreateGC(t.dpy, drawable, 0, nullptr);
+  XImage *img = XCreateImage(t.dpy, t.visual, t.depth, ZPixmap, 0, nullptr,
+                             t.width, band, 32, 0);
+  img->data = (char *)malloc(size_t(img->bytes_per_line) * band);
+  for (int y0 = 0; y0 < t.height; y0 += band) {
+    int h = std::min(band, t.height - y0);
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < t.width; x++)
+        XPutPixel(img, x, y, desktop_pattern(x, y0 + y));
+    }
+    XPutImage(t.dpy, drawable, gc, img, 0, 0, 0, y0, t.width, h);
+  }
+  XDestroyImage(img);
+  XFreeGC(t.dpy, gc);
+  XSync(t.dpy, False);
+}
+
+// Redraws a small square that moves every frame, like a blinking cursor.
+static void touch_desktop(const BenchTarget &t, Drawable drawable,
+                          int frame) {
+  if (t.native)
+    return;
+  GC gc = XCreateGC(t.dpy, drawable, 0, nullptr);
+  XSetForeground(t.dpy, gc, 0xff000000u | uint32_t(frame * 0x10101));
+  XFillRectangle(t.dpy, drawable, gc, (frame * 37) % (t.width - 64),
+                 (frame * 11) % (t.height - 64), 64, 64);
+  XFreeGC(t.dpy, gc);
+}
+
+
+static bool create_shm(Capture &c, Display *dpy, size_t size) {
+  c.shm.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+  if (c.shm.shmid < 0) {
+    perror("shmget");
+    return false;
+  }
+  c.shm.shmaddr = (char *)shmat(c.shm.shmid, 0, 0);
+  // Removed once everyone detached.
+  shmctl(c.shm.shmid, IPC_RMID, 0);
+  if (c.shm.shmaddr == (char *)-1) {
+    perror("shmat");
+    return false;
+  }
+  c.shm.readOnly = False;
+  if (dpy) {
+    if (!XShmAttach(dpy, &c.shm))
+      return false;
+    XSync(dpy, False);
+    c.shm_attached = true;
+  }
+  return true;
+}
+
+static void destroy_shm(Capture &c, Display *dpy) {
+  if (c.shm_attached) {
+    XShmDetach(dpy, &c.shm);
+    XSync(dpy, False);
+  }
+  if (c.shm.shmaddr && c.shm.shmaddr != (char *)-1)
+    shmdt(c.shm.shmaddr);
+}
+
+// Shm images share one segment, the data of each starting at its offset.
+static const char *init_shm_images(Capture &c, const BenchTarget &t,
+                                   const std::vector<XRectangle> &rects) {
+  if (!XShmQueryExtension(t.dpy))
+    return "no MIT-SHM";
+
+  std::vector<size_t> offsets;
+  size_t size = 0;
+  for (const XRectangle &r : rects) {
+    XImage *img = XShmCreateImage(t.dpy, t.visual, t.depth, ZPixmap, nullptr,
+                                  &c.shm, r.width, r.height);
+    if (!img)
+      return "XShmCreateImage failed";
+    c.images.push_back(img);
+    c.rects.push_back(r);
+    offsets.push_back(size);
+    size += size_t(img->bytes_per_line) * r.height;
+  }
+  if (!create_shm(c, t.dpy, size))
+    return "shared memory setup failed";
+  for (size_t i = 0; i < c.images.size(); i++)
+    c.images[i]->data = c.shm.shmaddr + offsets[i];
+  c.bytes = size;
+  return nullptr;
+}
+
+static void destroy_images(Capture &c, const BenchTarget &t) {
+  destroy_shm(c, t.dpy);
+  for (XImage *img : c.images) {
+    // Shm images don't own their data.
+    img->data = nullptr;
+    XDestroyImage(img);
+  }
+  c.images.clear();
+}
+
+
+static const char *init_xgetimage(Capture &c, const BenchTarget &t) {
+  c.bytes = 0;
+  return nullptr;
+}
+
+static bool grab_xgetimage(Capture &c, const BenchTarget &t) {
+  XImage *img = XGetImage(t.dpy, t.drawable, 0, 0, t.width, t.height,
+                          AllPlanes, ZPixmap);
+  if (!img)
+    return false;
+  c.bytes = size_t(img->bytes_per_line) * img->height;
+  XDestroyImage(img);
+  return true;
+}
+
+
+static const char *init_xshm_root(Capture &c, const BenchTarget &t) {
+  XRectangle all = {0, 0, (unsigned short)t.width, (unsigned short)t.height};
+  return init_shm_images(c, t, {all});
+}
+
+static const char *init_xshm_monitors(Capture &c, const BenchTarget &t) {
+  return init_shm_images(c, t, t.monitors);
+}
+
+static bool grab_xshm(Capture &c, const BenchTarget &t) {
+  for (size_t i = 0; i < c.images.size(); i++) {
+    if (!XShmGetImage(t.dpy, t.drawable, c.images[i], c.rects[i].x,
+                      c.rects[i].y, AllPlanes)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+#ifdef HAVE_XCB_SHM
+static const char *init_xcb_shm(Capture &c, const BenchTarget &t) {
+  // A connection of its own, XIDs are server wide.
+  c.conn = xcb_connect(nullptr, nullptr);
+  if (xcb_connection_has_error(c.conn))
+    return "xcb_connect failed";
+  const xcb_query_extension_reply_t *ext =
+      xcb_get_extension_data(c.conn, &xcb_shm_id);
+  if (!ext || !ext->present)
+    return "no MIT-SHM";
+
+  XImage *probe = XCreateImage(t.dpy, t.visual, t.depth, ZPixmap, 0, nullptr,
+                               t.width, t.height, 32, 0);
+  c.bytes = size_t(probe->bytes_per_line) * t.height;
+  XDestroyImage(probe);
+  if (!create_shm(c, nullptr, c.bytes))
+    return "shared memory setup failed";
+
+  c.seg = xcb_generate_id(c.conn);
+  xcb_generic_error_t *err = xcb_request_check(
+      c.conn, xcb_shm_attach_checked(c.conn, c.seg, c.shm.shmid, 0));
+  if (err) {
+    free(err);
+    return "xcb_shm_attach failed";
+  }
+  return nullptr;
+}
+
+static bool grab_xcb_shm(Capture &c, const BenchTarget &t) {
+  xcb_shm_get_image_cookie_t cookie = xcb_shm_get_image(
+      c.conn, t.drawable, 0, 0, t.width, t.height, ~0u,
+      XCB_IMAGE_FORMAT_Z_PIXMAP, c.seg, 0);
+  xcb_shm_get_image_reply_t *reply =
+      xcb_shm_get_image_reply(c.conn, cookie, nullptr);
+  if (!reply)
+    return false;
+  free(reply);
+  return true;
+}
+
+static void destroy_xcb_shm(Capture &c, const BenchTarget &t) {
+  if (c.seg)
+    xcb_shm_detach(c.conn, c.seg);
+  if (c.conn)
+    xcb_disconnect(c.conn);
+  destroy_shm(c, nullptr);
+}
+#endif
+
+
+// Reads back the redirected pixmap of a window showing the desktop, which is
+// what capturing individual windows costs.
+static const char *init_composite(Capture &c, const BenchTarget &t) {
+  int event_base, error_base, major = 0, minor = 2;
+  if (!XCompositeQueryExtension(t.dpy, &event_base, &error_base) ||
+      !XCompositeQueryVersion(t.dpy, &major, &minor) ||
+      (major == 0 && minor < 2)) {
+    return "no Composite 0.2";
+  }
+  if (t.native)
+    return "needs a window, not the root";
+
+  XSetWindowAttributes attrs = {};
+  attrs.override_redirect = True;
+  attrs.background_pixmap = t.drawable;
+  // Off screen, redirection keeps the contents anyway.
+  c.window = XCreateWindow(
+      t.dpy, DefaultRootWindow(t.dpy), -t.width - 16, -t.height - 16, t.width,
+      t.height, 0, t.depth, InputOutput, t.visual,
+      CWOverrideRedirect | CWBackPixmap, &attrs);
+  XCompositeRedirectWindow(t.dpy, c.window, CompositeRedirectAutomatic);
+  XMapWindow(t.dpy, c.window);
+  XSync(t.dpy, False);
+  c.window_pixmap = XCompositeNameWindowPixmap(t.dpy, c.window);
+
+  XRectangle all = {0, 0, (unsigned short)t.width, (unsigned short)t.height};
+  return init_shm_images(c, t, {all});
+}
+
+static bool grab_composite(Capture &c, const BenchTarget &t) {
+  return XShmGetImage(t.dpy, c.window_pixmap, c.images[0], 0, 0, AllPlanes);
+}
+
+static void destroy_composite(Capture &c, const BenchTarget &t) {
+  destroy_images(c, t);
+  if (c.window_pixmap)
+    XFreePixmap(t.dpy, c.window_pixmap);
+  if (c.window)
+    XDestroyWindow(t.dpy, c.window);
+  XSync(t.dpy, False);
+}
+
+static void destroy_nothing(Capture &c, const BenchTarget &t) {}
+
+static const BenchMethod bench_methods[] = {
+    {"xgetimage", init_xgetimage, grab_xgetimage, destroy_nothing},
+    {"xshm_root", init_xshm_root, grab_xshm, destroy_images},
+    {"xshm_monitors", init_xshm_monitors, grab_xshm, destroy_images},
+#ifdef HAVE_XCB_SHM
+    {"xcb_shm", init_xcb_shm, grab_xcb_shm, destroy_xcb_shm},
+#endif
+    {"composite", init_composite, grab_composite, destroy_composite},
+};
+
+
+static int x_error_count = 0;
+
+static int count_x_error(Display *dpy, XErrorEvent *e) {
+  x_error_count++;
+  return 0;
+}
+
+static int64_t percentile(const std::vector<int64_t> &sorted, double p) {
+  return sorted[size_t(p * (sorted.size() - 1) + 0.5)];
+}
+
+static bool selected(const std::vector<const char *> &names,
+                     const char *name) {
+  if (names.empty())
+    return true;
+  for (const char *n : names) {
+    if (strcmp(n, name) == 0)
+      return true;
+  }
+  return false;
+}
+
+static void native_monitors(BenchTarget &t) {
+  int n = 0;
+  XRRMonitorInfo *m = XRRGetMonitors(t.dpy, t.drawable, True, &n);
+  for (int i = 0; i < n; i++) {
+    t.monitors.push_back({(short)m[i].x, (short)m[i].y,
+                          (unsigned short)m[i].width,
+                          (unsigned short)m[i].height});
+  }
+  if (m)
+    XRRFreeMonitors(m);
+  if (t.monitors.empty()) {
+    t.monitors.push_back(
+        {0, 0, (unsigned short)t.width, (unsigned short)t.height});
+  }
+}
+
+// Runs one method on one target and prints its JSON object.
+static void run_method(const BenchMethod &m, const BenchTarget &t,
+                       const char *size_name, int warmup, int iterations,
+                       bool first) {
+  printf("%s\n    {\"size\": \"%s\", \"width\": %d, \"height\": %d, "
+         "\"monitors\": %d, \"method\": \"%s\", ",
+         first ? "" : ",", size_name, t.width, t.height,
+         int(t.monitors.size()), m.name);
+
+  Capture c = {};
+  x_error_count = 0;
+  const char *error = m.init(c, t);
+  XSync(t.dpy, False);
+  if (!error && x_error_count > 0)
+    error = "X error during setup";
+  if (error) {
+    fprintf(stderr, "%-12s %-14s skipped: %s\n", size_name, m.name, error);
+    printf("\"error\": \"%s\"}", error);
+    m.destroy(c, t);
+    return;
+  }
+
+  std::vector<int64_t> samples;
+  samples.reserve(iterations);
+  Drawable touched = c.window ? c.window : t.drawable;
+  int64_t total_ns = 0;
+  bool ok = true;
+  for (int i = 0; i < warmup + iterations && ok; i++) {
+    touch_desktop(t, touched, i);
+    XSync(t.dpy, False);
+    int64_t start = monotonic_ns();
+    ok = m.grab(c, t);
+    int64_t elapsed = monotonic_ns() - start;
+    if (i >= warmup) {
+      samples.push_back(elapsed / 1000);
+      total_ns += elapsed;
+    }
+  }
+  XSync(t.dpy, False);
+  m.destroy(c, t);
+  if (!ok || x_error_count > 0 || samples.empty()) {
+    fprintf(stderr, "%-12s %-14s failed\n", size_name, m.name);
+    printf("\"error\": \"capture failed\"}");
+    return;
+  }
+
+  std::sort(samples.begin(), samples.end());
+  double seconds = total_ns / 1e9;
+  double fps = samples.size() / seconds;
+  double mib_per_s = c.bytes * fps / (1024.0 * 1024.0);
+  fprintf(stderr,
+          "%-12s %-14s %8.1f fps %8.1f MiB/s p50 %6lld us p99 %6lld us\n",
+          size_name, m.name, fps, mib_per_s,
+          (long long)percentile(samples, 0.50),
+          (long long)percentile(samples, 0.99));
+  printf("\"bytes\": %zu, \"frames\": %zu, \"fps\": %.2f, "
+         "\"mib_per_s\": %.1f, \"p50_us\": %lld, \"p95_us\": %lld, "
+         "\"p99_us\": %lld, \"max_us\": %lld}",
+         c.bytes, samples.size(), fps, mib_per_s,
+         (long long)percentile(samples, 0.50),
+         (long long)percentile(samples, 0.95),
+         (long long)percentile(samples, 0.99), (long long)samples.back());
+}
+
+static void run_target(const BenchTarget &t, const char *size_name,
+                       const std::vector<const char *> &methods, int warmup,
+                       int iterations, bool &first) {
+  for (const BenchMethod &m : bench_methods) {
+    if (!selected(methods, m.name))
+      continue;
+    run_method(m, t, size_name, warmup, iterations, first);
+    first = false;
+    fflush(stdout);
+  }
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [--iterations N] [--warmup N] [--size NAME]... "
+          "[--method NAME]...\n  sizes:  ",
+          argv0);
+  for (const BenchSize &s : bench_sizes)
+    fprintf(stderr, " %s", s.name);
+  fprintf(stderr, " native\n  methods:");
+  for (const BenchMethod &m : bench_methods)
+    fprintf(stderr, " %s", m.name);
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+  int iterations = 100, warmup = 10;
+  std::vector<const char *> sizes, methods;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      warmup = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      sizes.push_back(argv[++i]);
+    } else if (strcmp(argv[i], "--method") == 0 && i + 1 < argc) {
+      methods.push_back(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (iterations < 1 || warmup < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  Display *dpy = XOpenDisplay(nullptr);
+  if (!dpy) {
+    fprintf(stderr, "Can't open display\n");
+    return 1;
+  }
+  XSetErrorHandler(count_x_error);
+  int screen = DefaultScreen(dpy);
+  Window root = RootWindow(dpy, screen);
+
+  printf("{\n  \"display\": \"%s\", \"vendor\": \"%s\", "
+         "\"release\": %d, \"depth\": %d,\n  \"iterations\": %d, "
+         "\"warmup\": %d,\n  \"results\": [",
+         DisplayString(dpy), ServerVendor(dpy), VendorRelease(dpy),
+         DefaultDepth(dpy, screen), iterations, warmup);
+
+  bool first = true;
+  for (const BenchSize &s : bench_sizes) {
+    if (!selected(sizes, s.name))
+      continue;
+    BenchTarget t = {};
+    t.dpy = dpy;
+    t.visual = DefaultVisual(dpy, screen);
+    t.depth = DefaultDepth(dpy, screen);
+    t.width = s.width;
+    t.height = s.height;
+    t.monitors.assign(s.monitors, s.monitors + s.monitor_count);
+    t.drawable = XCreatePixmap(dpy, root, s.width, s.height, t.depth);
+    fill_desktop(t, t.drawable);
+    run_target(t, s.name, methods, warmup, iterations, first);
+    XFreePixmap(dpy, t.drawable);
+  }
+
+  if (selected(sizes, "native")) {
+    BenchTarget t = {};
+    t.dpy = dpy;
+    t.visual = DefaultVisual(dpy, screen);
+    t.depth = DefaultDepth(dpy, screen);
+    t.drawable = root;
+    t.native = true;
+    t.width = DisplayWidth(dpy, screen);
+    t.height = DisplayHeight(dpy, screen);
+    native_monitors(t);
+    run_target(t, "native", methods, warmup, iterations, first);
+  }
+
+  printf("\n  ]\n}\n");
+  XCloseDisplay(dpy);
+  return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * Prints every pose viture_ar_desktop publishes, see include/pose_shm.h.
+ *
+ *   pose_reader          follow every sample
+ *   pose_reader latest   print only the newest pose, ten times a second
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pose_shm.h"
+
+static void print_pose(const struct viture_pose_record *r) {
+  printf("%10llu ts=%10u host=%lld.%09lld roll=%7.2f pitch=%7.2f yaw=%7.2f "
+         "q=(%6.3f %6.3f %6.3f %6.3f)\n",
+         (unsigned long long)r->index, r->device_ts,
+         (long long)(r->host_ns / 1000000000),
+         (long long)(r->host_ns % 1000000000), r->roll, r->pitch, r->yaw,
+         r->qw, r->qx, r->qy, r->qz);
+}
+
+static void sleep_us(long us) {
+  struct timespec ts = {us / 1000000, (us % 1000000) * 1000};
+  nanosleep(&ts, NULL);
+}
+
+int main(int argc, char **argv) {
+  int latest = argc > 1 && strcmp(argv[1], "latest") == 0;
+  struct viture_pose_record rec;
+  const struct viture_pose_shm *shm = viture_pose_shm_open();
+  if (!shm) {
+    fprintf(stderr, "No pose broadcast at %s (viewer not running or "
+                    "different version)\n",
+            VITURE_POSE_SHM_NAME);
+    return 1;
+  }
+
+  if (latest) {
+    for (;;) {
+      if (viture_pose_read_latest(shm, &rec) == VITURE_POSE_OK)
+        print_pose(&rec);
+      sleep_us(100000);
+    }
+  }
+
+  uint64_t next = viture_pose_head(shm);
+  for (;;) {
+    switch (viture_pose_read(shm, next, &rec)) {
+    case VITURE_POSE_OK:
+      print_pose(&rec);
+      next++;
+      break;
+    case VITURE_POSE_OVERWRITTEN:
+      fprintf(stderr, "fell behind, skipping %llu poses\n",
+              (unsigned long long)(viture_pose_head(shm) - 1 - next));
+      next = viture_pose_head(shm) - 1;
+      break;
+    default:
+      /* Polling stays syscall free; sleep a bit to leave the CPU alone. */
+      sleep_us(1000);
+      break;
+    }
+  }
+
+  viture_pose_shm_close(shm);
+  return 0;
+}
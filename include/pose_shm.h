@@ -0,0 +1,175 @@
+#ifndef VITURE_POSE_SHM_H
+#define VITURE_POSE_SHM_H
+
+/*
+ * Head pose broadcast by viture_ar_desktop through POSIX shared memory.
+ *
+ * The viewer writes one record per IMU sample into a ring of
+ * VITURE_POSE_RING_SIZE records. Readers map the segment read-only and never
+ * make a syscall after that:
+ *
+ * @code
+ *   const struct viture_pose_shm *shm = viture_pose_shm_open();
+ *   struct viture_pose_record rec;
+ *   if (shm && viture_pose_read_latest(shm, &rec) == 0)
+ *     use(rec.yaw, rec.host_ns);
+ * @endcode
+ *
+ * Every record is guarded by its own sequence counter (a seqlock): it is odd
+ * while the writer is inside the record, and readers retry if it changed
+ * while they were copying. Readers wanting every sample keep their own index
+ * and call viture_pose_read() with it; if they fall more than a ring behind
+ * they get VITURE_POSE_OVERWRITTEN and should skip ahead to
+ * viture_pose_head() - 1.
+ *
+ * Poses are already aligned: the offsets of the viewer's "align" command are
+ * applied to both the Euler angles and the quaternion. Times are
+ * CLOCK_MONOTONIC nanoseconds, so readers can extrapolate with the angular
+ * velocity to their own display time.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VITURE_POSE_SHM_NAME "/viture_ar_desktop_pose"
+#define VITURE_POSE_SHM_MAGIC 0x45534f50u /* "POSE" */
+/* Bumped on any layout change. */
+#define VITURE_POSE_SHM_VERSION 1
+/* Power of two. */
+#define VITURE_POSE_RING_SIZE 256
+/* A record stuck mid-write this long means the writer died inside it. */
+#define VITURE_POSE_MAX_RETRIES 100000
+
+#define VITURE_POSE_OK 0
+#define VITURE_POSE_NOT_YET -1
+#define VITURE_POSE_OVERWRITTEN -2
+
+struct viture_pose_record {
+  /* Seqlock, odd while the record is being written. */
+  uint32_t seq;
+  /* Device timestamp of the IMU sample. */
+  uint32_t device_ts;
+  /* Position in the stream, counts every record ever written. */
+  uint64_t index;
+  /* Host time the IMU sample arrived at, CLOCK_MONOTONIC. */
+  int64_t host_ns;
+
+  /* Filtered, aligned orientation. Degrees. */
+  float roll, pitch, yaw;
+  float qw, qx, qy, qz;
+  /* Filtered angular velocity, degrees per second per Euler angle. */
+  float droll, dpitch, dyaw;
+  uint32_t reserved;
+};
+
+struct viture_pose_shm {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t ring_size;
+  /* Number of records written so far, the newest is at head - 1. */
+  uint64_t head;
+  /* Process writing the ring. */
+  int32_t writer_pid;
+  uint32_t reserved0;
+  uint64_t reserved[4];
+  struct viture_pose_record records[VITURE_POSE_RING_SIZE];
+};
+
+static inline uint64_t
+viture_pose_head(const struct viture_pose_shm *shm) {
+  return __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+}
+
+/* Copies record `index` into `out`. */
+static inline int viture_pose_read(const struct viture_pose_shm *shm,
+                                   uint64_t index,
+                                   struct viture_pose_record *out) {
+  const struct viture_pose_record *rec;
+  uint32_t before, after;
+  int retries = 0;
+
+  if (index >= viture_pose_head(shm))
+    return VITURE_POSE_NOT_YET;
+
+  rec = &shm->records[index & (VITURE_POSE_RING_SIZE - 1)];
+  for (;; retries++) {
+    if (retries == VITURE_POSE_MAX_RETRIES)
+      return VITURE_POSE_NOT_YET;
+    before = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    if (before & 1)
+      continue;
+    memcpy(out, rec, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+    if (before == after)
+      break;
+  }
+
+  if (out->index != index)
+    return out->index > index ? VITURE_POSE_OVERWRITTEN : VITURE_POSE_NOT_YET;
+  return VITURE_POSE_OK;
+}
+
+static inline int viture_pose_read_latest(const struct viture_pose_shm *shm,
+                                          struct viture_pose_record *out) {
+  int result;
+  do {
+    uint64_t head = viture_pose_head(shm);
+    if (head == 0)
+      return VITURE_POSE_NOT_YET;
+    /* Only fails if the writer lapped us while copying, try the new head. */
+    result = viture_pose_read(shm, head - 1, out);
+  } while (result == VITURE_POSE_OVERWRITTEN);
+  return result;
+}
+
+/* Maps the segment read-only. Returns NULL if the viewer isn't running or
+ * speaks a different version. */
+static inline const struct viture_pose_shm *viture_pose_shm_open(void) {
+  struct stat st;
+  void *addr;
+  const struct viture_pose_shm *shm;
+  int fd = shm_open(VITURE_POSE_SHM_NAME, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*shm)) {
+    close(fd);
+    return NULL;
+  }
+  addr = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return NULL;
+
+  shm = (const struct viture_pose_shm *)addr;
+  if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) !=
+          VITURE_POSE_SHM_MAGIC ||
+      shm->version != VITURE_POSE_SHM_VERSION ||
+      shm->record_size != sizeof(struct viture_pose_record) ||
+      shm->ring_size != VITURE_POSE_RING_SIZE) {
+    munmap(addr, sizeof(*shm));
+    return NULL;
+  }
+  return shm;
+}
+
+static inline void viture_pose_shm_close(const struct viture_pose_shm *shm) {
+  munmap((void *)shm, sizeof(*shm));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <stdint.h>
+
+// Counts the heap allocations of the threads that ask for it, so --alloc-test
+// can check that the frame loops stay off the allocator once warmed up.
+//
+// Only compiled in with VITURE_ALLOC_TEST (cmake -DENABLE_ALLOC_TEST=ON),
+// since it replaces the allocator of the whole process. The global operator
+// new is replaced to count the program's own allocations, which decide the
+// test. malloc, calloc and realloc are replaced too, forwarding to glibc's
+// own implementation, to report what C libraries allocate (Xlib and xcb
+// replies, GL driver internals): that happens on every round trip and isn't
+// ours to avoid. Aligned allocations (posix_memalign and friends) are not
+// counted. The replacements are defined right here, so include this from
+// one translation unit only.
+
+// Warm-up lets containers reach their working capacity and lazily created
+// state (Xlib's event queue, trace rings) come into being.
+#define ALLOC_TEST_WARMUP_FRAMES 600
+#define ALLOC_TEST_FRAMES 1200
+
+struct AllocTest {
+  bool enabled;
+  int frame;
+  uint64_t start_count, start_bytes, start_lib_count;
+};
+
+#ifdef VITURE_ALLOC_TEST
+
+// Through operator new.
+static std::atomic<uint64_t> alloc_count{0};
+static std::atomic<uint64_t> alloc_bytes{0};
+// Through the C library's allocator.
+static std::atomic<uint64_t> alloc_lib_count{0};
+// Whether the calling thread's allocations are counted.
+static thread_local bool alloc_counted = false;
+
+static void count_thread_allocations() { alloc_counted = true; }
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+  if (alloc_counted)
+    alloc_lib_count.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+void *calloc(size_t count, size_t size) {
+  if (alloc_counted)
+    alloc_lib_count.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+void *realloc(void *p, size_t size) {
+  if (alloc_counted)
+    alloc_lib_count.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(p, size);
+}
+}
+
+// Straight to glibc so they aren't counted twice.
+static void *counted_new(size_t size) {
+  if (alloc_counted) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+  return __libc_malloc(size ? size : 1);
+}
+
+void *operator new(size_t size) {
+  void *p = counted_new(size);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return counted_new(size);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return counted_new(size);
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+// Call once per frame loop iteration. Returns the exit status once the test
+// is over, -1 until then.
+static int alloc_test_frame(AllocTest &t) {
+  t.frame++;
+  if (t.frame == ALLOC_TEST_WARMUP_FRAMES) {
+    t.start_count = alloc_count.load();
+    t.start_bytes = alloc_bytes.load();
+    t.start_lib_count = alloc_lib_count.load();
+    printf("Allocation test: warmed up, counting for %d frames\n",
+           ALLOC_TEST_FRAMES);
+  }
+  if (t.frame < ALLOC_TEST_WARMUP_FRAMES + ALLOC_TEST_FRAMES)
+    return -1;
+
+  uint64_t count = alloc_count.load() - t.start_count;
+  uint64_t bytes = alloc_bytes.load() - t.start_bytes;
+  uint64_t lib_count = alloc_lib_count.load() - t.start_lib_count;
+  printf("Allocation test: %llu allocations by C libraries (X, GL)\n",
+         (unsigned long long)lib_count);
+  if (count == 0) {
+    printf("Allocation test passed: no allocations in %d frames\n",
+           ALLOC_TEST_FRAMES);
+    return 0;
+  }
+  fprintf(stderr,
+          "Allocation test failed: %llu allocations (%llu bytes) in %d "
+          "frames after warm-up\n",
+          (unsigned long long)count, (unsigned long long)bytes,
+          ALLOC_TEST_FRAMES);
+  return 1;
+}
+
+#else
+
+static void count_thread_allocations() {}
+
+static int alloc_test_frame(AllocTest &) {
+  fprintf(stderr, "Built without the allocation test, configure with "
+                  "-DENABLE_ALLOC_TEST=ON\n");
+  return 1;
+}
+
+#endif
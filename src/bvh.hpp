@@ -0,0 +1,231 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+// Bounding volume hierarchy over axis aligned boxes, used to pick and cull
+// panels without walking all of them every frame.
+//
+// Built top down by splitting at the median centroid along the widest axis.
+// Nodes live in one flat array; queries walk it with a fixed size stack and
+// don't allocate, only build() does.
+
+#define BVH_LEAF_SIZE 4
+#define BVH_MAX_DEPTH 64
+
+struct Aabb {
+  float min[3], max[3];
+};
+
+static Aabb aabb_empty() {
+  return {{FLT_MAX, FLT_MAX, FLT_MAX}, {-FLT_MAX, -FLT_MAX, -FLT_MAX}};
+}
+
+static void aabb_grow(Aabb &box, const float p[3]) {
+  for (int i = 0; i < 3; i++) {
+    box.min[i] = std::min(box.min[i], p[i]);
+    box.max[i] = std::max(box.max[i], p[i]);
+  }
+}
+
+static void aabb_merge(Aabb &box, const Aabb &other) {
+  aabb_grow(box, other.min);
+  aabb_grow(box, other.max);
+}
+
+// Slab test. Returns the entry distance in `t_near`.
+static bool aabb_ray(const Aabb &box, const float origin[3],
+                     const float inv_dir[3], float t_max, float &t_near) {
+  float t0 = 0.0f, t1 = t_max;
+  for (int i = 0; i < 3; i++) {
+    float a = (box.min[i] - origin[i]) * inv_dir[i];
+    float b = (box.max[i] - origin[i]) * inv_dir[i];
+    if (a > b)
+      std::swap(a, b);
+    t0 = std::max(t0, a);
+    t1 = std::min(t1, b);
+    if (t0 > t1)
+      return false;
+  }
+  t_near = t0;
+  return true;
+}
+
+// Planes as (a, b, c, d) with inside meaning a*x + b*y + c*z + d >= 0.
+static bool aabb_in_frustum(const Aabb &box, const float planes[6][4]) {
+  for (int i = 0; i < 6; i++) {
+    const float *p = planes[i];
+    // Corner furthest along the plane normal.
+    float x = p[0] >= 0 ? box.max[0] : box.min[0];
+    float y = p[1] >= 0 ? box.max[1] : box.min[1];
+    float z = p[2] >= 0 ? box.max[2] : box.min[2];
+    if (p[0] * x + p[1] * y + p[2] * z + p[3] < 0)
+      return false;
+  }
+  return true;
+}
+
+// Extracts the view frustum planes from column-major projection and
+// modelview matrices as returned by glGetFloatv.
+static void frustum_planes(const float proj[16], const float modelview[16],
+                           float planes[6][4]) {
+  float m[16];
+  for (int c = 0; c < 4; c++) {
+    for (int r = 0; r < 4; r++) {
+      float v = 0;
+      for (int k = 0; k < 4; k++)
+        v += proj[k * 4 + r] * modelview[c * 4 + k];
+      m[c * 4 + r] = v;
+    }
+  }
+
+  // Row i of the clip matrix.
+  auto row = [&](int i, int c) { return m[c * 4 + i]; };
+  for (int p = 0; p < 6; p++) {
+    int axis = p / 2;
+    float sign = (p % 2 == 0) ? 1.0f : -1.0f;
+    for (int c = 0; c < 4; c++) {
+      planes[p][c] = row(3, c) + sign * row(axis, c);
+    }
+  }
+}
+
+struct BvhNode {
+  Aabb box;
+  // Internal nodes: index of the left child, the right one follows it.
+  // Leaves: first index into Bvh::items.
+  int first;
+  // 0 for internal nodes.
+  int count;
+};
+
+struct Bvh {
+  std::vector<BvhNode> nodes;
+  // Item indices, reordered so every leaf covers a contiguous range.
+  std::vector<int> items;
+  std::vector<Aabb> boxes;
+};
+
+// Fills node `index` with the items in [begin, end).
+static void bvh_build_node(Bvh &bvh, int index, int begin, int end,
+                           int depth) {
+  Aabb box = aabb_empty();
+  Aabb centroids = aabb_empty();
+  for (int i = begin; i < end; i++) {
+    const Aabb &b = bvh.boxes[bvh.items[i]];
+    aabb_merge(box, b);
+    float c[3] = {(b.min[0] + b.max[0]) / 2, (b.min[1] + b.max[1]) / 2,
+                  (b.min[2] + b.max[2]) / 2};
+    aabb_grow(centroids, c);
+  }
+  bvh.nodes[index].box = box;
+
+  if (end - begin <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1) {
+    bvh.nodes[index].first = begin;
+    bvh.nodes[index].count = end - begin;
+    return;
+  }
+
+  int axis = 0;
+  for (int i = 1; i < 3; i++) {
+    if (centroids.max[i] - centroids.min[i] >
+        centroids.max[axis] - centroids.min[axis])
+      axis = i;
+  }
+
+  int mid = (begin + end) / 2;
+  std::nth_element(bvh.items.begin() + begin, bvh.items.begin() + mid,
+                   bvh.items.begin() + end, [&](int a, int b) {
+                     const Aabb &ba = bvh.boxes[a];
+                     const Aabb &bb = bvh.boxes[b];
+                     return ba.min[axis] + ba.max[axis] <
+                            bb.min[axis] + bb.max[axis];
+                   });
+
+  // Both children are allocated up front so they sit next to each other.
+  int left = int(bvh.nodes.size());
+  bvh.nodes.push_back({});
+  bvh.nodes.push_back({});
+  bvh.nodes[index].first = left;
+  bvh.nodes[index].count = 0;
+  bvh_build_node(bvh, left, begin, mid, depth + 1);
+  bvh_build_node(bvh, left + 1, mid, end, depth + 1);
+}
+
+static void build_bvh(Bvh &bvh, const Aabb *boxes, int n) {
+  bvh.nodes.clear();
+  bvh.boxes.assign(boxes, boxes + n);
+  bvh.items.resize(n);
+  for (int i = 0; i < n; i++)
+    bvh.items[i] = i;
+  if (n > 0) {
+    bvh.nodes.push_back({});
+    bvh_build_node(bvh, 0, 0, n, 0);
+  }
+}
+
+// Closest item whose exact test passes. `hit(item, t)` does the exact test
+// and returns the distance along the ray in `t`. Returns -1 on a miss.
+template <typename F>
+static int bvh_pick(const Bvh &bvh, const float origin[3], const float dir[3],
+                    F hit) {
+  if (bvh.nodes.empty())
+    return -1;
+
+  float inv_dir[3];
+  for (int i = 0; i < 3; i++)
+    inv_dir[i] = dir[i] != 0.0f ? 1.0f / dir[i] : FLT_MAX;
+
+  int best = -1;
+  float best_t = FLT_MAX;
+  int stack[BVH_MAX_DEPTH * 2];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const BvhNode &node = bvh.nodes[stack[--top]];
+    float t_near;
+    if (!aabb_ray(node.box, origin, inv_dir, best_t, t_near))
+      continue;
+
+    if (node.count > 0) {
+      for (int i = node.first; i < node.first + node.count; i++) {
+        float t;
+        if (hit(bvh.items[i], t) && t < best_t) {
+          best_t = t;
+          best = bvh.items[i];
+        }
+      }
+    } else {
+      stack[top++] = node.first;
+      stack[top++] = node.first + 1;
+    }
+  }
+  return best;
+}
+
+// Calls `visit(item)` for every item whose box intersects the frustum.
+template <typename F>
+static void bvh_cull(const Bvh &bvh, const float planes[6][4], F visit) {
+  if (bvh.nodes.empty())
+    return;
+
+  int stack[BVH_MAX_DEPTH * 2];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const BvhNode &node = bvh.nodes[stack[--top]];
+    if (!aabb_in_frustum(node.box, planes))
+      continue;
+
+    if (node.count > 0) {
+      for (int i = node.first; i < node.first + node.count; i++) {
+        if (aabb_in_frustum(bvh.boxes[bvh.items[i]], planes))
+          visit(bvh.items[i]);
+      }
+    } else {
+      stack[top++] = node.first;
+      stack[top++] = node.first + 1;
+    }
+  }
+}
@@ -0,0 +1,524 @@
+#pragma once
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <stdint.h>
+
+#include "clock.hpp"
+#include "damage.hpp"
+#include "pixel_format.hpp"
+
+// One desktop capture shared by several viewers.
+//
+// A process started with --capture-daemon grabs the root window straight
+// into a SysV shared memory segment holding CAPTURE_SHM_BUFFERS frames,
+// frame n going to buffer n % CAPTURE_SHM_BUFFERS. Viewers started with
+// --capture-client connect to its Unix socket and pass it an eventfd
+// (SCM_RIGHTS), which the daemon signals after every frame; the daemon
+// answers with the segment id.
+//
+// Each buffer has a sequence counter that is odd while the daemon writes
+// it, plus the region that changed since the previous frame. Clients keep
+// a private copy of the desktop and only copy over what changed since the
+// frame they have, so the X server sees one grab however many viewers run.
+
+#define CAPTURE_SOCKET_PATH "/tmp/viture_capture.sock"
+#define CAPTURE_SHM_MAGIC 0x50414356u // "VCAP"
+#define CAPTURE_SHM_VERSION 1
+#define CAPTURE_SHM_BUFFERS 3
+#define CAPTURE_MAX_CLIENTS 8
+#define CAPTURE_RECONNECT_NS 1000000000LL
+
+struct CaptureFrameInfo {
+  std::atomic<uint64_t> seq;
+  uint64_t generation;
+  int32_t width, height, stride;
+  // Changed since frame `generation - 1`.
+  DirtyRegion dirty;
+};
+
+struct CaptureShmHeader {
+  uint32_t magic, version;
+  // PixelFormat::name of the pixels.
+  char format[16];
+  // Buffer i starts at data_offset + i * buffer_size.
+  uint64_t data_offset, buffer_size;
+  // Newest complete frame, 0 before the first.
+  std::atomic<uint64_t> latest;
+  // Set when the daemon gives up the segment, clients should reconnect.
+  std::atomic<uint32_t> closed;
+  CaptureFrameInfo frames[CAPTURE_SHM_BUFFERS];
+};
+
+struct CaptureHello {
+  uint32_t magic, version;
+  int32_t shmid;
+};
+
+// Sends `fd` along with one byte.
+static bool send_fd(int sock, int fd) {
+  char byte = 0;
+  iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+// Returns the received fd or -1.
+static int recv_fd(int sock) {
+  char byte;
+  iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+    return -1;
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    return -1;
+  }
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+static void set_socket_timeout(int sock, int ms) {
+  timeval tv = {ms / 1000, (ms % 1000) * 1000};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Daemon side.
+
+struct CaptureDaemon {
+  Display *dpy;
+  Visual *visual;
+  int depth;
+  const PixelFormat *format;
+
+  int listen_fd;
+  int client_fd[CAPTURE_MAX_CLIENTS];
+  int event_fd[CAPTURE_MAX_CLIENTS];
+  int client_count;
+
+  XShmSegmentInfo shm;
+  CaptureShmHeader *header;
+  XImage *images[CAPTURE_SHM_BUFFERS];
+  int width, height;
+  uint64_t generation;
+};
+
+static void free_capture_images(CaptureDaemon &d) {
+  for (XImage *&img : d.images) {
+    if (!img)
+      continue;
+    // They don't own their data, it is in the segment.
+    img->data = nullptr;
+    XDestroyImage(img);
+    img = nullptr;
+  }
+}
+
+static void destroy_capture_segment(CaptureDaemon &d) {
+  if (!d.header)
+    return;
+  d.header->closed = 1;
+  XShmDetach(d.dpy, &d.shm);
+  XSync(d.dpy, False);
+  free_capture_images(d);
+  shmdt(d.shm.shmaddr);
+  d.header = nullptr;
+}
+
+static void drop_capture_client(CaptureDaemon &d, int i) {
+  close(d.client_fd[i]);
+  close(d.event_fd[i]);
+  d.client_count--;
+  d.client_fd[i] = d.client_fd[d.client_count];
+  d.event_fd[i] = d.event_fd[d.client_count];
+}
+
+// A segment for `width` x `height` frames. Clients of the previous one are
+// dropped, they reconnect to the new one.
+static bool create_capture_segment(CaptureDaemon &d, int width, int height) {
+  destroy_capture_segment(d);
+  while (d.client_count > 0)
+    drop_capture_client(d, 0);
+
+  size_t buffer_size = 0;
+  for (XImage *&img : d.images) {
+    img = XShmCreateImage(d.dpy, d.visual, d.depth, ZPixmap, nullptr, &d.shm,
+                          width, height);
+    if (!img) {
+      fprintf(stderr, "XShmCreateImage failed\n");
+      free_capture_images(d);
+      return false;
+    }
+    buffer_size = size_t(img->bytes_per_line) * height;
+  }
+  // Buffers page aligned after the header.
+  size_t data_offset = (sizeof(CaptureShmHeader) + 4095) & ~size_t(4095);
+  size_t size = data_offset + buffer_size * CAPTURE_SHM_BUFFERS;
+
+  d.shm.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+  if (d.shm.shmid < 0) {
+    perror("shmget capture segment");
+    free_capture_images(d);
+    return false;
+  }
+  d.shm.shmaddr = (char *)shmat(d.shm.shmid, 0, 0);
+  // Freed once everyone detached, or right away if attaching failed. Linux
+  // still lets clients attach by id.
+  shmctl(d.shm.shmid, IPC_RMID, 0);
+  if (d.shm.shmaddr == (char *)-1) {
+    perror("shmat capture segment");
+    free_capture_images(d);
+    return false;
+  }
+  d.shm.readOnly = False;
+  if (!XShmAttach(d.dpy, &d.shm)) {
+    fprintf(stderr, "XShmAttach failed\n");
+    shmdt(d.shm.shmaddr);
+    free_capture_images(d);
+    return false;
+  }
+  XSync(d.dpy, False);
+
+  d.header = new (d.shm.shmaddr) CaptureShmHeader();
+  d.header->magic = CAPTURE_SHM_MAGIC;
+  d.header->version = CAPTURE_SHM_VERSION;
+  strncpy(d.header->format, d.format->name, sizeof(d.header->format) - 1);
+  d.header->data_offset = data_offset;
+  d.header->buffer_size = buffer_size;
+  for (int i = 0; i < CAPTURE_SHM_BUFFERS; i++) {
+    d.images[i]->data = d.shm.shmaddr + data_offset + i * buffer_size;
+  }
+  d.width = width;
+  d.height = height;
+  d.generation = 0;
+  printf("Capture segment %d: %dx%d, %d buffers of %zu bytes\n",
+         d.shm.shmid, width, height, CAPTURE_SHM_BUFFERS, buffer_size);
+  return true;
+}
+
+static bool init_capture_daemon(CaptureDaemon &d, Display *dpy,
+                                const PixelFormat *format, const char *path) {
+  int screen = DefaultScreen(dpy);
+  d.dpy = dpy;
+  d.visual = DefaultVisual(dpy, screen);
+  d.depth = DefaultDepth(dpy, screen);
+  d.format = format;
+
+  d.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (d.listen_fd < 0) {
+    perror("socket");
+    return false;
+  }
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  if (bind(d.listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(d.listen_fd, CAPTURE_MAX_CLIENTS) < 0) {
+    perror("capture socket");
+    close(d.listen_fd);
+    d.listen_fd = -1;
+    return false;
+  }
+  return create_capture_segment(d, DisplayWidth(dpy, screen),
+                                DisplayHeight(dpy, screen));
+}
+
+// Takes in new clients and drops the ones that went away. Returns true if
+// a client joined.
+static bool service_capture_clients(CaptureDaemon &d) {
+  for (int i = 0; i < d.client_count;) {
+    pollfd p = {d.client_fd[i], POLLIN, 0};
+    char byte;
+    if (poll(&p, 1, 0) > 0 &&
+        ((p.revents & (POLLHUP | POLLERR)) ||
+         recv(d.client_fd[i], &byte, 1, MSG_DONTWAIT) <= 0)) {
+      printf("Capture client left (%d left)\n", d.client_count - 1);
+      drop_capture_client(d, i);
+    } else {
+      i++;
+    }
+  }
+
+  bool joined = false;
+  int fd;
+  while ((fd = accept4(d.listen_fd, nullptr, nullptr, SOCK_CLOEXEC)) >= 0) {
+    // The client sends its eventfd right after connecting.
+    set_socket_timeout(fd, 500);
+    int efd = recv_fd(fd);
+    CaptureHello hello = {CAPTURE_SHM_MAGIC, CAPTURE_SHM_VERSION,
+                          d.shm.shmid};
+    if (efd < 0 || d.client_count == CAPTURE_MAX_CLIENTS ||
+        send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+      fprintf(stderr, "Rejected capture client\n");
+      if (efd >= 0)
+        close(efd);
+      close(fd);
+      continue;
+    }
+    d.client_fd[d.client_count] = fd;
+    d.event_fd[d.client_count] = efd;
+    d.client_count++;
+    joined = true;
+    printf("Capture client joined (%d connected)\n", d.client_count);
+  }
+  return joined;
+}
+
+// The image to grab the next frame into, recreating the segment if the
+// desktop changed size.
+static XImage *begin_capture_frame(CaptureDaemon &d, int width, int height) {
+  if ((width != d.width || height != d.height) &&
+      !create_capture_segment(d, width, height)) {
+    return nullptr;
+  }
+  uint64_t generation = d.generation + 1;
+  CaptureFrameInfo &f = d.header->frames[generation % CAPTURE_SHM_BUFFERS];
+  f.seq.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  return d.images[generation % CAPTURE_SHM_BUFFERS];
+}
+
+// Publishes the frame grabbed since begin_capture_frame() and wakes the
+// clients. `dirty` is what changed since the previous frame.
+static void end_capture_frame(CaptureDaemon &d, const DirtyRegion &dirty) {
+  uint64_t generation = ++d.generation;
+  int index = generation % CAPTURE_SHM_BUFFERS;
+  CaptureFrameInfo &f = d.header->frames[index];
+  f.generation = generation;
+  f.width = d.width;
+  f.height = d.height;
+  f.stride = d.images[index]->bytes_per_line;
+  f.dirty = dirty;
+  f.seq.fetch_add(1, std::memory_order_release);
+  d.header->latest.store(generation, std::memory_order_release);
+
+  uint64_t one = 1;
+  for (int i = 0; i < d.client_count; i++) {
+    if (write(d.event_fd[i], &one, sizeof(one)) < 0 && errno != EAGAIN)
+      perror("eventfd write");
+  }
+}
+
+static void destroy_capture_daemon(CaptureDaemon &d) {
+  while (d.client_count > 0)
+    drop_capture_client(d, 0);
+  destroy_capture_segment(d);
+  if (d.listen_fd >= 0)
+    close(d.listen_fd);
+}
+
+// Client side.
+
+enum CaptureFetch {
+  CAPTURE_FETCH_NONE,
+  CAPTURE_FETCH_UPDATED,
+  // The frame changed size, resize the destination and call again.
+  CAPTURE_FETCH_RESIZED,
+};
+
+struct CaptureClient {
+  const char *path;
+  const char *format;
+  // Ours for the whole run, handed to every daemon we connect to.
+  int event_fd = -1;
+  int sock = -1;
+  const CaptureShmHeader *header;
+  const uint8_t *shm;
+  int64_t next_connect_ns;
+  // Frame our copy is at, 0 if it needs a full copy.
+  uint64_t generation;
+};
+
+static void disconnect_capture_client(CaptureClient &c) {
+  if (c.shm) {
+    shmdt(c.shm);
+    c.shm = nullptr;
+    c.header = nullptr;
+  }
+  if (c.sock >= 0) {
+    close(c.sock);
+    c.sock = -1;
+  }
+  c.generation = 0;
+  c.next_connect_ns = monotonic_ns() + CAPTURE_RECONNECT_NS;
+}
+
+static bool connect_capture_client(CaptureClient &c) {
+  c.sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, c.path, sizeof(addr.sun_path) - 1);
+  set_socket_timeout(c.sock, 500);
+
+  CaptureHello hello;
+  if (connect(c.sock, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      !send_fd(c.sock, c.event_fd) ||
+      recv(c.sock, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) ||
+      hello.magic != CAPTURE_SHM_MAGIC ||
+      hello.version != CAPTURE_SHM_VERSION) {
+    disconnect_capture_client(c);
+    return false;
+  }
+
+  void *shm = shmat(hello.shmid, nullptr, SHM_RDONLY);
+  if (shm == (void *)-1) {
+    perror("shmat capture segment");
+    disconnect_capture_client(c);
+    return false;
+  }
+  c.shm = (const uint8_t *)shm;
+  c.header = (const CaptureShmHeader *)shm;
+  if (strncmp(c.header->format, c.format, sizeof(c.header->format)) != 0) {
+    fprintf(stderr, "Capture daemon sends %.16s, we need %s\n",
+            c.header->format, c.format);
+    disconnect_capture_client(c);
+    return false;
+  }
+  printf("Connected to capture daemon at %s\n", c.path);
+  return true;
+}
+
+static bool init_capture_client(CaptureClient &c, const char *path,
+                                const PixelFormat *format) {
+  c.path = path;
+  c.format = format->name;
+  c.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (c.event_fd < 0) {
+    perror("eventfd");
+    return false;
+  }
+  if (!connect_capture_client(c))
+    printf("Waiting for the capture daemon at %s\n", path);
+  return true;
+}
+
+// Reads the dirty region of frame `generation` into `out`. False if the
+// daemon is rewriting that buffer.
+static bool read_frame_dirty(const CaptureShmHeader *h, uint64_t generation,
+                             DirtyRegion &out) {
+  const CaptureFrameInfo &f = h->frames[generation % CAPTURE_SHM_BUFFERS];
+  uint64_t seq = f.seq.load(std::memory_order_acquire);
+  if ((seq & 1) || f.generation != generation)
+    return false;
+  DirtyRegion dirty = f.dirty;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (f.seq.load(std::memory_order_relaxed) != seq)
+    return false;
+  dirty_region_add_region(out, dirty);
+  return true;
+}
+
+// Brings `dst`, our copy of the desktop, up to the newest frame and sets
+// `dirty` to what changed. If the frame doesn't fit `dst` (or there is no
+// `dst` yet) its size goes to `width` and `height` and nothing is copied.
+// Never blocks.
+static CaptureFetch fetch_capture_frame(CaptureClient &c, XImage *dst,
+                                        DirtyRegion &dirty, int &width,
+                                        int &height) {
+  dirty.count = 0;
+  uint64_t drained;
+  if (read(c.event_fd, &drained, sizeof(drained)) < 0 && errno != EAGAIN)
+    perror("eventfd read");
+
+  if (c.header && c.header->closed) {
+    printf("Capture daemon went away\n");
+    disconnect_capture_client(c);
+  }
+  if (!c.header && (monotonic_ns() < c.next_connect_ns ||
+                    !connect_capture_client(c))) {
+    return CAPTURE_FETCH_NONE;
+  }
+
+  const CaptureShmHeader *h = c.header;
+  uint64_t latest = h->latest.load(std::memory_order_acquire);
+  if (latest == 0 || latest == c.generation)
+    return CAPTURE_FETCH_NONE;
+  const CaptureFrameInfo &f = h->frames[latest % CAPTURE_SHM_BUFFERS];
+  uint64_t seq = f.seq.load(std::memory_order_acquire);
+  // Lapped by the daemon, try again next time.
+  if ((seq & 1) || f.generation != latest)
+    return CAPTURE_FETCH_NONE;
+  width = f.width;
+  height = f.height;
+  if (!dst || dst->width != width || dst->height != height) {
+    c.generation = 0;
+    return CAPTURE_FETCH_RESIZED;
+  }
+
+  // What changed since our copy, or everything if we're too far behind.
+  bool partial = c.generation != 0 &&
+                 latest - c.generation < CAPTURE_SHM_BUFFERS;
+  for (uint64_t g = c.generation + 1; partial && g <= latest; g++)
+    partial = read_frame_dirty(h, g, dirty);
+  if (!partial) {
+    dirty.count = 0;
+    dirty_region_add(dirty, {0, 0, width, height});
+  }
+
+  const uint8_t *src = c.shm + h->data_offset +
+                       (latest % CAPTURE_SHM_BUFFERS) * h->buffer_size;
+  int bpp = dst->bits_per_pixel / 8;
+  for (int i = 0; i < dirty.count; i++) {
+    DirtyRect r = dirty.rects[i];
+    int x0 = std::max(r.x, 0), x1 = std::min(r.x + r.width, width);
+    int y0 = std::max(r.y, 0), y1 = std::min(r.y + r.height, height);
+    if (x1 <= x0)
+      continue;
+    for (int y = y0; y < y1; y++) {
+      memcpy(dst->data + y * dst->bytes_per_line + x0 * bpp,
+             src + y * f.stride + x0 * bpp, size_t(x1 - x0) * bpp);
+    }
+  }
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (f.seq.load(std::memory_order_relaxed) != seq) {
+    // Torn, our copy is a mix now. Start over from a full copy.
+    c.generation = 0;
+    return CAPTURE_FETCH_NONE;
+  }
+  c.generation = latest;
+  return CAPTURE_FETCH_UPDATED;
+}
+
+static void destroy_capture_client(CaptureClient &c) {
+  disconnect_capture_client(c);
+  if (c.event_fd >= 0) {
+    close(c.event_fd);
+    c.event_fd = -1;
+  }
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// Monotonic host time in nanoseconds. Everything that needs to correlate
+// timestamps across threads (IMU samples, GPU queries, frame records) uses
+// this clock.
+static int64_t monotonic_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
@@ -1,13 +1,12 @@
 #pragma once
 
 #include <cstdio>
+#include <cstring>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
-#include <string>
-
 #define SOCKET_PATH "/tmp/viture_ar.sock"
 
 // After creating socket `sockfd` as before:
@@ -47,49 +46,58 @@ static void (*on_zoom_out_command)(void) = nullptr;
 static void (*on_shift_left_command)(void) = nullptr;
 static void (*on_shift_right_command)(void) = nullptr;
 static void (*on_toggle_center_dot_command)(void) = nullptr;
+// Gets whatever follows the command word, possibly "".
+static void (*on_trace_dump_command)(const char *args) = nullptr;
 
-static void poll_commands(int sockfd) {
+// Returns true if a command was received.
+static bool poll_commands(int sockfd) {
   char buf[256];
 
   ssize_t len = recv(sockfd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
   if (len > 0) {
     buf[len] = '\0';
-    std::string cmd(buf);
+    const char *cmd = buf;
 
-    if (cmd == "align") {
+    if (strcmp(cmd, "align") == 0) {
       if (on_align_command != nullptr) {
         on_align_command();
       }
-    } else if (cmd == "push") {
+    } else if (strcmp(cmd, "push") == 0) {
       if (on_push_command != nullptr) {
         on_push_command();
       }
-    } else if (cmd == "pop") {
+    } else if (strcmp(cmd, "pop") == 0) {
       if (on_pop_command != nullptr) {
         on_pop_command();
       }
-    } else if (cmd == "zoom_in") {
+    } else if (strcmp(cmd, "zoom_in") == 0) {
       if (on_zoom_in_command != nullptr) {
         on_zoom_in_command();
       }
-    } else if (cmd == "zoom_out") {
+    } else if (strcmp(cmd, "zoom_out") == 0) {
       if (on_zoom_out_command != nullptr) {
         on_zoom_out_command();
       }
-    } else if (cmd == "shift_left") {
+    } else if (strcmp(cmd, "shift_left") == 0) {
       if (on_shift_left_command != nullptr) {
         on_shift_left_command();
       }
-    } else if (cmd == "shift_right") {
+    } else if (strcmp(cmd, "shift_right") == 0) {
       if (on_shift_right_command != nullptr) {
         on_shift_right_command();
       }
-    } else if (cmd == "center_dot_toggle") {
+    } else if (strcmp(cmd, "center_dot_toggle") == 0) {
       if (on_toggle_center_dot_command != nullptr) {
         on_toggle_center_dot_command();
       }
+    } else if (strcmp(cmd, "trace_dump") == 0 ||
+               strncmp(cmd, "trace_dump ", 11) == 0) {
+      if (on_trace_dump_command != nullptr) {
+        on_trace_dump_command(buf + strlen("trace_dump"));
+      }
     }
   }
+  return len > 0;
 }
 
 static void destroy_command_socket(int sockfd) {
@@ -0,0 +1,433 @@
+#pragma once
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "mat4.hpp"
+#include "scene.hpp"
+
+// Render backend for machines without a usable GPU.
+//
+// Projects the scene's textured quads straight from the captured desktop
+// image into an XShm image that is put on the output window, no GL
+// involved. The screen is split into tiles that a small worker pool
+// rasterizes in parallel. Every quad is planar, so screen position maps to
+// its (s, t) parameters through a single homography: per pixel that is three
+// dot products stepped incrementally, one division and a bilinear fetch,
+// with the filtering done in SSE2 lanes. The homography's denominator is
+// 1/w, which doubles as the depth value.
+//
+// Expects both the desktop and the output in 32-bit BGRA.
+
+#define CPU_TILE_SIZE 64
+#define CPU_MAX_WORKERS 15
+
+struct CpuTexture {
+  const uint8_t *data;
+  int width, height, stride;
+};
+
+// A quad prepared for rasterizing.
+struct CpuQuad {
+  // Rows give s, t and 1/w (all scaled by w) for pixel (x, y, 1).
+  float h[3][3];
+  // Screen bounds, exclusive at the end.
+  int x0, y0, x1, y1;
+  float u0, v0, du, dv;
+};
+
+struct CpuRenderer {
+  Display *dpy;
+  Window win;
+  GC gc;
+  XImage *img;
+  XShmSegmentInfo shm;
+  int width, height;
+  int tiles_x, tiles_y;
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable start_cv, done_cv;
+  uint64_t frame;
+  int busy;
+  bool quit;
+  std::atomic<int> next_tile{0};
+
+  // Current frame, written before the workers are started.
+  std::vector<CpuQuad> quads;
+  CpuTexture tex;
+};
+
+static inline uint32_t cpu_sample_bilinear(const CpuTexture &t, float fx,
+                                           float fy) {
+  fx = std::min(std::max(fx, 0.0f), float(t.width - 1));
+  fy = std::min(std::max(fy, 0.0f), float(t.height - 1));
+  int x0 = int(fx), y0 = int(fy);
+  int x1 = std::min(x0 + 1, t.width - 1);
+  int y1 = std::min(y0 + 1, t.height - 1);
+  // 7 bit weights keep the products inside 16-bit lanes.
+  int ax = int((fx - x0) * 128.0f);
+  int ay = int((fy - y0) * 128.0f);
+
+  const uint32_t *row0 = (const uint32_t *)(t.data + y0 * t.stride);
+  const uint32_t *row1 = (const uint32_t *)(t.data + y1 * t.stride);
+
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128();
+  // Left texel in the low four lanes, right texel in the high four.
+  __m128i top =
+      _mm_unpacklo_epi8(_mm_set_epi32(0, 0, row0[x1], row0[x0]), zero);
+  __m128i bottom =
+      _mm_unpacklo_epi8(_mm_set_epi32(0, 0, row1[x1], row1[x0]), zero);
+  __m128i col = _mm_add_epi16(
+      top, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(bottom, top),
+                                          _mm_set1_epi16(short(ay))),
+                          7));
+  __m128i right = _mm_srli_si128(col, 8);
+  __m128i px = _mm_add_epi16(
+      col, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(right, col),
+                                          _mm_set1_epi16(short(ax))),
+                          7));
+  return uint32_t(_mm_cvtsi128_si32(_mm_packus_epi16(px, zero))) |
+         0xff000000u;
+#else
+  uint32_t out = 0xff000000u;
+  for (int shift = 0; shift < 24; shift += 8) {
+    int p00 = (row0[x0] >> shift) & 0xff, p01 = (row0[x1] >> shift) & 0xff;
+    int p10 = (row1[x0] >> shift) & 0xff, p11 = (row1[x1] >> shift) & 0xff;
+    int left = p00 + (((p10 - p00) * ay) >> 7);
+    int right = p01 + (((p11 - p01) * ay) >> 7);
+    out |= uint32_t(left + (((right - left) * ax) >> 7)) << shift;
+  }
+  return out;
+#endif
+}
+
+// Narrows [x0, x1) to the part of a row inside the quad and in front of the
+// eye. Along a row s, t and 1/w are all linear in x, so each bound is a
+// single inequality.
+static inline bool cpu_quad_span(const CpuQuad &q, float sn0, float tn0,
+                                 float wn0, int x0, int x1, int &sx0,
+                                 int &sx1) {
+  float lo = float(x0), hi = float(x1 - 1);
+  // f0 + fx * x >= 0 for: 1/w > 0, s >= 0, s <= 1, t >= 0, t <= 1.
+  const float f0[5] = {wn0, sn0, wn0 - sn0, tn0, wn0 - tn0};
+  const float fx[5] = {q.h[2][0], q.h[0][0], q.h[2][0] - q.h[0][0],
+                       q.h[1][0], q.h[2][0] - q.h[1][0]};
+  for (int i = 0; i < 5; i++) {
+    if (fx[i] == 0.0f) {
+      if (f0[i] < 0.0f)
+        return false;
+    } else if (fx[i] > 0.0f) {
+      lo = std::max(lo, -f0[i] / fx[i]);
+    } else {
+      hi = std::min(hi, -f0[i] / fx[i]);
+    }
+  }
+  if (lo > hi)
+    return false;
+  sx0 = int(ceilf(lo));
+  sx1 = int(floorf(hi)) + 1;
+  return sx0 < sx1;
+}
+
+static void cpu_raster_tile(CpuRenderer &r, int tile) {
+  int tx0 = (tile % r.tiles_x) * CPU_TILE_SIZE;
+  int ty0 = (tile / r.tiles_x) * CPU_TILE_SIZE;
+  int tx1 = std::min(tx0 + CPU_TILE_SIZE, r.width);
+  int ty1 = std::min(ty0 + CPU_TILE_SIZE, r.height);
+
+  // 1/w of the nearest quad so far, 0 is infinitely far away.
+  float depth[CPU_TILE_SIZE * CPU_TILE_SIZE];
+  for (int y = ty0; y < ty1; y++) {
+    uint32_t *row = (uint32_t *)(r.img->data + y * r.img->bytes_per_line);
+    std::fill(row + tx0, row + tx1, 0xff000000u);
+    std::fill(depth + (y - ty0) * CPU_TILE_SIZE,
+              depth + (y - ty0) * CPU_TILE_SIZE + (tx1 - tx0), 0.0f);
+  }
+  if (r.tex.data == nullptr)
+    return;
+
+  for (const CpuQuad &q : r.quads) {
+    int x0 = std::max(tx0, q.x0), x1 = std::min(tx1, q.x1);
+    int y0 = std::max(ty0, q.y0), y1 = std::min(ty1, q.y1);
+    if (x0 >= x1 || y0 >= y1)
+      continue;
+
+    float tex_w = r.tex.width, tex_h = r.tex.height;
+    for (int y = y0; y < y1; y++) {
+      float sn0 = q.h[0][1] * y + q.h[0][2];
+      float tn0 = q.h[1][1] * y + q.h[1][2];
+      float wn0 = q.h[2][1] * y + q.h[2][2];
+      int sx0, sx1;
+      if (!cpu_quad_span(q, sn0, tn0, wn0, x0, x1, sx0, sx1))
+        continue;
+
+      uint32_t *row = (uint32_t *)(r.img->data + y * r.img->bytes_per_line);
+      float *zrow = depth + (y - ty0) * CPU_TILE_SIZE - tx0;
+      float sn = sn0 + q.h[0][0] * sx0;
+      float tn = tn0 + q.h[1][0] * sx0;
+      float wn = wn0 + q.h[2][0] * sx0;
+      for (int x = sx0; x < sx1;
+           x++, sn += q.h[0][0], tn += q.h[1][0], wn += q.h[2][0]) {
+        if (wn <= zrow[x])
+          continue;
+        float inv = 1.0f / wn;
+        zrow[x] = wn;
+        row[x] = cpu_sample_bilinear(
+            r.tex, (q.u0 + sn * inv * q.du) * tex_w - 0.5f,
+            (q.v0 + tn * inv * q.dv) * tex_h - 0.5f);
+      }
+    }
+  }
+}
+
+static void cpu_raster_tiles(CpuRenderer &r) {
+  int count = r.tiles_x * r.tiles_y;
+  for (int tile = r.next_tile++; tile < count; tile = r.next_tile++) {
+    cpu_raster_tile(r, tile);
+  }
+}
+
+static void cpu_worker_main(CpuRenderer *r) {
+  uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(r->mutex);
+      r->start_cv.wait(lock, [&] { return r->quit || r->frame != seen; });
+      if (r->quit)
+        return;
+      seen = r->frame;
+    }
+    cpu_raster_tiles(*r);
+    {
+      std::lock_guard<std::mutex> lock(r->mutex);
+      if (--r->busy == 0)
+        r->done_cv.notify_one();
+    }
+  }
+}
+
+// Before the segment is attached to the X server.
+static void free_cpu_output_image(CpuRenderer &r) {
+  if (r.img) {
+    XDestroyImage(r.img);
+    r.img = nullptr;
+  }
+}
+
+// `visual` and `depth` must be the output window's.
+static bool init_cpu_renderer(CpuRenderer &r, Display *dpy, Window win,
+                              Visual *visual, int depth, int width,
+                              int height) {
+  r.dpy = dpy;
+  r.win = win;
+  r.width = width;
+  r.height = height;
+  r.tiles_x = (width + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+  r.tiles_y = (height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+
+  r.img = XShmCreateImage(dpy, visual, depth, ZPixmap, NULL, &r.shm, width,
+                          height);
+  if (!r.img || r.img->bits_per_pixel != 32) {
+    fprintf(stderr, "CPU renderer needs a 32-bit output visual\n");
+    free_cpu_output_image(r);
+    return false;
+  }
+  r.shm.shmid =
+      shmget(IPC_PRIVATE, r.img->bytes_per_line * height, IPC_CREAT | 0600);
+  if (r.shm.shmid < 0) {
+    perror("shmget cpu output");
+    free_cpu_output_image(r);
+    return false;
+  }
+  r.shm.shmaddr = (char *)shmat(r.shm.shmid, 0, 0);
+  // Freed once everyone detached, or right away if attaching failed.
+  shmctl(r.shm.shmid, IPC_RMID, 0);
+  if (r.shm.shmaddr == (char *)-1) {
+    perror("shmat cpu output");
+    free_cpu_output_image(r);
+    return false;
+  }
+  r.img->data = r.shm.shmaddr;
+  r.shm.readOnly = True;
+  if (!XShmAttach(dpy, &r.shm)) {
+    fprintf(stderr, "XShmAttach failed for cpu output\n");
+    free_cpu_output_image(r);
+    shmdt(r.shm.shmaddr);
+    return false;
+  }
+  r.gc = XCreateGC(dpy, win, 0, NULL);
+
+  // The render thread works on tiles too.
+  int threads = int(std::thread::hardware_concurrency());
+  int workers = std::min(std::max(threads - 1, 0), CPU_MAX_WORKERS);
+  for (int i = 0; i < workers; i++) {
+    r.workers.emplace_back(cpu_worker_main, &r);
+  }
+  printf("CPU renderer: %dx%d, %d tiles, %d threads\n", width, height,
+         r.tiles_x * r.tiles_y, workers + 1);
+  return true;
+}
+
+static void destroy_cpu_renderer(CpuRenderer &r) {
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.quit = true;
+  }
+  r.start_cv.notify_all();
+  for (std::thread &t : r.workers) {
+    t.join();
+  }
+  r.workers.clear();
+  if (r.img) {
+    XShmDetach(r.dpy, &r.shm);
+    XDestroyImage(r.img);
+    shmdt(r.shm.shmaddr);
+    r.img = nullptr;
+  }
+  if (r.gc) {
+    XFreeGC(r.dpy, r.gc);
+    r.gc = 0;
+  }
+}
+
+// Sets up a quad's screen to parameter mapping. Returns false if it can't be
+// seen edge on.
+static bool cpu_setup_quad(const CpuRenderer &r, const Mat4 &mvp,
+                           const TexturedQuad &tq, CpuQuad &q) {
+  // Clip position is affine in (s, t): c = c0 + s * c1 + t * c2.
+  float c0[4], tr[4], bl[4], br[4];
+  mat4_transform(mvp, tq.corners[0], c0);
+  mat4_transform(mvp, tq.corners[1], tr);
+  mat4_transform(mvp, tq.corners[3], bl);
+  mat4_transform(mvp, tq.corners[2], br);
+
+  // Columns (c1, c2, c0) restricted to x, y, w.
+  const int xyw[3] = {0, 1, 3};
+  float a[3][3];
+  for (int i = 0; i < 3; i++) {
+    a[i][0] = tr[xyw[i]] - c0[xyw[i]];
+    a[i][1] = bl[xyw[i]] - c0[xyw[i]];
+    a[i][2] = c0[xyw[i]];
+  }
+
+  float det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1]) -
+              a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0]) +
+              a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+  if (fabsf(det) < 1e-12f)
+    return false;
+
+  float inv[3][3];
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      // Cofactor of a[j][i], transposed.
+      int r0 = (j + 1) % 3, r1 = (j + 2) % 3;
+      int c0i = (i + 1) % 3, c1i = (i + 2) % 3;
+      inv[i][j] = (a[r0][c0i] * a[r1][c1i] - a[r0][c1i] * a[r1][c0i]) / det;
+    }
+  }
+
+  // Pixel centres to normalized device coordinates, y pointing down.
+  float sx = 2.0f / r.width, ox = 1.0f / r.width - 1.0f;
+  float sy = -2.0f / r.height, oy = 1.0f - 1.0f / r.height;
+  for (int i = 0; i < 3; i++) {
+    q.h[i][0] = inv[i][0] * sx;
+    q.h[i][1] = inv[i][1] * sy;
+    q.h[i][2] = inv[i][0] * ox + inv[i][1] * oy + inv[i][2];
+  }
+
+  const float *corners[4] = {c0, tr, br, bl};
+  bool all_in_front = true;
+  float min_x = 1e30f, min_y = 1e30f, max_x = -1e30f, max_y = -1e30f;
+  for (const float *c : corners) {
+    if (c[3] <= 1e-6f) {
+      all_in_front = false;
+      break;
+    }
+    float x = (c[0] / c[3] + 1.0f) * 0.5f * r.width;
+    float y = (1.0f - c[1] / c[3]) * 0.5f * r.height;
+    min_x = std::min(min_x, x);
+    max_x = std::max(max_x, x);
+    min_y = std::min(min_y, y);
+    max_y = std::max(max_y, y);
+  }
+  if (all_in_front) {
+    q.x0 = std::max(0, int(floorf(min_x)));
+    q.y0 = std::max(0, int(floorf(min_y)));
+    q.x1 = std::min(r.width, int(ceilf(max_x)) + 1);
+    q.y1 = std::min(r.height, int(ceilf(max_y)) + 1);
+  } else {
+    // Crosses the eye plane, let the per pixel test sort it out.
+    q.x0 = 0;
+    q.y0 = 0;
+    q.x1 = r.width;
+    q.y1 = r.height;
+  }
+
+  q.u0 = tq.u0;
+  q.v0 = tq.v0;
+  q.du = tq.u1 - tq.u0;
+  q.dv = tq.v1 - tq.v0;
+  return q.x0 < q.x1 && q.y0 < q.y1;
+}
+
+// Rasterizes `quads` sampled from `tex` into the output image. Blocks until
+// every tile is done.
+static void cpu_render_frame(CpuRenderer &r, const TexturedQuad *quads,
+                             int count, const Mat4 &mvp,
+                             const CpuTexture &tex) {
+  r.quads.clear();
+  for (int i = 0; i < count; i++) {
+    CpuQuad q;
+    if (cpu_setup_quad(r, mvp, quads[i], q))
+      r.quads.push_back(q);
+  }
+  r.tex = tex;
+  r.next_tile = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.frame++;
+    r.busy = int(r.workers.size());
+  }
+  r.start_cv.notify_all();
+  cpu_raster_tiles(r);
+
+  std::unique_lock<std::mutex> lock(r.mutex);
+  r.done_cv.wait(lock, [&] { return r.busy == 0; });
+}
+
+static void cpu_fill_rect(CpuRenderer &r, int x, int y, int w, int h,
+                          uint32_t color) {
+  int x0 = std::max(x, 0), x1 = std::min(x + w, r.width);
+  int y0 = std::max(y, 0), y1 = std::min(y + h, r.height);
+  for (int row = y0; row < y1; row++) {
+    uint32_t *p = (uint32_t *)(r.img->data + row * r.img->bytes_per_line);
+    std::fill(p + x0, p + x1, color);
+  }
+}
+
+// Shows the output image. Waits for the server to have read it, so the next
+// frame can draw into the same buffer.
+static void cpu_present(CpuRenderer &r) {
+  XShmPutImage(r.dpy, r.win, r.gc, r.img, 0, 0, 0, 0, r.width, r.height,
+               False);
+  XSync(r.dpy, False);
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+
+// Tracks what changed on the desktop between two captures.
+//
+// XDamage reports on the root window are collected into a small fixed list of
+// dirty rectangles by the thread pumping X events; the capture thread takes
+// them right before grabbing. Cursor shape changes come in through XFixes.
+// Without the Damage extension every capture is treated as fully dirty.
+
+#define DIRTY_RECTS_MAX 32
+
+struct DirtyRect {
+  int x, y, width, height;
+};
+
+struct DirtyRegion {
+  DirtyRect rects[DIRTY_RECTS_MAX];
+  int count;
+};
+
+static DirtyRect dirty_rect_union(const DirtyRect &a, const DirtyRect &b) {
+  int x0 = std::min(a.x, b.x);
+  int y0 = std::min(a.y, b.y);
+  int x1 = std::max(a.x + a.width, b.x + b.width);
+  int y1 = std::max(a.y + a.height, b.y + b.height);
+  return {x0, y0, x1 - x0, y1 - y0};
+}
+
+static bool dirty_rect_overlaps(const DirtyRect &a, const DirtyRect &b) {
+  return a.x <= b.x + b.width && b.x <= a.x + a.width &&
+         a.y <= b.y + b.height && b.y <= a.y + a.height;
+}
+
+static void dirty_region_add(DirtyRegion &r, DirtyRect rect) {
+  if (rect.width <= 0 || rect.height <= 0)
+    return;
+
+  // Swallow every rectangle the new one touches, repeating since the grown
+  // rectangle may now touch others.
+  for (int i = 0; i < r.count;) {
+    if (dirty_rect_overlaps(r.rects[i], rect)) {
+      rect = dirty_rect_union(r.rects[i], rect);
+      r.rects[i] = r.rects[--r.count];
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+
+  if (r.count == DIRTY_RECTS_MAX) {
+    // Out of room, fold into the last one rather than allocating.
+    r.rects[r.count - 1] = dirty_rect_union(r.rects[r.count - 1], rect);
+    return;
+  }
+  r.rects[r.count++] = rect;
+}
+
+static void dirty_region_add_region(DirtyRegion &r, const DirtyRegion &other) {
+  for (int i = 0; i < other.count; i++) {
+    dirty_region_add(r, other.rects[i]);
+  }
+}
+
+struct DesktopDamage {
+  Display *dpy;
+  Window root;
+  bool available;
+  Damage damage;
+  int damage_event_base;
+  int fixes_event_base;
+
+  std::mutex mutex;
+  DirtyRegion pending;
+  std::atomic<bool> cursor_changed{true};
+};
+
+static bool init_desktop_damage(DesktopDamage &d, Display *dpy, Window root) {
+  d.dpy = dpy;
+  d.root = root;
+
+  int error_base;
+  if (!XFixesQueryExtension(dpy, &d.fixes_event_base, &error_base)) {
+    fprintf(stderr, "XFixes missing, cursor changes not tracked\n");
+    d.fixes_event_base = -1;
+  } else {
+    XFixesSelectCursorInput(dpy, root, XFixesDisplayCursorNotifyMask);
+  }
+
+  if (!XDamageQueryExtension(dpy, &d.damage_event_base, &error_base)) {
+    fprintf(stderr, "XDamage missing, capturing every frame\n");
+    d.available = false;
+    return false;
+  }
+
+  d.damage = XDamageCreate(dpy, root, XDamageReportBoundingBox);
+  d.available = true;
+  return true;
+}
+
+static void destroy_desktop_damage(DesktopDamage &d) {
+  if (d.available) {
+    XDamageDestroy(d.dpy, d.damage);
+    d.available = false;
+  }
+}
+
+// Returns true if the event belonged to damage tracking.
+static bool handle_desktop_damage_event(DesktopDamage &d, const XEvent &ev) {
+  if (d.available && ev.type == d.damage_event_base + XDamageNotify) {
+    const XDamageNotifyEvent &de = (const XDamageNotifyEvent &)ev;
+    std::lock_guard<std::mutex> lock(d.mutex);
+    dirty_region_add(d.pending,
+                     {de.area.x, de.area.y, de.area.width, de.area.height});
+    return true;
+  }
+  if (d.fixes_event_base >= 0 &&
+      ev.type == d.fixes_event_base + XFixesCursorNotify) {
+    d.cursor_changed = true;
+    return true;
+  }
+  return false;
+}
+
+// Moves the damage collected so far into `out` and re-arms the damage object.
+// Call right before grabbing: anything drawn after this point shows up in the
+// next call. Returns false if nothing is known to have changed.
+static bool take_desktop_damage(DesktopDamage &d, DirtyRegion &out,
+                                int width, int height) {
+  out.count = 0;
+  if (!d.available) {
+    dirty_region_add(out, {0, 0, width, height});
+    return true;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(d.mutex);
+    out = d.pending;
+    d.pending.count = 0;
+  }
+  XDamageSubtract(d.dpy, d.damage, None, None);
+  return out.count > 0;
+}
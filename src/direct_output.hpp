@@ -0,0 +1,125 @@
+#pragma once
+
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#ifdef HAVE_XPRESENT
+#include <X11/extensions/Xpresent.h>
+#endif
+
+#include <cstdio>
+#include <stdint.h>
+
+// Direct output: the output window covers the glasses' XRandR output
+// exactly, is override-redirect so no window manager moves or decorates
+// it, and sets _NET_WM_BYPASS_COMPOSITOR so a compositing manager
+// unredirects it rather than copying every frame into its own scene.
+//
+// Whether that worked shows in how the X server completes our swaps: with
+// the Present extension (libXpresent) we watch the completion mode, flips
+// meaning the buffer went to the display untouched and copies meaning a
+// blit, typically into a compositor's or the root window's pixmap. Without
+// it only the compositor's presence is reported.
+
+// Swaps summarised per report.
+#define PRESENT_REPORT_SWAPS 120
+
+struct DirectOutput {
+  Display *dpy;
+  Window win;
+  bool compositor;
+  // Present extension opcode, -1 if completions aren't watched.
+  int present_opcode;
+  uint64_t flips, copies;
+  // Whether the last report saw mostly flips, -1 before the first.
+  int flipping;
+};
+
+static bool compositor_running(Display *dpy, int screen) {
+  char name[32];
+  snprintf(name, sizeof(name), "_NET_WM_CM_S%d", screen);
+  return XGetSelectionOwner(dpy, XInternAtom(dpy, name, False)) != None;
+}
+
+// Attributes for creating the output window unmanaged.
+static void direct_output_attributes(XSetWindowAttributes &swa,
+                                     unsigned long &mask) {
+  swa.override_redirect = True;
+  mask |= CWOverrideRedirect;
+}
+
+// Call with the window created with direct_output_attributes(), before
+// mapping it.
+static void init_direct_output(DirectOutput &o, Display *dpy, Window win) {
+  o = DirectOutput{};
+  o.dpy = dpy;
+  o.win = win;
+  o.present_opcode = -1;
+  o.flipping = -1;
+
+  long bypass = 1;
+  Atom bypass_atom = XInternAtom(dpy, "_NET_WM_BYPASS_COMPOSITOR", False);
+  XChangeProperty(dpy, win, bypass_atom, XA_CARDINAL, 32, PropModeReplace,
+                  (unsigned char *)&bypass, 1);
+  // Some compositors only unredirect windows they consider fullscreen.
+  Atom fullscreen = XInternAtom(dpy, "_NET_WM_STATE_FULLSCREEN", False);
+  XChangeProperty(dpy, win, XInternAtom(dpy, "_NET_WM_STATE", False),
+                  XA_ATOM, 32, PropModeReplace, (unsigned char *)&fullscreen,
+                  1);
+
+  o.compositor = compositor_running(dpy, DefaultScreen(dpy));
+  printf("Compositing manager: %s\n",
+         o.compositor ? "running, asked to bypass the output window"
+                      : "none");
+
+#ifdef HAVE_XPRESENT
+  int event, error;
+  if (XPresentQueryExtension(dpy, &o.present_opcode, &event, &error)) {
+    XPresentSelectInput(dpy, win, PresentCompleteNotifyMask);
+  } else {
+    o.present_opcode = -1;
+  }
+#endif
+  if (o.present_opcode < 0) {
+    printf("Present unavailable, can't verify the compositor bypass\n");
+  }
+}
+
+// Counts swap completions. Returns true if `ev` was a Present event.
+static bool handle_direct_output_event(DirectOutput &o, XEvent &ev) {
+#ifdef HAVE_XPRESENT
+  if (!o.win || o.present_opcode < 0 || ev.type != GenericEvent ||
+      ev.xcookie.extension != o.present_opcode) {
+    return false;
+  }
+  if (!XGetEventData(o.dpy, &ev.xcookie))
+    return true;
+  if (ev.xcookie.evtype == PresentCompleteNotify) {
+    auto *complete = (XPresentCompleteNotifyEvent *)ev.xcookie.data;
+    if (complete->kind == PresentCompleteKindPixmap) {
+      if (complete->mode == PresentCompleteModeFlip)
+        o.flips++;
+      else if (complete->mode != PresentCompleteModeSkip)
+        o.copies++;
+    }
+  }
+  XFreeEventData(o.dpy, &ev.xcookie);
+
+  if (o.flips + o.copies >= PRESENT_REPORT_SWAPS) {
+    int flipping = o.flips > o.copies;
+    if (flipping != o.flipping) {
+      printf("Presentation: %llu of %d swaps flipped, %s\n",
+             (unsigned long long)o.flips, PRESENT_REPORT_SWAPS,
+             flipping ? "compositor bypassed"
+                      : "copied, paying for the compositor or a blit");
+      o.flipping = flipping;
+    }
+    o.flips = 0;
+    o.copies = 0;
+  }
+  return true;
+#else
+  (void)o;
+  (void)ev;
+  return false;
+#endif
+}
@@ -0,0 +1,366 @@
+#pragma once
+
+#include <X11/Xlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "clock.hpp"
+#include "damage.hpp"
+#include "pixel_format.hpp"
+
+// Recorded desktop frames, so capture can be taken out of the picture when
+// profiling uploads and rendering.
+//
+// A recording is one append-only file: a header page with the pixel format
+// and monitor layout, then one record per captured frame. Each record is a
+// page with a FrameRecord, followed by the frame's pixels, padded to a page.
+// Frames are complete, so replay can hand out pointers straight into the
+// mapped file without copying or reassembling anything.
+//
+// A record's magic is written after its pixels. Replay stops at the first
+// record without one, so a recording cut short by a crash stays readable.
+//
+// The capturing thread only copies frames into one of FRAME_RECORDER_QUEUE
+// buffers; a thread of the recorder's own writes them out, so the disk
+// doesn't show up in the timings being recorded. Frames coming in while all
+// buffers are queued are dropped, their damage carried over to the next
+// recorded one.
+
+#define FRAME_RECORDING_MAGIC 0x43455256u // "VREC"
+#define FRAME_RECORDING_VERSION 1
+#define FRAME_RECORD_MAGIC 0x4d415246u // "FRAM"
+#define FRAME_RECORDING_MAX_MONITORS 16
+#define FRAME_RECORDING_PAGE 4096
+#define FRAME_RECORDER_QUEUE 4
+
+struct FrameRecordingMonitor {
+  int32_t x, y, width, height;
+};
+
+struct FrameRecordingHeader {
+  uint32_t magic, version;
+  // PixelFormat::name of all frames.
+  char format[16];
+  int32_t monitor_count;
+  FrameRecordingMonitor monitors[FRAME_RECORDING_MAX_MONITORS];
+};
+
+struct FrameRecord {
+  uint32_t magic;
+  int32_t width, height, stride;
+  // Capture time relative to the first frame.
+  int64_t time_ns;
+  // From this record to the next one.
+  uint64_t size;
+  // Changed since the previous frame.
+  DirtyRegion dirty;
+};
+
+static_assert(sizeof(FrameRecordingHeader) <= FRAME_RECORDING_PAGE, "");
+static_assert(sizeof(FrameRecord) <= FRAME_RECORDING_PAGE, "");
+
+static uint64_t page_align(uint64_t n) {
+  return (n + FRAME_RECORDING_PAGE - 1) & ~uint64_t(FRAME_RECORDING_PAGE - 1);
+}
+
+static bool write_file_range(int fd, const void *data, size_t size,
+                             uint64_t offset) {
+  const uint8_t *p = (const uint8_t *)data;
+  while (size > 0) {
+    ssize_t n = pwrite(fd, p, size, offset);
+    if (n < 0) {
+      perror("write recording");
+      return false;
+    }
+    p += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+struct FrameRecorderBuffer {
+  FrameRecord rec;
+  std::vector<uint8_t> pixels;
+};
+
+struct FrameRecorder {
+  int fd = -1;
+  int64_t first_ns;
+  // Frames handed to the writer and dropped.
+  uint64_t frames, dropped;
+  // Damage of the frames dropped since the last recorded one.
+  DirtyRegion dropped_dirty;
+
+  // Buffers [tail, head) modulo FRAME_RECORDER_QUEUE are queued for the
+  // writer, the others belong to the capturing thread.
+  FrameRecorderBuffer buffers[FRAME_RECORDER_QUEUE];
+  std::mutex mutex;
+  std::condition_variable cv;
+  uint64_t head, tail;
+  bool stopping, failed;
+  std::thread writer;
+  // Where the next record goes, writer only.
+  uint64_t end;
+};
+
+// Writes the queued frames until stopped.
+static void frame_recorder_main(FrameRecorder *r) {
+  static uint8_t page[FRAME_RECORDING_PAGE];
+  std::unique_lock<std::mutex> lock(r->mutex);
+  while (true) {
+    r->cv.wait(lock, [&] { return r->stopping || r->tail != r->head; });
+    if (r->tail == r->head)
+      break;
+    FrameRecorderBuffer &b = r->buffers[r->tail % FRAME_RECORDER_QUEUE];
+    lock.unlock();
+
+    // Pixels first, and the file grown to the padded size, so the record
+    // only gets its magic once it is complete.
+    uint64_t pixels = uint64_t(b.rec.stride) * b.rec.height;
+    b.rec.magic = FRAME_RECORD_MAGIC;
+    memset(page, 0, sizeof(page));
+    memcpy(page, &b.rec, sizeof(b.rec));
+    bool ok = write_file_range(r->fd, b.pixels.data(), pixels,
+                               r->end + FRAME_RECORDING_PAGE);
+    if (ok && ftruncate(r->fd, r->end + b.rec.size) < 0) {
+      perror("ftruncate recording");
+      ok = false;
+    }
+    ok = ok && write_file_range(r->fd, page, sizeof(page), r->end);
+    r->end += b.rec.size;
+
+    lock.lock();
+    if (!ok) {
+      r->failed = true;
+      break;
+    }
+    r->tail++;
+  }
+}
+
+static bool open_frame_recorder(FrameRecorder &r, const char *path,
+                                const PixelFormat *format,
+                                const FrameRecordingMonitor *monitors,
+                                int monitor_count) {
+  r.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (r.fd < 0) {
+    perror("open recording");
+    return false;
+  }
+  static uint8_t page[FRAME_RECORDING_PAGE];
+  auto *h = (FrameRecordingHeader *)page;
+  h->magic = FRAME_RECORDING_MAGIC;
+  h->version = FRAME_RECORDING_VERSION;
+  strncpy(h->format, format->name, sizeof(h->format) - 1);
+  h->monitor_count = std::min(monitor_count, FRAME_RECORDING_MAX_MONITORS);
+  std::copy(monitors, monitors + h->monitor_count, h->monitors);
+  if (!write_file_range(r.fd, page, sizeof(page), 0)) {
+    close(r.fd);
+    r.fd = -1;
+    return false;
+  }
+
+  r.end = FRAME_RECORDING_PAGE;
+  r.frames = 0;
+  r.dropped = 0;
+  r.dropped_dirty.count = 0;
+  r.head = r.tail = 0;
+  r.stopping = r.failed = false;
+  r.writer = std::thread(frame_recorder_main, &r);
+  printf("Recording frames to %s\n", path);
+  return true;
+}
+
+static void close_frame_recorder(FrameRecorder &r) {
+  if (r.fd < 0)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.stopping = true;
+  }
+  r.cv.notify_all();
+  r.writer.join();
+  close(r.fd);
+  r.fd = -1;
+  if (r.failed) {
+    fprintf(stderr, "Recording stopped after %llu frames\n",
+            (unsigned long long)r.tail);
+  } else {
+    printf("Recorded %llu frames\n", (unsigned long long)r.frames);
+  }
+  if (r.dropped > 0) {
+    fprintf(stderr, "Dropped %llu frames, the disk didn't keep up\n",
+            (unsigned long long)r.dropped);
+  }
+}
+
+// Appends `img` with `dirty`, what changed since the previous call.
+static void record_frame(FrameRecorder &r, const XImage *img,
+                         const DirtyRegion &dirty) {
+  if (r.fd < 0)
+    return;
+  int64_t now = monotonic_ns();
+  if (r.frames == 0 && r.dropped == 0)
+    r.first_ns = now;
+
+  bool full, failed;
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    full = r.head - r.tail == FRAME_RECORDER_QUEUE;
+    failed = r.failed;
+  }
+  if (failed) {
+    close_frame_recorder(r);
+    return;
+  }
+  if (full) {
+    r.dropped++;
+    dirty_region_add_region(r.dropped_dirty, dirty);
+    return;
+  }
+
+  FrameRecorderBuffer &b = r.buffers[r.head % FRAME_RECORDER_QUEUE];
+  uint64_t pixels = uint64_t(img->bytes_per_line) * img->height;
+  // Only allocates when the frame size changes.
+  b.pixels.resize(pixels);
+  memcpy(b.pixels.data(), img->data, pixels);
+  b.rec.magic = 0;
+  b.rec.width = img->width;
+  b.rec.height = img->height;
+  b.rec.stride = img->bytes_per_line;
+  b.rec.time_ns = now - r.first_ns;
+  b.rec.size = FRAME_RECORDING_PAGE + page_align(pixels);
+  b.rec.dirty = r.dropped_dirty;
+  dirty_region_add_region(b.rec.dirty, dirty);
+  r.dropped_dirty.count = 0;
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.head++;
+  }
+  r.cv.notify_one();
+  r.frames++;
+}
+
+struct FrameReplay {
+  const uint8_t *map;
+  size_t size;
+  const FrameRecordingHeader *header;
+  std::vector<const FrameRecord *> frames;
+  // Serve frames as fast as they are asked for instead of at their
+  // recorded pace.
+  bool max_rate;
+  size_t next;
+  // Host time the current pass through the recording started.
+  int64_t start_ns;
+};
+
+static bool open_frame_replay(FrameReplay &r, const char *path,
+                              bool max_rate) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror("open recording");
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  r.size = st.st_size;
+  void *p = r.size >= FRAME_RECORDING_PAGE
+                ? mmap(nullptr, r.size, PROT_READ, MAP_SHARED, fd, 0)
+                : MAP_FAILED;
+  close(fd);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Can't map recording %s\n", path);
+    return false;
+  }
+  r.map = (const uint8_t *)p;
+  r.header = (const FrameRecordingHeader *)r.map;
+  if (r.header->magic != FRAME_RECORDING_MAGIC ||
+      r.header->version != FRAME_RECORDING_VERSION) {
+    fprintf(stderr, "%s is not a frame recording\n", path);
+    munmap(p, r.size);
+    r.map = nullptr;
+    return false;
+  }
+
+  r.frames.clear();
+  for (uint64_t offset = FRAME_RECORDING_PAGE;
+       offset + FRAME_RECORDING_PAGE <= r.size;) {
+    auto *rec = (const FrameRecord *)(r.map + offset);
+    if (rec->magic != FRAME_RECORD_MAGIC || rec->size == 0 ||
+        offset + rec->size > r.size) {
+      break;
+    }
+    r.frames.push_back(rec);
+    offset += rec->size;
+  }
+  if (r.frames.empty()) {
+    fprintf(stderr, "No frames in %s\n", path);
+    munmap(p, r.size);
+    r.map = nullptr;
+    return false;
+  }
+  r.max_rate = max_rate;
+  r.next = 0;
+  printf("Replaying %zu frames (%.1f s, %s) from %s\n", r.frames.size(),
+         r.frames.back()->time_ns / 1e9, r.header->format, path);
+  return true;
+}
+
+static const uint8_t *frame_pixels(const FrameRecord *rec) {
+  return (const uint8_t *)rec + FRAME_RECORDING_PAGE;
+}
+
+// The newest frame that is due, with `dirty` set to what changed since the
+// previously returned one, or nullptr if none is due yet. Loops at the end.
+static const FrameRecord *next_replay_frame(FrameReplay &r,
+                                            DirtyRegion &dirty) {
+  dirty.count = 0;
+  int64_t now = monotonic_ns();
+  if (r.next == 0)
+    r.start_ns = now;
+
+  const FrameRecord *prev = r.next > 0 ? r.frames[r.next - 1] : nullptr;
+  const FrameRecord *rec = nullptr;
+  while (r.next < r.frames.size() &&
+         (r.max_rate ? rec == nullptr
+                     : r.frames[r.next]->time_ns <= now - r.start_ns)) {
+    rec = r.frames[r.next++];
+    dirty_region_add_region(dirty, rec->dirty);
+  }
+  if (!rec)
+    return nullptr;
+
+  // A new pass or size starts over from a full frame.
+  if (!prev || prev->width != rec->width || prev->height != rec->height) {
+    dirty.count = 0;
+    dirty_region_add(dirty, {0, 0, rec->width, rec->height});
+  }
+  if (r.next == r.frames.size()) {
+    r.next = 0;
+  } else {
+    const FrameRecord *upcoming = r.frames[r.next];
+    madvise((void *)upcoming, upcoming->size, MADV_WILLNEED);
+  }
+  return rec;
+}
+
+static void close_frame_replay(FrameReplay &r) {
+  if (r.map) {
+    munmap((void *)r.map, r.size);
+    r.map = nullptr;
+  }
+  r.frames.clear();
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <stdint.h>
+
+#include "clock.hpp"
+#include "gpu_timer.hpp"
+
+// Rolling percentiles over the last FRAME_STATS_WINDOW samples of each
+// metric, plus an optional per-frame CSV log. Fed from both the render and
+// the upload thread.
+
+#define FRAME_STATS_WINDOW 1024
+#define FRAME_STATS_REPORT_NS 5000000000LL
+
+enum FrameMetric {
+  METRIC_CPU_FRAME,
+  METRIC_CPU_MIPS,
+  METRIC_GPU_UPLOAD,
+  METRIC_GPU_MIPS,
+  METRIC_GPU_PANELS,
+  METRIC_GPU_UPSCALE,
+  METRIC_GPU_OVERLAY,
+  METRIC_MOTION_TO_PHOTON,
+  METRIC_COUNT,
+};
+
+static const char *frame_metric_names[METRIC_COUNT] = {
+    "cpu_frame",   "cpu_mips",    "gpu_upload",
+    "gpu_mips",    "gpu_panels",  "gpu_upscale",
+    "gpu_overlay", "motion_to_photon",
+};
+
+// Loops whose idle residency is reported.
+enum IdleLoop {
+  IDLE_CAPTURE,
+  IDLE_RENDER,
+  IDLE_LOOP_COUNT,
+};
+
+static const char *idle_loop_names[IDLE_LOOP_COUNT] = {"capture", "render"};
+
+struct RollingWindow {
+  int64_t values[FRAME_STATS_WINDOW];
+  int count;
+  int next;
+};
+
+struct FrameStats {
+  std::mutex mutex;
+  RollingWindow windows[METRIC_COUNT];
+  int64_t scratch[FRAME_STATS_WINDOW];
+  // Ticks and skipped ticks since the last report.
+  uint64_t ticks[IDLE_LOOP_COUNT];
+  uint64_t idle_ticks[IDLE_LOOP_COUNT];
+  FILE *log;
+  int64_t last_report_ns;
+};
+
+static bool open_frame_log(FrameStats &s, const char *path) {
+  s.log = fopen(path, "w");
+  if (!s.log) {
+    perror("fopen frame log");
+    return false;
+  }
+  fprintf(s.log, "kind,frame,cpu_us,cpu_mips_us,gpu_upload_us,gpu_mips_us,"
+                 "gpu_panels_us,gpu_upscale_us,gpu_overlay_us,imu_ts,"
+                 "motion_to_photon_us\n");
+  return true;
+}
+
+static void close_frame_log(FrameStats &s) {
+  if (s.log) {
+    fclose(s.log);
+    s.log = nullptr;
+  }
+}
+
+static void frame_stats_push(FrameStats &s, FrameMetric metric, int64_t us) {
+  RollingWindow &w = s.windows[metric];
+  w.values[w.next] = us;
+  w.next = (w.next + 1) % FRAME_STATS_WINDOW;
+  if (w.count < FRAME_STATS_WINDOW)
+    w.count++;
+}
+
+static void frame_stats_add(FrameStats &s, FrameMetric metric, int64_t us) {
+  std::lock_guard<std::mutex> lock(s.mutex);
+  frame_stats_push(s, metric, us);
+}
+
+static void frame_stats_count_tick(FrameStats &s, IdleLoop loop, bool idle) {
+  std::lock_guard<std::mutex> lock(s.mutex);
+  s.ticks[loop]++;
+  if (idle)
+    s.idle_ticks[loop]++;
+}
+
+static int64_t ns_to_us(int64_t ns) { return ns < 0 ? -1 : ns / 1000; }
+
+// Records one resolved GpuTimer frame. `kind` tells the render and upload
+// streams apart in the log.
+static void frame_stats_add_timing(FrameStats &s, const char *kind,
+                                   const GpuFrameTiming &t) {
+  int64_t upload_us = ns_to_us(t.pass_ns[GPU_PASS_UPLOAD]);
+  int64_t mips_us = ns_to_us(t.pass_ns[GPU_PASS_MIPS]);
+  int64_t panels_us = ns_to_us(t.pass_ns[GPU_PASS_PANELS]);
+  int64_t upscale_us = ns_to_us(t.pass_ns[GPU_PASS_UPSCALE]);
+  int64_t overlay_us = ns_to_us(t.pass_ns[GPU_PASS_OVERLAY]);
+  int64_t m2p_us = -1;
+  if (t.swap_host_ns >= 0 && t.imu_host_ns >= 0) {
+    m2p_us = ns_to_us(t.swap_host_ns - t.imu_host_ns);
+  }
+
+  std::lock_guard<std::mutex> lock(s.mutex);
+  if (upload_us >= 0)
+    frame_stats_push(s, METRIC_GPU_UPLOAD, upload_us);
+  if (mips_us >= 0)
+    frame_stats_push(s, METRIC_GPU_MIPS, mips_us);
+  if (panels_us >= 0)
+    frame_stats_push(s, METRIC_GPU_PANELS, panels_us);
+  if (upscale_us >= 0)
+    frame_stats_push(s, METRIC_GPU_UPSCALE, upscale_us);
+  if (overlay_us >= 0)
+    frame_stats_push(s, METRIC_GPU_OVERLAY, overlay_us);
+  if (m2p_us >= 0)
+    frame_stats_push(s, METRIC_MOTION_TO_PHOTON, m2p_us);
+
+  if (s.log) {
+    fprintf(s.log, "%s,%llu,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%u,%lld\n",
+            kind, (unsigned long long)t.frame, (long long)t.cpu_us,
+            (long long)t.cpu_mips_us, (long long)upload_us, (long long)mips_us,
+            (long long)panels_us, (long long)upscale_us, (long long)overlay_us,
+            t.imu_ts, (long long)m2p_us);
+  }
+}
+
+static int64_t percentile(const int64_t *sorted, int count, double p) {
+  int i = int(p * (count - 1) + 0.5);
+  return sorted[i];
+}
+
+// Prints p50/p95/p99/max of every metric every FRAME_STATS_REPORT_NS.
+static void frame_stats_report(FrameStats &s) {
+  int64_t now = monotonic_ns();
+  if (now - s.last_report_ns < FRAME_STATS_REPORT_NS)
+    return;
+  s.last_report_ns = now;
+
+  std::lock_guard<std::mutex> lock(s.mutex);
+  for (int m = 0; m < METRIC_COUNT; m++) {
+    const RollingWindow &w = s.windows[m];
+    if (w.count == 0)
+      continue;
+
+    std::copy(w.values, w.values + w.count, s.scratch);
+    std::sort(s.scratch, s.scratch + w.count);
+    printf("%-17s p50=%6lld p95=%6lld p99=%6lld max=%6lld us (n=%d)\n",
+           frame_metric_names[m],
+           (long long)percentile(s.scratch, w.count, 0.50),
+           (long long)percentile(s.scratch, w.count, 0.95),
+           (long long)percentile(s.scratch, w.count, 0.99),
+           (long long)s.scratch[w.count - 1], w.count);
+  }
+
+  printf("idle residency:");
+  for (int l = 0; l < IDLE_LOOP_COUNT; l++) {
+    double residency = s.ticks[l] ? 100.0 * s.idle_ticks[l] / s.ticks[l] : 0;
+    printf(" %s=%.1f%%", idle_loop_names[l], residency);
+    s.ticks[l] = 0;
+    s.idle_ticks[l] = 0;
+  }
+  printf("\n");
+  if (s.log)
+    fflush(s.log);
+}
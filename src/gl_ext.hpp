@@ -0,0 +1,42 @@
+#pragma once
+
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <string.h>
+
+#include <algorithm>
+
+// Checks the extension string of the current context. Only valid with a
+// context current on the calling thread.
+static bool gl_has_extension(const char *name) {
+  const char *exts = (const char *)glGetString(GL_EXTENSIONS);
+  if (exts == nullptr)
+    return false;
+
+  size_t len = strlen(name);
+  for (const char *p = strstr(exts, name); p != nullptr;
+       p = strstr(p + len, name)) {
+    bool starts = p == exts || p[-1] == ' ';
+    bool ends = p[len] == ' ' || p[len] == '\0';
+    if (starts && ends)
+      return true;
+  }
+  return false;
+}
+
+// Anisotropy to filter textures with given the `wanted` one, clamped to what
+// the current context supports. 1 (off) without
+// GL_EXT_texture_filter_anisotropic.
+static float gl_anisotropy(float wanted) {
+  if (wanted <= 1.0f || !gl_has_extension("GL_EXT_texture_filter_anisotropic"))
+    return 1.0f;
+  GLfloat max = 1.0f;
+  glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &max);
+  return std::min(wanted, float(max));
+}
+
+// Sets the anisotropy of the bound 2D texture, from gl_anisotropy().
+static void gl_set_anisotropy(float anisotropy) {
+  if (anisotropy > 1.0f)
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, anisotropy);
+}
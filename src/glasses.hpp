@@ -1,6 +1,10 @@
 #pragma once
 
 #include <GL/gl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <math.h>
 #include <stdbool.h>
@@ -8,10 +12,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <thread>
 #include <unistd.h>
 
+#include "clock.hpp"
+#include "imu_rate.hpp"
+#include "pose.hpp"
+#include "pose_publisher.hpp"
+#include "trace.hpp"
 #include "viture.h"
 
+// A pose as used for rendering: the filtered orientation plus the offsets
+// from aligning, see predicted_glasses(). The state behind it lives in
+// pose_estimator, under its lock.
 struct Glasses {
   float roll, pitch, yaw;
   float qw, qx, qy, qz;
@@ -19,10 +32,63 @@ struct Glasses {
   float oroll, opitch, oyaw;
   float oqw, oqx, oqy, oqz;
 
-  GLdouble fov;
+  // Device timestamp of the latest sample and the host time it arrived at.
+  // In a predicted copy, those of the sample the prediction started from.
+  uint32_t ts;
+  int64_t host_ns;
 };
 
-static Glasses glasses{};
+// The SDK is initialized on a thread of its own so the viewer comes up
+// straight away, showing a fixed pose until samples arrive. That thread then
+// watches the device timestamps; when they stop advancing (cable bumped, USB
+// reset) it tears the SDK down and initializes it again, with backoff
+// between failed attempts. Tracking resumes where it left off.
+
+// No sample with a new device timestamp for this long means the link is gone.
+// Well above the pause of an IMU rate switch.
+#define GLASSES_STALL_NS 1000000000LL
+#define GLASSES_POLL_US 100000
+#define GLASSES_BACKOFF_MIN_MS 250
+#define GLASSES_BACKOFF_MAX_MS 8000
+
+enum GlassesLinkState {
+  GLASSES_CONNECTING,
+  GLASSES_TRACKING,
+  GLASSES_STALLED,
+};
+
+struct GlassesLink {
+  // IMU_FREQUENCE_* to initialize with, follows the rate controller.
+  int imu_fq;
+  // Adapts the IMU rate while tracking, nullptr for a fixed rate. The link
+  // starts and stops it so only one thread talks to the SDK at a time.
+  ImuRateController *rate;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::atomic<bool> running{false};
+
+  std::atomic<int> state{GLASSES_CONNECTING};
+  std::atomic<uint64_t> reconnects{0};
+  int64_t started_ns;
+
+  // Host time of the newest sample that advanced the device timestamp.
+  std::atomic<int64_t> last_progress_ns{0};
+  uint32_t last_ts;
+
+  // Set before each init; the first sample then re-anchors the offsets so
+  // it shows up as the held pose.
+  std::atomic<bool> anchor_pending{false};
+  // Aligned pose on screen when the link went down, straight ahead at first.
+  float held_roll, held_pitch, held_yaw;
+  Quat held_q;
+};
+
+static PoseEstimator pose_estimator;
+// Set up before start_glasses_link() to broadcast every sample.
+static PosePublisher pose_publisher;
+static GlassesLink glasses_link;
 
 static float get_roll(Glasses g) { return g.roll + g.oroll; }
 
@@ -30,6 +96,11 @@ static float get_pitch(Glasses g) { return g.pitch + g.opitch; }
 
 static float get_yaw(Glasses g) { return g.yaw + g.oyaw; }
 
+// Orientation relative to the one captured when aligning.
+static Quat get_quat(Glasses g) {
+  return quat_mul({g.oqw, g.oqx, g.oqy, g.oqz}, {g.qw, g.qx, g.qy, g.qz});
+}
+
 static float makeFloat(uint8_t *data) {
   float value = 0;
   uint8_t tem[4];
@@ -41,24 +112,99 @@ static float makeFloat(uint8_t *data) {
   return value;
 }
 
+static Glasses glasses_from_pose(const Pose &p) {
+  Glasses g;
+  g.oroll = p.alignment.roll;
+  g.opitch = p.alignment.pitch;
+  g.oyaw = p.alignment.yaw;
+  g.oqw = p.alignment.q.w;
+  g.oqx = p.alignment.q.x;
+  g.oqy = p.alignment.q.y;
+  g.oqz = p.alignment.q.z;
+  g.roll = p.roll;
+  g.pitch = p.pitch;
+  g.yaw = p.yaw;
+  g.qw = p.q.w;
+  g.qx = p.q.x;
+  g.qy = p.q.y;
+  g.qz = p.q.z;
+  g.ts = p.sample_ts;
+  g.host_ns = p.sample_host_ns;
+  return g;
+}
+
+// The filtered pose extrapolated to `target_ns`, with the offsets from
+// aligning.
+static Glasses predicted_glasses(int64_t target_ns) {
+  return glasses_from_pose(predict_pose(pose_estimator, target_ns));
+}
+
+// Sets the offsets so that the newest sample shows as the held pose. The
+// device restarts its sensor fusion on init, so its own reference can't be
+// trusted across a reconnect.
+static void anchor_glasses(const GlassesLink &l) {
+  align_pose(pose_estimator, l.held_roll, l.held_pitch, l.held_yaw,
+             l.held_q);
+}
+
 static void imuCallback(uint8_t *data, uint16_t len, uint32_t ts) {
-  glasses.roll = makeFloat(data);
-  glasses.pitch = makeFloat(data + 4);
-  glasses.yaw = makeFloat(data + 8);
-
-  if (len >= 36) {
-    glasses.qw = makeFloat(data + 20);
-    glasses.qx = makeFloat(data + 24);
-    glasses.qy = makeFloat(data + 28);
-    glasses.qz = makeFloat(data + 32);
+  int64_t host_ns = monotonic_ns();
+  TRACE_THREAD("imu");
+  TRACE_SCOPE_ARG("imu", ts);
+
+  // A stuck device may keep repeating its last report.
+  if (ts != glasses_link.last_ts) {
+    glasses_link.last_ts = ts;
+    glasses_link.last_progress_ns = host_ns;
+  }
+
+  ImuSample sample;
+  sample.ts = ts;
+  sample.host_ns = host_ns;
+  sample.roll = makeFloat(data);
+  sample.pitch = makeFloat(data + 4);
+  sample.yaw = makeFloat(data + 8);
+  sample.has_quat = len >= 36;
+  sample.q = {1.0f, 0.0f, 0.0f, 0.0f};
+  if (sample.has_quat) {
+    sample.q = {makeFloat(data + 20), makeFloat(data + 24),
+                makeFloat(data + 28), makeFloat(data + 32)};
+  }
+  push_imu_sample(pose_estimator, sample);
+  if (glasses_link.anchor_pending.exchange(false)) {
+    anchor_glasses(glasses_link);
+  }
+
+  if (pose_publisher.shm) {
+    // Filtered pose at this sample, aligned like the rendered one.
+    Pose p = predict_pose(pose_estimator, host_ns);
+    Glasses g = glasses_from_pose(p);
+    Quat q = get_quat(g);
+
+    viture_pose_record rec{};
+    rec.device_ts = ts;
+    rec.host_ns = host_ns;
+    rec.roll = wrap_degrees(get_roll(g));
+    rec.pitch = wrap_degrees(get_pitch(g));
+    rec.yaw = wrap_degrees(get_yaw(g));
+    rec.qw = q.w;
+    rec.qx = q.x;
+    rec.qy = q.y;
+    rec.qz = q.z;
+    rec.droll = p.droll;
+    rec.dpitch = p.dpitch;
+    rec.dyaw = p.dyaw;
+    publish_pose(pose_publisher, rec);
   }
 }
 
 static void mcuCallback(uint16_t msgid, uint8_t *data, uint16_t len,
                         uint32_t ts) {}
 
-// Returns ERR_SUCCESS if succeeded, otherwise something else.
-static int init_glasses() {
+// Returns ERR_SUCCESS if succeeded, otherwise something else, with the SDK
+// deinitialized again. `imu_fq` is one of the IMU_FREQUENCE_* values.
+static int init_glasses(int imu_fq) {
+  TRACE_SCOPE("glasses_init");
   if (!init(imuCallback, mcuCallback)) {
     fprintf(stderr, "Failed to init glasses\n");
     return ERR_FAILURE;
@@ -67,17 +213,14 @@ static int init_glasses() {
   int result = set_imu(true);
   if (result != ERR_SUCCESS) {
     fprintf(stderr, "Failed to set imu=true on glasses\n");
+    deinit();
     return result;
   }
 
-  // result = set_imu_fq(IMU_FREQUENCE_240);
-  // if (result != ERR_SUCCESS) {
-  //   fprintf(stderr, "Failed to set imufq=240 on glasses\n");
-  //   return result;
-  // }
-  result = set_imu_fq(IMU_FREQUENCE_120);
+  result = set_imu_fq(imu_fq);
   if (result != ERR_SUCCESS) {
-    fprintf(stderr, "Failed to set imufq=120 on glasses\n");
+    fprintf(stderr, "Failed to set imufq=%d on glasses\n", imu_fq);
+    deinit();
     return result;
   }
 
@@ -85,3 +228,113 @@ static int init_glasses() {
 
   return ERR_SUCCESS;
 }
+
+// Returns false once the link is being stopped.
+static bool glasses_link_sleep(GlassesLink &l, int64_t us) {
+  std::unique_lock<std::mutex> lock(l.mutex);
+  l.cv.wait_for(lock, std::chrono::microseconds(us),
+                [&] { return !l.running; });
+  return l.running;
+}
+
+// Keeps the current pose on screen across the reconnect.
+static void hold_glasses_pose(GlassesLink &l) {
+  Glasses g = predicted_glasses(0);
+  Quat q = get_quat(g);
+  l.held_roll = get_roll(g);
+  l.held_pitch = get_pitch(g);
+  l.held_yaw = get_yaw(g);
+  l.held_q = q;
+}
+
+static void glasses_link_main(GlassesLink *l) {
+  int backoff_ms = GLASSES_BACKOFF_MIN_MS;
+  int64_t down_since_ns = l->started_ns;
+  bool initialized = false, tracking = false;
+  TRACE_THREAD("glasses link");
+
+  while (l->running) {
+    if (initialized) {
+      deinit();
+      initialized = false;
+    }
+    int64_t attempt_ns = monotonic_ns();
+    // Stall clock starts now, samples move it forward.
+    l->last_progress_ns = attempt_ns;
+    l->anchor_pending = true;
+    if (init_glasses(l->imu_fq) == ERR_SUCCESS) {
+      initialized = true;
+      while (glasses_link_sleep(*l, GLASSES_POLL_US)) {
+        int64_t now = monotonic_ns();
+        int64_t last = l->last_progress_ns;
+        if (!tracking && last > attempt_ns) {
+          tracking = true;
+          backoff_ms = GLASSES_BACKOFF_MIN_MS;
+          l->state = GLASSES_TRACKING;
+          if (l->reconnects == 0) {
+            printf("Glasses tracking %.0f ms after startup\n",
+                   (now - down_since_ns) / 1e6);
+          } else {
+            printf("Glasses reconnected after %.0f ms (reconnect %llu)\n",
+                   (now - down_since_ns) / 1e6,
+                   (unsigned long long)l->reconnects);
+          }
+          if (l->rate)
+            start_imu_rate_controller(*l->rate, pose_estimator, l->imu_fq);
+        }
+        if (now - last > GLASSES_STALL_NS)
+          break;
+      }
+      if (!l->running)
+        break;
+      if (tracking) {
+        // Reconnect right away, at the rate we were at.
+        if (l->rate) {
+          stop_imu_rate_controller(*l->rate);
+          l->imu_fq = imu_rate_levels[l->rate->level].value;
+        }
+        hold_glasses_pose(*l);
+        tracking = false;
+        down_since_ns = l->last_progress_ns;
+        l->reconnects++;
+        l->state = GLASSES_STALLED;
+        fprintf(stderr, "Glasses IMU stalled, reconnecting (reconnect %llu)\n",
+                (unsigned long long)l->reconnects);
+        continue;
+      }
+      fprintf(stderr, "No IMU samples from the glasses\n");
+    }
+
+    fprintf(stderr, "Glasses not ready, retrying in %d ms\n", backoff_ms);
+    if (!glasses_link_sleep(*l, int64_t(backoff_ms) * 1000))
+      break;
+    backoff_ms = std::min(backoff_ms * 2, GLASSES_BACKOFF_MAX_MS);
+  }
+
+  if (tracking && l->rate)
+    stop_imu_rate_controller(*l->rate);
+  if (initialized)
+    deinit();
+}
+
+// Starts connecting to the glasses in the background. `rate` is optional.
+static void start_glasses_link(GlassesLink &l, int imu_fq,
+                               ImuRateController *rate) {
+  l.imu_fq = imu_fq;
+  l.rate = rate;
+  l.started_ns = monotonic_ns();
+  l.held_roll = l.held_pitch = l.held_yaw = 0.0f;
+  l.held_q = {1.0f, 0.0f, 0.0f, 0.0f};
+  l.running = true;
+  l.thread = std::thread(glasses_link_main, &l);
+}
+
+static void stop_glasses_link(GlassesLink &l) {
+  {
+    std::lock_guard<std::mutex> lock(l.mutex);
+    l.running = false;
+  }
+  l.cv.notify_all();
+  if (l.thread.joinable())
+    l.thread.join();
+}
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <cstdio>
+#include <stdint.h>
+
+#include "clock.hpp"
+#include "gl_ext.hpp"
+
+// GPU side timing with GL_TIMESTAMP queries. Query objects are not shared
+// between contexts, so the render and upload contexts each own a GpuTimer.
+//
+// Every frame gets its own set of queries out of a small ring. Results are
+// only read once GL reports them available, which is normally a couple of
+// frames later, so instrumenting never stalls the pipeline. If a ring entry
+// is still in flight when it comes around again that frame is simply not
+// timed.
+
+#define GPU_TIMER_LATENCY 4
+
+enum GpuPass {
+  GPU_PASS_UPLOAD,
+  // Regenerating the mipmaps of textures that were uploaded.
+  GPU_PASS_MIPS,
+  GPU_PASS_PANELS,
+  // Stretching a reduced resolution scene onto the window.
+  GPU_PASS_UPSCALE,
+  GPU_PASS_OVERLAY,
+  // Single timestamp issued right after glXSwapBuffers.
+  GPU_PASS_SWAP,
+  GPU_PASS_COUNT,
+};
+
+struct GpuTimerFrame {
+  GLuint begin[GPU_PASS_COUNT];
+  GLuint end[GPU_PASS_COUNT];
+  bool began[GPU_PASS_COUNT];
+  bool ended[GPU_PASS_COUNT];
+  bool pending;
+
+  uint64_t frame;
+  // Host side data carried along until the queries resolve.
+  uint32_t imu_ts;
+  int64_t imu_host_ns;
+  int64_t cpu_us;
+  int64_t cpu_mips_us;
+};
+
+struct GpuFrameTiming {
+  uint64_t frame;
+  // -1 for passes that were not recorded this frame.
+  int64_t pass_ns[GPU_PASS_COUNT];
+  // Host time at which the swap timestamp was reached on the GPU, -1 if the
+  // swap was not recorded.
+  int64_t swap_host_ns;
+
+  uint32_t imu_ts;
+  int64_t imu_host_ns;
+  int64_t cpu_us;
+  // Downsampling on the CPU, -1 if there was none.
+  int64_t cpu_mips_us;
+};
+
+struct GpuTimer {
+  bool enabled;
+  GpuTimerFrame frames[GPU_TIMER_LATENCY];
+  // Frame being recorded, nullptr between end and begin or when its ring
+  // entry was still in flight.
+  GpuTimerFrame *recording;
+  int next;
+  uint64_t frame;
+
+  // Added to a GPU timestamp to get monotonic_ns() time.
+  int64_t gpu_to_host_ns;
+  int64_t last_calibration_ns;
+  uint64_t skipped;
+};
+
+static void calibrate_gpu_timer(GpuTimer &t) {
+  GLint64 gpu_now = 0;
+  glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+  int64_t host_now = monotonic_ns();
+  t.gpu_to_host_ns = host_now - gpu_now;
+  t.last_calibration_ns = host_now;
+}
+
+// Must be called with the owning context current.
+static bool init_gpu_timer(GpuTimer &t) {
+  t = GpuTimer{};
+  if (!gl_has_extension("GL_ARB_timer_query")) {
+    fprintf(stderr, "GL_ARB_timer_query missing, GPU timings disabled\n");
+    return false;
+  }
+
+  for (GpuTimerFrame &f : t.frames) {
+    glGenQueries(GPU_PASS_COUNT, f.begin);
+    glGenQueries(GPU_PASS_COUNT, f.end);
+  }
+  calibrate_gpu_timer(t);
+  t.enabled = true;
+  return true;
+}
+
+static void destroy_gpu_timer(GpuTimer &t) {
+  if (!t.enabled)
+    return;
+  for (GpuTimerFrame &f : t.frames) {
+    glDeleteQueries(GPU_PASS_COUNT, f.begin);
+    glDeleteQueries(GPU_PASS_COUNT, f.end);
+  }
+  t.enabled = false;
+}
+
+static void begin_gpu_frame(GpuTimer &t) {
+  t.recording = nullptr;
+  if (!t.enabled)
+    return;
+
+  GpuTimerFrame &f = t.frames[t.next];
+  if (f.pending) {
+    t.skipped++;
+    return;
+  }
+
+  for (int i = 0; i < GPU_PASS_COUNT; i++) {
+    f.began[i] = false;
+    f.ended[i] = false;
+  }
+  f.frame = t.frame;
+  f.imu_ts = 0;
+  f.imu_host_ns = -1;
+  f.cpu_us = -1;
+  f.cpu_mips_us = -1;
+  t.recording = &f;
+}
+
+static void gpu_pass_begin(GpuTimer &t, GpuPass pass) {
+  if (t.recording == nullptr)
+    return;
+  glQueryCounter(t.recording->begin[pass], GL_TIMESTAMP);
+  t.recording->began[pass] = true;
+}
+
+static void gpu_pass_end(GpuTimer &t, GpuPass pass) {
+  if (t.recording == nullptr)
+    return;
+  glQueryCounter(t.recording->end[pass], GL_TIMESTAMP);
+  t.recording->ended[pass] = true;
+}
+
+// Whether `pass` was recorded in the frame being recorded.
+static bool gpu_pass_recorded(const GpuTimer &t, GpuPass pass) {
+  return t.recording != nullptr && t.recording->ended[pass];
+}
+
+static void end_gpu_frame(GpuTimer &t, int64_t cpu_us) {
+  t.frame++;
+  if (t.recording == nullptr)
+    return;
+
+  t.recording->cpu_us = cpu_us;
+  t.recording->pending = true;
+  t.recording = nullptr;
+  t.next = (t.next + 1) % GPU_TIMER_LATENCY;
+}
+
+// Drops the frame being recorded, e.g. when it turned out to have no work.
+static void cancel_gpu_frame(GpuTimer &t) {
+  t.frame++;
+  t.recording = nullptr;
+}
+
+static bool gpu_query_available(GLuint query) {
+  GLint available = 0;
+  glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+  return available != 0;
+}
+
+// Hands every frame whose queries have resolved to `on_timing`. Never waits
+// for the GPU.
+template <typename F> static void collect_gpu_timer(GpuTimer &t, F on_timing) {
+  if (!t.enabled)
+    return;
+
+  // The offset between the clocks drifts slowly, refresh it once a second.
+  if (monotonic_ns() - t.last_calibration_ns > 1000000000) {
+    calibrate_gpu_timer(t);
+  }
+
+  for (GpuTimerFrame &f : t.frames) {
+    if (!f.pending)
+      continue;
+
+    bool available = true;
+    for (int i = 0; i < GPU_PASS_COUNT && available; i++) {
+      if (f.began[i] && !gpu_query_available(f.begin[i]))
+        available = false;
+      if (f.ended[i] && !gpu_query_available(f.end[i]))
+        available = false;
+    }
+    if (!available)
+      continue;
+
+    GpuFrameTiming timing{};
+    timing.frame = f.frame;
+    timing.imu_ts = f.imu_ts;
+    timing.imu_host_ns = f.imu_host_ns;
+    timing.cpu_us = f.cpu_us;
+    timing.cpu_mips_us = f.cpu_mips_us;
+    timing.swap_host_ns = -1;
+    for (int i = 0; i < GPU_PASS_COUNT; i++) {
+      timing.pass_ns[i] = -1;
+      GLuint64 begin = 0, end = 0;
+      if (f.ended[i]) {
+        glGetQueryObjectui64v(f.end[i], GL_QUERY_RESULT, &end);
+      }
+      if (f.began[i] && f.ended[i]) {
+        glGetQueryObjectui64v(f.begin[i], GL_QUERY_RESULT, &begin);
+        timing.pass_ns[i] = int64_t(end - begin);
+      }
+      if (i == GPU_PASS_SWAP && f.ended[i]) {
+        timing.swap_host_ns = int64_t(end) + t.gpu_to_host_ns;
+      }
+    }
+
+    f.pending = false;
+    on_timing(timing);
+  }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cmath>
+
+#include "glasses.hpp"
+
+// Decides whether a frame can be skipped entirely. The capture side skips
+// when the desktop and cursor didn't change (see damage.hpp); the render side
+// skips when there is no new texture, no command, nothing to redraw and the
+// head moved less than `pose_threshold_deg` since the last rendered frame.
+//
+// Comparing against the last rendered pose rather than the previous frame
+// means slow drift still adds up to a redraw eventually.
+struct IdleDetector {
+  bool enabled;
+  float pose_threshold_deg;
+
+  bool has_rendered;
+  float roll, pitch, yaw;
+};
+
+static bool pose_changed_since_render(const IdleDetector &d, const Glasses &g) {
+  if (!d.has_rendered)
+    return true;
+  float t = d.pose_threshold_deg;
+  return fabsf(wrap_degrees(get_roll(g) - d.roll)) > t ||
+         fabsf(wrap_degrees(get_pitch(g) - d.pitch)) > t ||
+         fabsf(wrap_degrees(get_yaw(g) - d.yaw)) > t;
+}
+
+static void idle_mark_rendered(IdleDetector &d, const Glasses &g) {
+  d.has_rendered = true;
+  d.roll = get_roll(g);
+  d.pitch = get_pitch(g);
+  d.yaw = get_yaw(g);
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <unistd.h>
+
+#include "clock.hpp"
+#include "pose.hpp"
+#include "viture.h"
+
+// Switches the IMU report rate with head motion: 60 Hz while reading with a
+// still head, 240 Hz during fast turns. set_imu_fq() is a blocking USB
+// transfer so it runs on its own thread, never on the IMU callback or the
+// render loop.
+//
+// Going up happens as soon as the speed crosses the next level's threshold.
+// Going down needs the speed to stay below a lower threshold for a while, so
+// the rate doesn't flap around a boundary.
+
+struct ImuRateLevel {
+  int value; // IMU_FREQUENCE_*
+  int hz;
+  // Angular speed (deg/s) needed to switch up to this level.
+  float up_deg_s;
+  // Speed below which we may switch back down from this level.
+  float down_deg_s;
+};
+
+static const ImuRateLevel imu_rate_levels[] = {
+    {IMU_FREQUENCE_60, 60, 0.0f, 0.0f},
+    {IMU_FREQUENCE_90, 90, 15.0f, 8.0f},
+    {IMU_FREQUENCE_120, 120, 45.0f, 25.0f},
+    {IMU_FREQUENCE_240, 240, 120.0f, 70.0f},
+};
+
+#define IMU_RATE_LEVEL_COUNT                                                   \
+  int(sizeof(imu_rate_levels) / sizeof(imu_rate_levels[0]))
+
+#define IMU_RATE_POLL_US 20000
+// Speed has to stay below the down threshold this long before stepping down.
+#define IMU_RATE_DOWN_HOLD_NS 1000000000LL
+// Minimum time between two switches in any direction.
+#define IMU_RATE_MIN_DWELL_NS 250000000LL
+// Failed switches double the wait before the next attempt up to this, so a
+// device that stopped answering isn't asked 50 times a second.
+#define IMU_RATE_MAX_RETRY_NS 8000000000LL
+
+struct ImuRateController {
+  PoseEstimator *estimator;
+
+  std::thread thread;
+  std::atomic<bool> running{false};
+
+  int level;
+  // Last attempt to switch, and how long to wait after it.
+  int64_t last_switch_ns;
+  int64_t dwell_ns;
+  int64_t below_since_ns;
+
+  // Exposed for logging and stats.
+  std::atomic<int> hz{0};
+  std::atomic<uint64_t> switches{0};
+};
+
+static int imu_rate_level_for_value(int value) {
+  for (int i = 0; i < IMU_RATE_LEVEL_COUNT; i++) {
+    if (imu_rate_levels[i].value == value)
+      return i;
+  }
+  return -1;
+}
+
+static bool switch_imu_rate(ImuRateController &c, int level) {
+  const ImuRateLevel &to = imu_rate_levels[level];
+
+  // Samples may pause while the device reconfigures; tell the estimator so
+  // the pause is bridged instead of restarting the filter.
+  begin_imu_rate_switch(*c.estimator);
+  int result = set_imu_fq(to.value);
+  end_imu_rate_switch(*c.estimator);
+
+  if (result != ERR_SUCCESS) {
+    fprintf(stderr, "Failed to set imufq=%d on glasses (%d)\n", to.hz, result);
+    return false;
+  }
+
+  printf("IMU rate %d Hz -> %d Hz\n", imu_rate_levels[c.level].hz, to.hz);
+  c.level = level;
+  c.hz = to.hz;
+  c.switches++;
+  return true;
+}
+
+static void try_switch_imu_rate(ImuRateController &c, int level,
+                               int64_t now) {
+  c.last_switch_ns = now;
+  if (switch_imu_rate(c, level)) {
+    c.dwell_ns = IMU_RATE_MIN_DWELL_NS;
+  } else {
+    c.dwell_ns = std::min<int64_t>(c.dwell_ns * 2, IMU_RATE_MAX_RETRY_NS);
+  }
+}
+
+static void imu_rate_thread_main(ImuRateController *c) {
+  while (c->running) {
+    usleep(IMU_RATE_POLL_US);
+
+    int64_t now = monotonic_ns();
+    if (now - c->last_switch_ns < c->dwell_ns)
+      continue;
+
+    float speed = pose_angular_speed(*c->estimator);
+
+    int up = c->level;
+    while (up + 1 < IMU_RATE_LEVEL_COUNT &&
+           speed >= imu_rate_levels[up + 1].up_deg_s) {
+      up++;
+    }
+
+    if (up > c->level) {
+      c->below_since_ns = -1;
+      try_switch_imu_rate(*c, up, now);
+      continue;
+    }
+
+    if (c->level == 0 || speed >= imu_rate_levels[c->level].down_deg_s) {
+      c->below_since_ns = -1;
+      continue;
+    }
+
+    if (c->below_since_ns < 0) {
+      c->below_since_ns = now;
+    } else if (now - c->below_since_ns >= IMU_RATE_DOWN_HOLD_NS) {
+      c->below_since_ns = -1;
+      try_switch_imu_rate(*c, c->level - 1, now);
+    }
+  }
+}
+
+// `initial_value` is the IMU_FREQUENCE_* the glasses were initialized with.
+static bool start_imu_rate_controller(ImuRateController &c,
+                                      PoseEstimator &estimator,
+                                      int initial_value) {
+  int level = imu_rate_level_for_value(initial_value);
+  if (level < 0) {
+    fprintf(stderr, "Unknown initial IMU frequency %d\n", initial_value);
+    return false;
+  }
+
+  c.estimator = &estimator;
+  c.level = level;
+  c.hz = imu_rate_levels[level].hz;
+  c.last_switch_ns = monotonic_ns();
+  c.dwell_ns = IMU_RATE_MIN_DWELL_NS;
+  c.below_since_ns = -1;
+  c.running = true;
+  c.thread = std::thread(imu_rate_thread_main, &c);
+  return true;
+}
+
+static void stop_imu_rate_controller(ImuRateController &c) {
+  c.running = false;
+  if (c.thread.joinable()) {
+    c.thread.join();
+  }
+}
@@ -7,6 +7,7 @@
 #include <X11/extensions/Xfixes.h>
 #include <X11/extensions/Xrandr.h>
 #include <chrono>
+#include <cfloat>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
@@ -18,9 +19,30 @@
 #include <unistd.h> // for usleep
 #include <vector>
 
+#include "alloc_counter.hpp"
+#include "bvh.hpp"
+#include "capture_shm.hpp"
 #include "command_socket.hpp"
+#include "cpu_render.hpp"
+#include "damage.hpp"
+#include "direct_output.hpp"
+#include "frame_recording.hpp"
+#include "frame_stats.hpp"
 #include "glasses.hpp"
+#include "gpu_timer.hpp"
+#include "idle.hpp"
+#include "imu_rate.hpp"
+#include "mat4.hpp"
+#include "options.hpp"
+#include "panel_layout.hpp"
+#include "pixel_format.hpp"
+#include "render_scale.hpp"
+#include "scene.hpp"
+#include "trace.hpp"
+#include "upload_thread.hpp"
+#include "virtual_texture.hpp"
 #include "viture.h"
+#include "window_panels.hpp"
 
 struct Framebuffer {
   XImage *img;
@@ -34,36 +56,138 @@ struct MyMonitor {
 };
 
 float screen_angle_offset_degrees = 0.0f;
+// Vertical field of view, changed by the zoom commands.
+GLdouble fov_degrees = 45.0;
+int64_t pose_prediction_ns = 0;
 bool center_dot_enabled = true;
 
 Display *dpy;
 Window root;
 Window win;
+// Visual and depth `win` was created with.
+Visual *output_visual;
+int output_depth;
+// Where `win` sits: the glasses' output in direct mode, otherwise wherever
+// the window manager puts it.
+int output_x = 0;
+int output_y = 0;
+int output_width = 1920;
+int output_height = 1080;
+bool direct_output_mode = false;
+DirectOutput direct_output;
 GLXContext glc;
+// Rasterize on the CPU instead of through GL.
+bool cpu_render = false;
+CpuRenderer cpu_renderer;
+Window upload_win;
+GLXContext upload_glc;
+UploadThread upload_thread;
+GpuTimer render_timer;
+// Resolution the GL scene is drawn at, and where it is drawn to if reduced.
+RenderScaleController render_scale;
+ScaledTarget scaled_target;
+FrameStats frame_stats;
+ImuRateController imu_rate;
+DesktopDamage desktop_damage;
+IdleDetector idle;
+// Set by X events that require drawing even if nothing else changed.
+bool redraw_requested = true;
 std::vector<MyMonitor> monitors;
-std::vector<MyMonitor *> focusedmonitors;
+// Monitors being worked with, the top one in the lap and the rest on the
+// rings. See panel_layout.hpp.
+PanelStack panel_stack;
+PanelLayout panel_layout;
+// What each monitor looks like as a panel, indexed like `monitors`.
+std::vector<PanelSource> panel_sources;
+// --alloc-test: counts allocations of the frame loops.
+AllocTest alloc_test;
+
+// Window mode: application windows instead of monitors on the ring.
+bool window_mode = false;
+WindowSet window_set;
+
+// Where a window panel sits on the ring, rebuilt whenever the set of windows
+// or the ring offset changes.
+struct WindowPanelPlacement {
+  int panel;
+  // Rotation around the vertical axis, including the ring offset.
+  float angle_deg;
+  float y, w, h;
+};
+std::vector<WindowPanelPlacement> window_placements;
+// Bounds of the placements, kept for their capacity.
+std::vector<Aabb> window_boxes;
+Bvh window_bvh;
+uint64_t window_layout_generation = UINT64_MAX;
+float window_layout_offset = NAN;
+// Texture last acquired for each panel, render side.
+GLuint window_tex[WINDOW_PANELS_MAX];
+// Panel under the gaze in the last rendered frame, -1 if none.
+int gazedWindow = -1;
+
+int focusIndex = 0;
+int focusCandidate = -1;
+int focusFrames = 0;
+const int FOCUS_HOLD_FRAMES = 20;
+// Whether the last rendered frame had the gaze on a thumbnail.
+bool gazeOnThumbnail = false;
 
 void grabMonitor(MyMonitor &m);
 
+// Capture side, only touched by the upload thread.
 Framebuffer framebuffer{};
+// Render side, the texture currently presented by render().
+Framebuffer presented{};
+// Tile table of `presented.tex`.
+const VtPool *presented_pool = nullptr;
+// The desktop as seen by the GL renderer, tiles of which are uploaded on
+// demand.
+VirtualTexture virtual_texture;
+// Tiles drawn this frame, render side.
+std::vector<int> vt_requests;
+// Panels of the monitor mode that are in view, rebuilt every frame. Reserved
+// for the whole layout whenever it changes.
+std::vector<TexturedQuad> panel_quads;
+
+// Where captureDesktop() takes the desktop from.
+CaptureMode capture_mode = CAPTURE_DIRECT;
+CaptureClient capture_client;
+FrameReplay frame_replay;
+// Captured frames go here with --record.
+FrameRecorder frame_recorder;
 
 XShmSegmentInfo shmInfo;
+// Layout of the root window's pixels, picked once at startup.
+const PixelFormat *desktop_format;
 
 void initShm(Display *dpy, Framebuffer &fb);
 
 void cleanupShm(Display *dpy);
 
 void grabFramebuffer(Framebuffer &fb);
-void uploadFramebufferTexture(Framebuffer &fb);
+bool captureDesktop();
+bool grabDesktop();
+bool fetchSharedDesktop();
+bool replayDesktop();
+int runCaptureDaemon(const char *socket_path);
+bool captureAndUpload(UploadSlot &slot);
 
 void getMonitorUVs(const MyMonitor &m, const Framebuffer &fb, float &u0,
                    float &v0, float &u1, float &v1);
 
+Window createOutputWindow(Visual *visual, int depth, unsigned long mask,
+                          XSetWindowAttributes &swa);
 bool initGL();
+bool glIsSoftware();
+void destroyGL();
+bool cpuOutputSupported(Visual *visual, int depth);
+bool initCpuOutput();
 void cleanup();
 void grabMonitor(MyMonitor &m);
 void uploadTexture(MyMonitor &m);
-void render();
+void render(const Glasses &pose);
+void pumpXEvents();
+bool acquireWindowPanels();
 
 void draw_filled_center_rect(float half_width, float half_height) {
   int viewport[4];
@@ -112,54 +236,103 @@ void draw_filled_center_rect(float half_width, float half_height) {
 }
 
 void on_align() {
-  glasses.oroll = -glasses.roll;
-  glasses.opitch = -glasses.pitch;
-  glasses.oyaw = -glasses.yaw;
+  // Align against the filtered pose at its newest sample, not the raw one.
+  align_pose(pose_estimator, 0.0f, 0.0f, 0.0f, {1.0f, 0.0f, 0.0f, 0.0f});
 }
 
+// Moves the lap panel onto the ring, leaving the lap empty.
 void on_push() {
-  for (int i = int(focusedmonitors.size()) - 1; i >= 0; i--) {
-    if (i == int(focusedmonitors.size()) - 1) {
-      focusedmonitors.push_back(focusedmonitors[i]);
-    } else {
-      focusedmonitors[i + 1] = focusedmonitors[i];
-    }
-  }
-  if (focusedmonitors.size() > 0) {
-    focusedmonitors[0] = nullptr;
+  if (panel_stack.count > 0) {
+    panel_stack_push(panel_stack, PANEL_NONE);
   }
 }
 
-void on_pop() {
-  for (int i = 0; i < focusedmonitors.size(); i++) {
-    if (i == int(focusedmonitors.size()) - 1) {
-      focusedmonitors[i] = nullptr;
-    } else {
-      focusedmonitors[i] = focusedmonitors[i + 1];
-    }
-  }
-  if (focusedmonitors.size() > 0) {
-    focusedmonitors.pop_back();
-  }
-}
+void on_pop() { panel_stack_pop(panel_stack); }
 
-void on_zoom_in() { glasses.fov *= 0.99;  }
+void on_zoom_in() { fov_degrees *= 0.99;  }
 
-void on_zoom_out() { glasses.fov *= 1.01; }
+void on_zoom_out() { fov_degrees *= 1.01; }
 
 void on_shift_left() { screen_angle_offset_degrees += 5.0f; }
 void on_shift_right() { screen_angle_offset_degrees -= 5.0f; }
 
 void on_toggle_center_dot() { center_dot_enabled = !center_dot_enabled; }
 
+void on_upload_timing(const GpuFrameTiming &timing) {
+  frame_stats_add_timing(frame_stats, "upload", timing);
+}
+
+void on_render_timing(const GpuFrameTiming &timing) {
+  frame_stats_add_timing(frame_stats, "render", timing);
+  if (scaled_target.enabled &&
+      update_render_scale(render_scale, timing.frame,
+                          timing.pass_ns[GPU_PASS_PANELS],
+                          render_timer.frame)) {
+    printf("Render scale %.2f (%dx%d)\n", render_scale.scale,
+           int(output_width * render_scale.scale + 0.5f),
+           int(output_height * render_scale.scale + 0.5f));
+  }
+}
+
 int main(int argc, char **argv) {
-  if (init_glasses() != ERR_SUCCESS) {
-    fprintf(stderr, "Failed to setup glasses\n");
+  Options options;
+  if (!parse_options(argc, argv, options)) {
     return 1;
   }
+  if (options.frame_log && !open_frame_log(frame_stats, options.frame_log)) {
+    return 1;
+  }
+
+  pose_estimator.config = options.pose_filter;
+  pose_prediction_ns = int64_t(options.prediction_ms * 1e6f);
 
-  glasses.fov = 45.0;
-  on_align();
+  // The upload thread grabs the framebuffer on the same connection.
+  if (!XInitThreads()) {
+    fprintf(stderr, "Failed to init Xlib threads\n");
+    return 1;
+  }
+
+  dpy = XOpenDisplay(NULL);
+  if (!dpy) {
+    fprintf(stderr, "Cannot open display\n");
+    return 1;
+  }
+  int screen = DefaultScreen(dpy);
+  root = RootWindow(dpy, screen);
+
+  desktop_format = find_pixel_format(dpy, DefaultVisual(dpy, screen),
+                                     DefaultDepth(dpy, screen));
+  if (!desktop_format) {
+    fprintf(stderr, "Unsupported desktop visual (depth %d)\n",
+            DefaultDepth(dpy, screen));
+    return 1;
+  }
+  printf("Desktop pixel format: %s\n", desktop_format->name);
+
+  const char *capture_socket =
+      options.capture_socket ? options.capture_socket : CAPTURE_SOCKET_PATH;
+  idle.enabled = options.idle;
+  idle.pose_threshold_deg = options.idle_threshold_deg;
+  if (options.capture == CAPTURE_DAEMON) {
+    return runCaptureDaemon(capture_socket);
+  }
+  capture_mode = options.capture;
+  if (capture_mode == CAPTURE_CLIENT &&
+      !init_capture_client(capture_client, capture_socket, desktop_format)) {
+    return 1;
+  }
+  if (capture_mode == CAPTURE_REPLAY) {
+    if (!open_frame_replay(frame_replay, options.replay,
+                           options.replay_max_rate)) {
+      return 1;
+    }
+    desktop_format = find_pixel_format_by_name(frame_replay.header->format);
+    if (!desktop_format) {
+      fprintf(stderr, "Unknown pixel format %.16s in the recording\n",
+              frame_replay.header->format);
+      return 1;
+    }
+  }
 
   on_align_command = on_align;
   on_push_command = on_push;
@@ -169,6 +342,7 @@ int main(int argc, char **argv) {
   on_shift_left_command = on_shift_left;
   on_shift_right_command = on_shift_right;
   on_toggle_center_dot_command = on_toggle_center_dot;
+  on_trace_dump_command = dump_trace_command;
   int command_sockfd = setup_command_socket();
   if (command_sockfd < 0) {
     fprintf(stderr, "Failed to create command socket\n");
@@ -179,13 +353,6 @@ int main(int argc, char **argv) {
     // handle error
   }
 
-  dpy = XOpenDisplay(NULL);
-  if (!dpy) {
-    fprintf(stderr, "Cannot open display\n");
-    return 1;
-  }
-  int screen = DefaultScreen(dpy);
-  root = RootWindow(dpy, screen);
 
   // Get XRR monitors
   int n;
@@ -196,7 +363,7 @@ int main(int argc, char **argv) {
   }
 
   int excludeIndex = -1;
-  if (argc == 1) {
+  if (!options.has_exclude_index) {
     // No argument: list monitors and exit
     printf("Detected monitors:\n");
     for (int i = 0; i < n; i++) {
@@ -217,8 +384,7 @@ int main(int argc, char **argv) {
     XCloseDisplay(dpy);
     return 0;
   } else {
-    // Parse excluded monitor index from first argument
-    excludeIndex = atoi(argv[1]);
+    excludeIndex = options.exclude_index;
     if (excludeIndex < 0 || excludeIndex >= n) {
       fprintf(stderr, "Invalid exclude monitor index %d (0 to %d allowed)\n",
               excludeIndex, n - 1);
@@ -243,66 +409,223 @@ ok:
     monitors.push_back(m);
   }
 
+  if (capture_mode == CAPTURE_REPLAY) {
+    // Panels show the monitors the recording was made with.
+    monitors.clear();
+    for (int i = 0; i < frame_replay.header->monitor_count; i++) {
+      const FrameRecordingMonitor &rm = frame_replay.header->monitors[i];
+      monitors.push_back({rm.x, rm.y, rm.width, rm.height, i});
+    }
+  }
+  init_panel_stack(panel_stack, int(monitors.size()) + 1);
+  panel_sources.reserve(monitors.size());
+  if (options.record) {
+    std::vector<FrameRecordingMonitor> layout;
+    for (const MyMonitor &m : monitors) {
+      layout.push_back({m.x, m.y, m.width, m.height});
+    }
+    if (!open_frame_recorder(frame_recorder, options.record, desktop_format,
+                             layout.data(), int(layout.size()))) {
+      return 1;
+    }
+  }
+
+  if (options.direct_output) {
+    const XRRMonitorInfo &glasses_monitor = xrrmonitors[excludeIndex];
+    output_x = glasses_monitor.x;
+    output_y = glasses_monitor.y;
+    output_width = glasses_monitor.width;
+    output_height = glasses_monitor.height;
+    direct_output_mode = true;
+    printf("Direct output on monitor %d: %dx%d+%d+%d\n", excludeIndex,
+           output_width, output_height, output_x, output_y);
+  }
+
   XRRFreeMonitors(xrrmonitors);
 
-  if (!initGL()) {
-    fprintf(stderr, "Failed to init GL\n");
+  // Start at 120 Hz when adapting, the controller takes it from there. Until
+  // the glasses deliver samples we render a fixed pose; the first sample
+  // aligns the view.
+  bool adaptive_imu_rate = options.imu_fq < 0;
+  int imu_fq = adaptive_imu_rate ? IMU_FREQUENCE_120 : options.imu_fq;
+  // Only now that this is surely a viewer, the capture daemon and listing the
+  // monitors have nothing to broadcast.
+  if (options.pose_shm && !open_pose_publisher(pose_publisher)) {
+    fprintf(stderr, "Pose broadcast disabled\n");
+  }
+  printf("Connecting to the glasses in the background\n");
+  start_glasses_link(glasses_link, imu_fq,
+                     adaptive_imu_rate ? &imu_rate : nullptr);
+
+  cpu_render = options.render == RENDER_CPU;
+  if (!cpu_render) {
+    if (!initGL()) {
+      fprintf(stderr, "Failed to init GL\n");
+      cleanup();
+      return 1;
+    }
+    if (options.render == RENDER_AUTO && glIsSoftware() &&
+        cpuOutputSupported(output_visual, output_depth)) {
+      printf("GL renders in software (%s), using the CPU renderer\n",
+             (const char *)glGetString(GL_RENDERER));
+      destroyGL();
+      cpu_render = true;
+    }
+  }
+  if (cpu_render && !initCpuOutput()) {
+    fprintf(stderr, "Failed to init CPU renderer\n");
     cleanup();
     return 1;
   }
 
+  static __useconds_t second = 1000000;
+  static __useconds_t fps = 120;
+  static __useconds_t us = second / fps;
+
+  init_desktop_damage(desktop_damage, dpy, root);
+  if (options.windows && cpu_render) {
+    fprintf(stderr, "Window panels need the GL renderer, showing monitors\n");
+  } else if (options.windows &&
+             (capture_mode == CAPTURE_REPLAY || options.record)) {
+    fprintf(stderr, "Window panels aren't recorded, showing monitors\n");
+  } else if (options.windows) {
+    window_mode = init_window_set(window_set, dpy, root, win);
+  }
+  if (!cpu_render) {
+    float anisotropy = gl_anisotropy(options.anisotropy);
+    virtual_texture.mipmaps = options.mipmaps;
+    virtual_texture.anisotropy = anisotropy;
+    // Window textures are mipmapped by GL.
+    window_set.mipmaps = options.mipmaps &&
+                         gl_has_extension("GL_ARB_framebuffer_object");
+    window_set.anisotropy = anisotropy;
+    if (options.mipmaps) {
+      printf("Mipmapped panels, anisotropy %.0f\n", anisotropy);
+    }
+  }
+
+  // The CPU renderer samples the grabbed image directly, there is nothing
+  // to upload.
+  if (!cpu_render) {
+    upload_thread.dpy = dpy;
+    upload_thread.drawable = upload_win;
+    upload_thread.ctx = upload_glc;
+    upload_thread.produce = captureAndUpload;
+    // Replaying at the maximum rate uploads as fast as the GPU allows.
+    bool max_rate = capture_mode == CAPTURE_REPLAY && options.replay_max_rate;
+    upload_thread.interval_us = max_rate ? 0 : us;
+    // Pick up the daemon's frames as soon as they are published.
+    upload_thread.wait_fd =
+        capture_mode == CAPTURE_CLIENT ? capture_client.event_fd : -1;
+    upload_thread.on_timing = on_upload_timing;
+    start_upload_thread(upload_thread);
+
+    // Without GPU timings there is nothing to adapt to.
+    init_render_scale(render_scale, options.render_scale);
+    if (init_gpu_timer(render_timer) &&
+        (options.render_scale.min_scale != 1.0f ||
+         options.render_scale.max_scale != 1.0f) &&
+        init_scaled_target(scaled_target, output_width, output_height,
+                           options.render_scale.max_scale)) {
+      printf("Dynamic resolution between %.2f and %.2f, %.1f ms budget\n",
+             options.render_scale.min_scale, options.render_scale.max_scale,
+             options.render_scale.budget_ms);
+    }
+  }
+
   long highest = 0;
   int delay_highest_check_frames = 1000;
   int frame = 0;
 
-  while (true) {
+  alloc_test.enabled = options.alloc_test;
+  if (alloc_test.enabled) {
+    count_thread_allocations();
+  }
+  int status = -1;
+
+  TRACE_THREAD("render");
+  while (status < 0) {
     auto start = std::chrono::high_resolution_clock::now();
-    // std::cout << "fb size: " << framebuffer.width << "x" <<
-    // framebuffer.height
-    //           << "\n";
-    // auto grabStart = std::chrono::high_resolution_clock::now();
-    //  for (MyMonitor &m : monitors) {
-    //    grabMonitor(m);
-    //  }
-    grabFramebuffer(framebuffer);
-    // auto grabEnd = std::chrono::high_resolution_clock::now();
-    // auto grabMs = std::chrono::duration_cast<std::chrono::microseconds>(
-    //                   grabEnd - grabStart)
-    //                   .count();
-    // std::cout << "grab took " << grabMs << "us\n";
-
-    auto uploadStart = std::chrono::high_resolution_clock::now();
-    uploadFramebufferTexture(framebuffer);
-    auto uploadEnd = std::chrono::high_resolution_clock::now();
-    auto uploadMs = std::chrono::duration_cast<std::chrono::microseconds>(
-                        uploadEnd - uploadStart)
-                        .count();
-    // std::cout << "upload took " << uploadMs << "us\n";
+    if (alloc_test.enabled && (status = alloc_test_frame(alloc_test)) >= 0) {
+      break;
+    }
+
+    pumpXEvents();
 
     auto pollStart = std::chrono::high_resolution_clock::now();
-    poll_commands(command_sockfd);
+    bool command = poll_commands(command_sockfd);
+    if (command) {
+      TRACE_INSTANT("command");
+    }
     auto pollEnd = std::chrono::high_resolution_clock::now();
     auto pollMs = std::chrono::duration_cast<std::chrono::microseconds>(
                       pollEnd - pollStart)
                       .count();
     // std::cout << "poll took " << pollMs << "us\n";
 
+    // With GL, grabbing and uploading happen on the upload thread, just pick
+    // up whatever has finished transferring. The CPU renderer grabs here.
+    bool updated = false;
+    if (cpu_render) {
+      updated = captureDesktop();
+      presented.width = framebuffer.width;
+      presented.height = framebuffer.height;
+    } else {
+      TRACE_SCOPE("acquire");
+      const UploadSlot &slot = acquire_uploaded_slot(upload_thread, updated);
+      presented.tex = slot.tex;
+      presented.width = slot.width;
+      presented.height = slot.height;
+      presented_pool = slot.vt;
+      if (window_mode && acquireWindowPanels()) {
+        updated = true;
+      }
+    }
+
+    // Render with the pose expected by the time this frame is displayed.
+    Glasses pose = predicted_glasses(monotonic_ns() + pose_prediction_ns);
+
+    // Nothing to show that isn't already on screen: skip drawing and
+    // swapping altogether. Gaze dwell on a thumbnail counts frames, so it
+    // prevents idling too.
+    bool skip = idle.enabled && !command && !updated && !redraw_requested &&
+                !gazeOnThumbnail && !pose_changed_since_render(idle, pose) &&
+                !(window_mode &&
+                  window_set.generation != window_layout_generation);
+    frame_stats_count_tick(frame_stats, IDLE_RENDER, skip);
+    if (skip) {
+      TRACE_INSTANT("idle");
+      frame_stats_report(frame_stats);
+      auto duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::high_resolution_clock::now() - start)
+                             .count();
+      if (us > duration_us) {
+        usleep(us - duration_us);
+      }
+      continue;
+    }
+
     auto renderStart = std::chrono::high_resolution_clock::now();
-    render();
+    begin_gpu_frame(render_timer);
+    render(pose);
+    idle_mark_rendered(idle, pose);
+    redraw_requested = false;
     auto renderEnd = std::chrono::high_resolution_clock::now();
     auto renderMs = std::chrono::duration_cast<std::chrono::microseconds>(
                         renderEnd - renderStart)
                         .count();
     // std::cout << "render took " << renderMs << "us\n";
 
-    static __useconds_t second = 1000000;
-    static __useconds_t fps = 120;
-    static __useconds_t us = second / fps;
     auto end = std::chrono::high_resolution_clock::now();
     auto duration_us =
         std::chrono::duration_cast<std::chrono::microseconds>(end - start)
             .count();
 
+    end_gpu_frame(render_timer, duration_us);
+    frame_stats_add(frame_stats, METRIC_CPU_FRAME, duration_us);
+    collect_gpu_timer(render_timer, on_render_timing);
+    frame_stats_report(frame_stats);
+
     if (frame > delay_highest_check_frames) {
       if (highest < duration_us) {
         std::cout << "new highest frame time: " << duration_us << " us\n";
@@ -320,12 +643,14 @@ ok:
 
   cleanup();
   destroy_command_socket(command_sockfd);
-  return 0;
+  return status;
 }
 
 void initShm(Display *dpy, Framebuffer &fb) {
-  fb.img = XShmCreateImage(dpy, DefaultVisual(dpy, DefaultScreen(dpy)), 24,
-                           ZPixmap, NULL, &shmInfo, fb.width, fb.height);
+  int screen = DefaultScreen(dpy);
+  fb.img = XShmCreateImage(dpy, DefaultVisual(dpy, screen),
+                           DefaultDepth(dpy, screen), ZPixmap, NULL, &shmInfo,
+                           fb.width, fb.height);
   if (!fb.img) {
     std::cerr << "oh no error\n";
     return;
@@ -377,61 +702,261 @@ void grabFramebuffer(Framebuffer &fb) {
   XShmGetImage(dpy, root, fb.img, 0, 0, AllPlanes);
 }
 
-void uploadFramebufferTexture(Framebuffer &fb) {
-  if (fb.tex == 0) {
-    glGenTextures(1, &fb.tex);
+// Pointer position as of the last pointerMoved().
+int pointer_x = -1, pointer_y = -1;
+
+// Returns true if the pointer moved since the last call.
+bool pointerMoved() {
+  Window root_ret, child_ret;
+  int x, y, win_x, win_y;
+  unsigned int mask;
+  if (!XQueryPointer(dpy, root, &root_ret, &child_ret, &x, &y, &win_x,
+                     &win_y, &mask)) {
+    return false;
   }
+  bool moved = x != pointer_x || y != pointer_y;
+  pointer_x = x;
+  pointer_y = y;
+  return moved;
+}
 
-  // Add cursor to fb.img->data before uploading
+DirtyRegion capture_dirty;
+// Where the cursor was blended in by the last grab.
+DirtyRect cursor_rect{};
+
+// The cursor's shape, only fetched again when XFixes reports a change. Its
+// position is the pointer's.
+XFixesCursorImage cursor_image{};
+std::vector<unsigned long> cursor_pixels;
+
+void fetchCursorShape() {
   XFixesCursorImage *ci = XFixesGetCursorImage(dpy);
-  if (ci) {
-    int cursor_x = ci->x - ci->xhot;
-    int cursor_y = ci->y - ci->yhot;
+  if (!ci) {
+    cursor_image.width = 0;
+    cursor_image.height = 0;
+    return;
+  }
+  cursor_pixels.assign(ci->pixels,
+                       ci->pixels + size_t(ci->width) * ci->height);
+  cursor_image.width = ci->width;
+  cursor_image.height = ci->height;
+  cursor_image.xhot = ci->xhot;
+  cursor_image.yhot = ci->yhot;
+  cursor_image.pixels = cursor_pixels.data();
+  XFree(ci);
+}
 
-    for (unsigned int cy = 0; cy < ci->height; ++cy) {
-      int img_y = cursor_y + cy;
-      if (img_y < 0 || img_y >= fb.height)
-        continue;
+// Blends the cursor into a fresh grab. Both where it was and where it is now
+// differ from the previous grab. Call after pointerMoved().
+void blendCursor(XImage *img, bool shape_changed) {
+  dirty_region_add(capture_dirty, cursor_rect);
+  cursor_rect = {};
+  // Without XFixes events there is no telling when the shape changed.
+  if (shape_changed || desktop_damage.fixes_event_base < 0) {
+    fetchCursorShape();
+  }
+  if (cursor_image.width == 0) {
+    return;
+  }
+  cursor_image.x = pointer_x;
+  cursor_image.y = pointer_y;
+  desktop_format->blend_cursor(img, &cursor_image, 0, 0);
+  cursor_rect = {pointer_x - cursor_image.xhot, pointer_y - cursor_image.yhot,
+                 int(cursor_image.width), int(cursor_image.height)};
+  dirty_region_add(capture_dirty, cursor_rect);
+}
 
-      for (unsigned int cx = 0; cx < ci->width; ++cx) {
-        int img_x = cursor_x + cx;
-        if (img_x < 0 || img_x >= fb.width)
-          continue;
+bool takeDesktopDamage() {
+  int width = DisplayWidth(dpy, DefaultScreen(dpy));
+  int height = DisplayHeight(dpy, DefaultScreen(dpy));
+  return take_desktop_damage(desktop_damage, capture_dirty, width, height);
+}
 
-        unsigned long cursor_pixel = ci->pixels[cy * ci->width + cx];
+// Brings `framebuffer` and `capture_dirty` up to date from wherever the
+// desktop comes from, recording the frame with --record. Returns false if
+// nothing changed.
+bool captureDesktop() {
+  TRACE_SCOPE("capture");
+  bool updated;
+  switch (capture_mode) {
+  case CAPTURE_CLIENT:
+    updated = fetchSharedDesktop();
+    break;
+  case CAPTURE_REPLAY:
+    updated = replayDesktop();
+    break;
+  default:
+    updated = grabDesktop();
+    break;
+  }
+  if (updated) {
+    record_frame(frame_recorder, framebuffer.img, capture_dirty);
+  }
+  return updated;
+}
 
-        unsigned char a = (cursor_pixel >> 24) & 0xFF;
-        if (a == 0)
-          continue;
+// Grabs the desktop into `framebuffer` with the cursor blended in. Returns
+// false if nothing changed since the last grab.
+bool grabDesktop() {
+  bool damaged = takeDesktopDamage();
+  bool cursor_changed = desktop_damage.cursor_changed.exchange(false);
+  // The cursor is blended in on our side, so moving it alone changes the
+  // texture.
+  bool moved = pointerMoved();
+  bool first = framebuffer.img == nullptr;
+
+  bool skip = idle.enabled && !first && !damaged && !cursor_changed && !moved;
+  frame_stats_count_tick(frame_stats, IDLE_CAPTURE, skip);
+  if (skip) {
+    return false;
+  }
 
-        unsigned char r = (cursor_pixel >> 16) & 0xFF;
-        unsigned char g = (cursor_pixel >> 8) & 0xFF;
-        unsigned char b = (cursor_pixel) & 0xFF;
+  grabFramebuffer(framebuffer);
+  blendCursor(framebuffer.img, cursor_changed);
+  return true;
+}
 
-        unsigned char *p = (unsigned char *)fb.img->data +
-                           img_y * fb.img->bytes_per_line + img_x * 4;
+// Client mode: copies what changed in the daemon's newest frame into
+// `framebuffer`, which then is a plain XImage rather than a shm one.
+bool fetchSharedDesktop() {
+  int width, height;
+  CaptureFetch fetch = fetch_capture_frame(capture_client, framebuffer.img,
+                                           capture_dirty, width, height);
+  if (fetch == CAPTURE_FETCH_RESIZED) {
+    if (framebuffer.img) {
+      XDestroyImage(framebuffer.img);
+    }
+    int screen = DefaultScreen(dpy);
+    framebuffer.img = XCreateImage(dpy, DefaultVisual(dpy, screen),
+                                   DefaultDepth(dpy, screen), ZPixmap, 0,
+                                   nullptr, width, height, 32, 0);
+    framebuffer.img->data =
+        (char *)malloc(size_t(framebuffer.img->bytes_per_line) * height);
+    framebuffer.width = width;
+    framebuffer.height = height;
+    fetch = fetch_capture_frame(capture_client, framebuffer.img,
+                                capture_dirty, width, height);
+  }
+  bool updated = fetch == CAPTURE_FETCH_UPDATED;
+  frame_stats_count_tick(frame_stats, IDLE_CAPTURE, !updated);
+  return updated;
+}
 
-        unsigned char bg_b = p[0];
-        unsigned char bg_g = p[1];
-        unsigned char bg_r = p[2];
+// Replay: points `framebuffer` at the next due frame inside the recording.
+// The cursor was blended in when it was recorded.
+bool replayDesktop() {
+  const FrameRecord *rec = next_replay_frame(frame_replay, capture_dirty);
+  frame_stats_count_tick(frame_stats, IDLE_CAPTURE, !rec);
+  if (!rec) {
+    return false;
+  }
+  if (!framebuffer.img || framebuffer.width != rec->width ||
+      framebuffer.height != rec->height) {
+    if (framebuffer.img) {
+      framebuffer.img->data = nullptr;
+      XDestroyImage(framebuffer.img);
+    }
+    int screen = DefaultScreen(dpy);
+    framebuffer.img = XCreateImage(dpy, DefaultVisual(dpy, screen),
+                                   DefaultDepth(dpy, screen), ZPixmap, 0,
+                                   nullptr, rec->width, rec->height, 32,
+                                   rec->stride);
+    framebuffer.width = rec->width;
+    framebuffer.height = rec->height;
+  }
+  framebuffer.img->data = (char *)frame_pixels(rec);
+  return true;
+}
 
-        float alpha = a / 255.0f;
-        float inv_alpha = 1.0f - alpha;
+// --capture-daemon: grabs the desktop for --capture-client instances until
+// killed, skipping grabs while nobody is connected or nothing changed.
+int runCaptureDaemon(const char *socket_path) {
+  CaptureDaemon daemon{};
+  if (!init_capture_daemon(daemon, dpy, desktop_format, socket_path)) {
+    destroy_capture_daemon(daemon);
+    return 1;
+  }
+  init_desktop_damage(desktop_damage, dpy, root);
+  printf("Capture daemon listening on %s\n", socket_path);
 
-        p[0] = (unsigned char)(b * alpha + bg_b * inv_alpha); // B
-        p[1] = (unsigned char)(g * alpha + bg_g * inv_alpha); // G
-        p[2] = (unsigned char)(r * alpha + bg_r * inv_alpha); // R
-        p[3] = 255;                                           // A
+  const useconds_t interval_us = 1000000 / 120;
+  bool force = true;
+  while (true) {
+    auto start = std::chrono::steady_clock::now();
+
+    pumpXEvents();
+    // Newcomers have no copy yet, they need a frame even on a still desktop.
+    force |= service_capture_clients(daemon);
+
+    int width = DisplayWidth(dpy, DefaultScreen(dpy));
+    int height = DisplayHeight(dpy, DefaultScreen(dpy));
+    bool damaged = takeDesktopDamage();
+    bool cursor_changed = desktop_damage.cursor_changed.exchange(false);
+    bool moved = pointerMoved();
+    bool changed = force || damaged || cursor_changed || moved;
+    if (daemon.client_count > 0 && (!idle.enabled || changed)) {
+      XImage *img = begin_capture_frame(daemon, width, height);
+      if (!img) {
+        break;
       }
+      XShmGetImage(dpy, root, img, 0, 0, AllPlanes);
+      blendCursor(img, cursor_changed || force);
+      end_capture_frame(daemon, capture_dirty);
+      force = false;
     }
-    XFree(ci);
+
+    auto duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    if (interval_us > duration_us) {
+      usleep(interval_us - duration_us);
+    }
+  }
+
+  destroy_desktop_damage(desktop_damage);
+  destroy_capture_daemon(daemon);
+  XCloseDisplay(dpy);
+  return 1;
+}
+
+bool captureAndUpload(UploadSlot &slot) {
+  // Flagged from here since the flag is per thread.
+  if (alloc_test.enabled) {
+    count_thread_allocations();
+  }
+  if (window_mode) {
+    TRACE_SCOPE("window_capture");
+    // Window pixmaps don't carry the cursor, so only damage matters. Windows
+    // that come into view are captured regardless.
+    refresh_window_set(window_set);
+    bool damaged = takeDesktopDamage();
+    bool published = capture_window_panels(
+        window_set, !idle.enabled || damaged, upload_thread.timer);
+    frame_stats_count_tick(frame_stats, IDLE_CAPTURE, !published);
+    return false;
   }
 
-  glBindTexture(GL_TEXTURE_2D, fb.tex);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, fb.width, fb.height, 0, GL_BGRA,
-               GL_UNSIGNED_BYTE, fb.img->data);
+  // Tiles coming into view need uploading even if the desktop is unchanged.
+  if (captureDesktop()) {
+    vt_set_size(virtual_texture, framebuffer.width, framebuffer.height);
+    vt_invalidate(virtual_texture, capture_dirty);
+    if (virtual_texture.mipmaps) {
+      TRACE_SCOPE("mips");
+      int64_t mips_start = monotonic_ns();
+      vt_update_mips(virtual_texture, framebuffer.img, desktop_format,
+                     capture_dirty);
+      int64_t mips_us = (monotonic_ns() - mips_start) / 1000;
+      frame_stats_add(frame_stats, METRIC_CPU_MIPS, mips_us);
+      if (upload_thread.timer.recording) {
+        upload_thread.timer.recording->cpu_mips_us = mips_us;
+      }
+    }
+  }
+  if (!framebuffer.img) {
+    return false;
+  }
+  TRACE_SCOPE("vt_update");
+  return vt_update(virtual_texture, slot, framebuffer.img, desktop_format);
 }
 
 void getMonitorUVs(const MyMonitor &m, const Framebuffer &fb, float &u0,
@@ -516,6 +1041,20 @@ void getMonitorUVs(const MyMonitor &m, const Framebuffer &fb, float &u0,
 //                   GL_UNSIGNED_BYTE, m.img->data);
 // }
 
+Window createOutputWindow(Visual *visual, int depth, unsigned long mask,
+                          XSetWindowAttributes &swa) {
+  if (direct_output_mode) {
+    direct_output_attributes(swa, mask);
+  }
+  Window w = XCreateWindow(dpy, root, output_x, output_y, output_width,
+                           output_height, 0, depth, InputOutput, visual, mask,
+                           &swa);
+  if (direct_output_mode) {
+    init_direct_output(direct_output, dpy, w);
+  }
+  return w;
+}
+
 bool initGL() {
   int screen = DefaultScreen(dpy);
 
@@ -533,8 +1072,10 @@ bool initGL() {
   swa.colormap = cmap;
   swa.event_mask = ExposureMask | KeyPressMask;
 
-  win = XCreateWindow(dpy, root, 0, 0, 1920, 1080, 0, vi->depth, InputOutput,
-                      vi->visual, CWColormap | CWEventMask, &swa);
+  win = createOutputWindow(vi->visual, vi->depth, CWColormap | CWEventMask,
+                           swa);
+  output_visual = vi->visual;
+  output_depth = vi->depth;
 
   XMapWindow(dpy, win);
   XStoreName(dpy, win, "Multi-monitor viewer");
@@ -542,6 +1083,15 @@ bool initGL() {
   glc = glXCreateContext(dpy, vi, NULL, GL_TRUE);
   glXMakeCurrent(dpy, win, glc);
 
+  // Never mapped, it only exists so the upload context has a drawable.
+  upload_win = XCreateWindow(dpy, root, 0, 0, 1, 1, 0, vi->depth, InputOutput,
+                             vi->visual, CWColormap, &swa);
+  upload_glc = glXCreateContext(dpy, vi, glc, GL_TRUE);
+  if (!upload_glc) {
+    fprintf(stderr, "Failed to create shared upload context\n");
+    return false;
+  }
+
   glEnable(GL_TEXTURE_2D);
   glClearColor(0.0f, 0.0f, 0.0f, 1.f);
 
@@ -550,13 +1100,70 @@ bool initGL() {
 
   glMatrixMode(GL_PROJECTION);
   glLoadIdentity();
-  gluPerspective(60.0, 1920.0 / 1080.0, 1.0, 1000.0);
+  gluPerspective(60.0, double(output_width) / output_height, 1.0, 1000.0);
 
   glMatrixMode(GL_MODELVIEW);
 
   return true;
 }
 
+// Whether the GL context renders on the CPU anyway.
+bool glIsSoftware() {
+  const char *renderer = (const char *)glGetString(GL_RENDERER);
+  if (!renderer)
+    return false;
+  return strstr(renderer, "llvmpipe") || strstr(renderer, "softpipe") ||
+         strstr(renderer, "Software Rasterizer");
+}
+
+// Drops the GL contexts, keeping the output window.
+void destroyGL() {
+  glXMakeCurrent(dpy, None, NULL);
+  if (upload_glc) {
+    glXDestroyContext(dpy, upload_glc);
+    upload_glc = nullptr;
+  }
+  if (upload_win) {
+    XDestroyWindow(dpy, upload_win);
+    upload_win = 0;
+  }
+  if (glc) {
+    glXDestroyContext(dpy, glc);
+    glc = nullptr;
+  }
+}
+
+// The CPU renderer reads and writes 32-bit BGRA only.
+bool cpuOutputSupported(Visual *visual, int depth) {
+  const PixelFormat *bgra = pixel_format<FormatBgra8888>();
+  return desktop_format == bgra &&
+         find_pixel_format(dpy, visual, depth) == bgra;
+}
+
+// Sets up the CPU renderer, creating the output window unless GL already did.
+bool initCpuOutput() {
+  if (!win) {
+    int screen = DefaultScreen(dpy);
+    output_visual = DefaultVisual(dpy, screen);
+    output_depth = DefaultDepth(dpy, screen);
+
+    XSetWindowAttributes swa;
+    swa.event_mask = ExposureMask | KeyPressMask;
+    swa.background_pixel = BlackPixel(dpy, screen);
+    win = createOutputWindow(output_visual, output_depth,
+                             CWEventMask | CWBackPixel, swa);
+    XMapWindow(dpy, win);
+    XStoreName(dpy, win, "Multi-monitor viewer");
+  }
+
+  if (!cpuOutputSupported(output_visual, output_depth)) {
+    fprintf(stderr, "CPU renderer needs a 32-bit BGRA desktop and output\n");
+    return false;
+  }
+  return init_cpu_renderer(cpu_renderer, dpy, win, output_visual,
+                           output_depth, output_width, output_height);
+}
+
 struct Vec3 {
   float x, y, z;
 
@@ -576,73 +1183,223 @@ Vec3 cross(Vec3 a, Vec3 b) {
   return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
 }
 
-int focusIndex = 0;
-int focusCandidate = -1;
-int focusFrames = 0;
-const int FOCUS_HOLD_FRAMES = 20;
-
 // Convert head orientation to direction vector
-void getLookVector(float &dx, float &dy, float &dz) {
-  float pitchRad = get_pitch(glasses) * M_PI / 180.0;
-  float yawRad = get_yaw(glasses) * M_PI / 180.0;
+void getLookVector(const Glasses &g, float &dx, float &dy, float &dz) {
+  float pitchRad = get_pitch(g) * M_PI / 180.0;
+  float yawRad = get_yaw(g) * M_PI / 180.0;
 
   dx = sin(yawRad) * -cos(pitchRad);
   dy = -sin(pitchRad);
   dz = -cos(yawRad) * cos(pitchRad);
 }
 
-bool isLookingAt(float eyeX, float eyeY, float eyeZ, float rayX, float rayY,
-                 float rayZ, float centerX, float centerY, float centerZ,
-                 float width, float height) {
-  // Avoid division by zero for ray parallel to plane
-  if (fabs(rayZ) < 1e-5)
-    return false;
+void pumpXEvents() {
+  TRACE_SCOPE("pump_x");
+  while (XPending(dpy)) {
+    XEvent ev;
+    XNextEvent(dpy, &ev);
+    if (handle_desktop_damage_event(desktop_damage, ev)) {
+      continue;
+    }
+    if (handle_window_set_event(window_set, ev)) {
+      continue;
+    }
+    if (handle_direct_output_event(direct_output, ev)) {
+      continue;
+    }
+    if (ev.type == Expose) {
+      redraw_requested = true;
+    }
+  }
+}
 
-  // Calculate intersection parameter t for plane Z = centerZ
-  float t = (centerZ - eyeZ) / rayZ;
+// Picks up finished window uploads and frees panels of closed windows.
+// Returns true if any panel texture changed.
+bool acquireWindowPanels() {
+  reap_window_panels(window_set);
+  bool any = false;
+  for (int i = 0; i < WINDOW_PANELS_MAX; i++) {
+    WindowPanel &p = window_set.panels[i];
+    if (p.state != WINDOW_PANEL_LIVE) {
+      window_tex[i] = 0;
+      continue;
+    }
+    bool updated = false;
+    window_tex[i] = mailbox_acquire(p.mailbox, updated).tex;
+    any = any || updated;
+  }
+  return any;
+}
 
-  // Intersection must be in front of the eye
+// Rotates `v` around the vertical axis like glRotatef(angle_deg, 0, 1, 0).
+void rotateY(float angle_deg, const float v[3], float out[3]) {
+  float a = angle_deg * M_PI / 180.0;
+  out[0] = v[0] * cos(a) + v[2] * sin(a);
+  out[1] = v[1];
+  out[2] = -v[0] * sin(a) + v[2] * cos(a);
+}
+
+// Lays the window panels out on the ring, topmost window first, going
+// right until a row has gone all the way around and continuing in a new row
+// below. Panels keep their pixel size relative to a 1920 wide monitor.
+void layoutWindowPanels(float r, float base_z, float focused_w) {
+  const float gap = 0.1f;
+  float pixel_size = focused_w / 1920.0f;
+
+  int stacking[WINDOW_PANELS_MAX] = {};
+  window_placements.clear();
+  {
+    std::lock_guard<std::mutex> lock(window_set.mutex);
+    for (int i = 0; i < WINDOW_PANELS_MAX; i++) {
+      const WindowPanel &p = window_set.panels[i];
+      if (p.state != WINDOW_PANEL_LIVE || p.width == 0)
+        continue;
+      stacking[i] = p.stacking;
+      window_placements.push_back({i, 0, 0, p.width * pixel_size,
+                                   p.height * pixel_size});
+    }
+  }
+  std::sort(window_placements.begin(), window_placements.end(),
+            [&](const WindowPanelPlacement &a, const WindowPanelPlacement &b) {
+              return stacking[a.panel] > stacking[b.panel];
+            });
+
+  window_boxes.clear();
+  float row_angle = 0, row_top = 0, row_h = 0;
+  for (size_t i = 0; i < window_placements.size(); i++) {
+    WindowPanelPlacement &pl = window_placements[i];
+    float span_deg = (pl.w + gap) / r * 180.0 / M_PI;
+    if (i == 0) {
+      row_top = pl.h / 2;
+    } else if (row_angle + span_deg > 360.0f) {
+      row_top -= row_h + gap;
+      row_angle = 0;
+      row_h = 0;
+    }
+    pl.angle_deg = -(row_angle + span_deg / 2) + screen_angle_offset_degrees;
+    pl.y = row_top - pl.h / 2;
+    row_angle += span_deg;
+    row_h = std::max(row_h, pl.h);
+
+    Aabb box = aabb_empty();
+    for (int c = 0; c < 4; c++) {
+      float local[3] = {(c & 1) ? pl.w / 2 : -pl.w / 2,
+                        pl.y + ((c & 2) ? pl.h / 2 : -pl.h / 2), base_z};
+      float world[3];
+      rotateY(pl.angle_deg, local, world);
+      aabb_grow(box, world);
+    }
+    window_boxes.push_back(box);
+  }
+  build_bvh(window_bvh, window_boxes.data(), int(window_boxes.size()));
+}
+
+// Exact gaze test against a placed panel, `t` is the distance along the ray.
+bool windowPanelHit(const WindowPanelPlacement &pl, float base_z,
+                    const float eye[3], const float ray[3], float &t) {
+  float o[3], d[3];
+  rotateY(-pl.angle_deg, eye, o);
+  rotateY(-pl.angle_deg, ray, d);
+  if (fabs(d[2]) < 1e-5)
+    return false;
+  t = (base_z - o[2]) / d[2];
   if (t < 0)
     return false;
+  float ix = o[0] + d[0] * t;
+  float iy = o[1] + d[1] * t;
+  return ix >= -pl.w / 2 && ix <= pl.w / 2 && iy >= pl.y - pl.h / 2 &&
+         iy <= pl.y + pl.h / 2;
+}
 
-  // Calculate intersection point coordinates
-  float ix = eyeX + rayX * t;
-  float iy = eyeY + rayY * t;
+void drawWindowPanel(const WindowPanelPlacement &pl, float base_z) {
+  glPushMatrix();
+  glRotatef(pl.angle_deg, 0.0f, 1.0f, 0.0f);
+  glTranslatef(0.0f, pl.y, base_z);
+  glBindTexture(GL_TEXTURE_2D, window_tex[pl.panel]);
+
+  glBegin(GL_QUADS);
+  glTexCoord2f(0, 0);
+  glVertex3f(-pl.w / 2, pl.h / 2, 0);
+  glTexCoord2f(1, 0);
+  glVertex3f(pl.w / 2, pl.h / 2, 0);
+  glTexCoord2f(1, 1);
+  glVertex3f(pl.w / 2, -pl.h / 2, 0);
+  glTexCoord2f(0, 1);
+  glVertex3f(-pl.w / 2, -pl.h / 2, 0);
+  glEnd();
 
-  // Check if intersection lies within quad bounds
-  return (ix >= centerX - width / 2 && ix <= centerX + width / 2 &&
-          iy >= centerY - height / 2 && iy <= centerY + height / 2);
+  glPopMatrix();
 }
 
-void render() {
-  // if (focusedmonitors.size() > 0) {
-  //   // Suppose focusedmonitors[0] has these fields:
-  //   int x = focusedmonitors[0]->x;
-  //   int y = focusedmonitors[0]->y;
-  //   int width = focusedmonitors[0]->width;
-  //   int height = focusedmonitors[0]->height;
+void drawWindowHighlight(const WindowPanelPlacement &pl, float base_z) {
+  glPushMatrix();
+  glRotatef(pl.angle_deg, 0.0f, 1.0f, 0.0f);
+  glTranslatef(0.0f, pl.y, base_z);
+  glDisable(GL_TEXTURE_2D);
+  glColor3f(1.0f, 0.8f, 0.0f);
+  glLineWidth(3.0f);
+
+  glBegin(GL_LINE_LOOP);
+  glVertex3f(-pl.w / 2, pl.h / 2, 0);
+  glVertex3f(pl.w / 2, pl.h / 2, 0);
+  glVertex3f(pl.w / 2, -pl.h / 2, 0);
+  glVertex3f(-pl.w / 2, -pl.h / 2, 0);
+  glEnd();
 
-  //  // Warp mouse to center of that monitor:
-  //  int target_x = x + width / 2;
-  //  int target_y = y + height / 2;
+  glColor3f(1.0f, 1.0f, 1.0f);
+  glEnable(GL_TEXTURE_2D);
+  glPopMatrix();
+}
 
-  //  XWarpPointer(dpy, None, root, 0, 0, 0, 0, target_x, target_y);
-  //  XFlush(dpy);
-  //}
+// Draws the window panels inside the view and picks the one under the gaze.
+// Expects the view transform on the modelview stack.
+void renderWindowPanels(float r, float base_z, float focused_w,
+                        const float eye[3], const float ray[3]) {
+  uint64_t generation = window_set.generation;
+  if (generation != window_layout_generation ||
+      screen_angle_offset_degrees != window_layout_offset) {
+    window_layout_generation = generation;
+    window_layout_offset = screen_angle_offset_degrees;
+    layoutWindowPanels(r, base_z, focused_w);
+  }
 
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  glEnable(GL_DEPTH_TEST);
-  glEnable(GL_TEXTURE_2D);
+  float proj[16], modelview[16], planes[6][4];
+  glGetFloatv(GL_PROJECTION_MATRIX, proj);
+  glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+  frustum_planes(proj, modelview, planes);
+
+  // Only panels drawn here get captured by the upload thread.
+  uint64_t frame = ++window_set.render_frame;
+  bvh_cull(window_bvh, planes, [&](int item) {
+    const WindowPanelPlacement &pl = window_placements[item];
+    window_set.panels[pl.panel].visible_frame = frame;
+    if (window_tex[pl.panel] != 0) {
+      drawWindowPanel(pl, base_z);
+    }
+  });
 
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  gluPerspective(glasses.fov, 1920.0 / 1080.0, 0.1, 100.0);
+  gazedWindow = bvh_pick(window_bvh, eye, ray, [&](int item, float &t) {
+    return windowPanelHit(window_placements[item], base_z, eye, ray, t);
+  });
+  if (gazedWindow >= 0) {
+    drawWindowHighlight(window_placements[gazedWindow], base_z);
+  }
+}
 
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
+// Camera and ring geometry for one frame, shared by both backends.
+struct View {
+  Mat4 projection, modelview;
+  float eye[3], ray[3];
+  float focused_w, angle_deg, r, base_z;
+};
+
+void setupView(const Glasses &pose, View &view) {
+  view.projection =
+      mat4_perspective(fov_degrees, float(output_width) / output_height, 0.1f,
+                       100.0f);
 
   // Head orientation
-  float roll = get_roll(glasses);
+  float roll = get_roll(pose);
   // glRotatef(roll, 0.0f, 0.0f, 1.0f);
   // glRotatef(get_pitch(glasses), 1.0f, 0.0f, 0.0f);
   // glRotatef(-get_yaw(glasses), 0.0f, 1.0f, 0.0f);
@@ -683,140 +1440,221 @@ void render() {
   float flat_z = r - focused_w * 1.05f;
 
   float rayX, rayY, rayZ;
-  getLookVector(rayX, rayY, rayZ);
+  getLookVector(pose, rayX, rayY, rayZ);
   float eyeX = rayX * roll_perc;
   float eyeY = rayY * roll_perc;
   float eyeZ = rayZ * roll_perc - flat_z;
-  float tx = eyeX + rayX;
-  float ty = eyeY + rayY;
-  float tz = eyeZ + rayZ;
-  gluLookAt(eyeX, eyeY, eyeZ, tx, ty, tz, 0.0f, 1.0f, 0.0f);
-  glRotatef(roll, 0.0f, 0.0f, 1.0f);
+  float eye[3] = {eyeX, eyeY, eyeZ};
+  float target[3] = {eyeX + rayX, eyeY + rayY, eyeZ + rayZ};
+  float up[3] = {0.0f, 1.0f, 0.0f};
+  view.modelview = mat4_mul(mat4_look_at(eye, target, up),
+                            mat4_rotate(roll, 0.0f, 0.0f, 1.0f));
+
+  view.eye[0] = eyeX;
+  view.eye[1] = eyeY;
+  view.eye[2] = eyeZ;
+  view.ray[0] = rayX;
+  view.ray[1] = rayY;
+  view.ray[2] = rayZ;
+  view.focused_w = focused_w;
+  view.angle_deg = angle_deg;
+  view.r = r;
+  view.base_z = base_z;
+}
 
-  while (focusedmonitors.size() > 7) {
-    // TODO: some other way
-    focusedmonitors.pop_back();
+// Lays the panels out again if the stack or the view geometry changed since
+// the last time.
+void updatePanelLayout(const View &view) {
+  PanelLayoutParams params;
+  params.focused_w = view.focused_w;
+  params.angle_deg = view.angle_deg;
+  params.base_z = view.base_z;
+  params.offset_deg = screen_angle_offset_degrees;
+  params.tex_w = presented.width;
+  params.tex_h = presented.height;
+  if (panel_layout_current(panel_layout, panel_stack, params)) {
+    return;
   }
 
-  {
+  TRACE_SCOPE("layout_panels");
+  panel_sources.clear();
+  for (const MyMonitor &m : monitors) {
+    PanelSource src;
+    src.aspect = (float)m.height / m.width;
+    getMonitorUVs(m, presented, src.u0, src.v0, src.u1, src.v1);
+    panel_sources.push_back(src);
+  }
+  layout_panels(panel_layout, panel_stack, panel_sources.data(),
+                int(panel_sources.size()), params);
+  // Enough for all of them being in view.
+  panel_quads.reserve(panel_layout.quads.size());
+}
 
-    for (int i = 0; i < int(focusedmonitors.size()) - 1; i++) {
-      const MyMonitor *m = focusedmonitors[i + 1];
-      if (m == nullptr)
-        continue;
+// The panels of the layout that are in view, and the gaze selection of
+// thumbnails.
+void buildMonitorPanels(const View &view) {
+  updatePanelLayout(view);
+
+  // Culled against the view volume widened like vt_outside() does, so the
+  // tiles of panels just out of view are still requested.
+  Mat4 proj = view.projection;
+  for (int c = 0; c < 4; c++) {
+    proj.m[c * 4] /= VT_GUARD_BAND;
+    proj.m[c * 4 + 1] /= VT_GUARD_BAND;
+  }
+  float planes[6][4];
+  frustum_planes(proj.m, view.modelview.m, planes);
+  panel_quads.clear();
+  bvh_cull(panel_layout.bvh, planes, [&](int item) {
+    panel_quads.push_back(panel_layout.quads[item]);
+  });
+
+  int gazed = bvh_pick(panel_layout.bvh, view.eye, view.ray,
+                       [&](int item, float &t) {
+                         return panel_layout.thumbnail[item] != PANEL_NONE &&
+                                panel_facing_hit(panel_layout.quads[item],
+                                                 view.eye, view.ray, t);
+                       });
+  gazeOnThumbnail = gazed >= 0;
+  if (!gazeOnThumbnail) {
+    return;
+  }
+
+  int i = panel_layout.thumbnail[gazed];
+  if (focusCandidate == i) {
+    focusFrames++;
+    if (focusFrames >= FOCUS_HOLD_FRAMES) {
+      focusIndex = i;
+      focusCandidate = -1;
+      focusFrames = 0;
+      if (panel_stack.count == 0) {
+        panel_stack_push(panel_stack, i);
+      } else {
+        panel_stack_set(panel_stack, 0, i);
+      }
+    }
+  } else {
+    focusCandidate = i;
+    focusFrames = 1;
+  }
+}
 
-      float aspect = (float)m->height / m->width;
-      float focused_h = focused_w * aspect;
+// Draws panel_quads with the desktop atlas bound, and asks for the tiles
+// they need.
+void drawPanelQuads(const View &view) {
+  if (!presented_pool) {
+    return;
+  }
+  int viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  Mat4 mvp = mat4_mul(view.projection, view.modelview);
 
-      glPushMatrix();
-      glRotatef(-i * angle_deg + screen_angle_offset_degrees, 0.0f, 1.0f, 0.0f);
-      glTranslatef(0.0f, 0.0f, base_z);
+  vt_requests.clear();
+  glBegin(GL_QUADS);
+  for (const TexturedQuad &q : panel_quads) {
+    vt_draw_quad(*presented_pool, q, mvp, float(viewport[2]),
+                 float(viewport[3]), vt_requests);
+  }
+  glEnd();
+  vt_request_tiles(virtual_texture, *presented_pool, vt_requests);
+}
 
-      // framebuffer already bound
-      // glBindTexture(GL_TEXTURE_2D, m->tex);
+void renderCpu(const View &view) {
+  TRACE_SCOPE("cpu_render");
+  buildMonitorPanels(view);
 
-      glBegin(GL_QUADS);
-      float u0, v0, u1, v1;
-      getMonitorUVs(*m, framebuffer, u0, v0, u1, v1);
-      glTexCoord2f(u0, v0);
-      glVertex3f(-focused_w / 2, focused_h / 2, 0);
-      glTexCoord2f(u1, v0);
-      glVertex3f(focused_w / 2, focused_h / 2, 0);
-      glTexCoord2f(u1, v1);
-      glVertex3f(focused_w / 2, -focused_h / 2, 0);
-      glTexCoord2f(u0, v1);
-      glVertex3f(-focused_w / 2, -focused_h / 2, 0);
-      glEnd();
+  CpuTexture tex{};
+  if (framebuffer.img) {
+    tex.data = (const uint8_t *)framebuffer.img->data;
+    tex.width = framebuffer.width;
+    tex.height = framebuffer.height;
+    tex.stride = framebuffer.img->bytes_per_line;
+  }
+  cpu_render_frame(cpu_renderer, panel_quads.data(), int(panel_quads.size()),
+                   mat4_mul(view.projection, view.modelview), tex);
 
-      glPopMatrix();
-    }
-  }
-
-  if (focusedmonitors.size() > 0 && focusedmonitors[0] != nullptr) {
-    // place first focused monitor in our lap
-    const auto &m = focusedmonitors.at(0);
-    float aspect = (float)m->height / m->width;
-    float focused_h = focused_w * aspect;
-
-    glPushMatrix();
-    // -36.0f was just tested and seems okay, idk what it should be to be
-    // correct geometrically
-    glRotatef(-angle_deg * aspect, 1.0f, 0.0f, 0.0f);
-    glTranslatef(0.0f, 0.0f, base_z);
-
-    // glBindTexture(GL_TEXTURE_2D, m->tex);
-
-    glBegin(GL_QUADS);
-    float u0, v0, u1, v1;
-    getMonitorUVs(*m, framebuffer, u0, v0, u1, v1);
-    glTexCoord2f(u0, v0);
-    glVertex3f(-focused_w / 2, focused_h / 2, 0);
-    glTexCoord2f(u1, v0);
-    glVertex3f(focused_w / 2, focused_h / 2, 0);
-    glTexCoord2f(u1, v1);
-    glVertex3f(focused_w / 2, -focused_h / 2, 0);
-    glTexCoord2f(u0, v1);
-    glVertex3f(-focused_w / 2, -focused_h / 2, 0);
-    glEnd();
-
-    glPopMatrix();
-  }
-
-  // Draw thumbnails above focused screen
-  float thumbY = 1.2f;
-  float spacing = 0.6f;
-  float thumbSize = 0.55f;
-  for (size_t i = 0; i < monitors.size(); i++) {
-    float x = (i - (monitors.size() - 1) / 2.0f) * spacing;
-    float y = thumbY;
-    float z = base_z;
-
-    // glBindTexture(GL_TEXTURE_2D, monitors[i].tex);
-    glPushMatrix();
-    glTranslatef(x, y, z);
-
-    glBegin(GL_QUADS);
-    float u0, v0, u1, v1;
-    getMonitorUVs(monitors[i], framebuffer, u0, v0, u1, v1);
-    glTexCoord2f(u0, v0);
-    glVertex3f(-thumbSize / 2, thumbSize / 2, 0);
-    glTexCoord2f(u1, v0);
-    glVertex3f(thumbSize / 2, thumbSize / 2, 0);
-    glTexCoord2f(u1, v1);
-    glVertex3f(thumbSize / 2, -thumbSize / 2, 0);
-    glTexCoord2f(u0, v1);
-    glVertex3f(-thumbSize / 2, -thumbSize / 2, 0);
-    glEnd();
-    glPopMatrix();
-
-    // Gaze selection
-    if (isLookingAt(eyeX, eyeY, eyeZ, rayX, rayY, rayZ, x, y, z, thumbSize,
-                    thumbSize)) {
-      if (focusCandidate == i) {
-        focusFrames++;
-        if (focusFrames >= FOCUS_HOLD_FRAMES) {
-          focusIndex = i;
-          focusCandidate = -1;
-          focusFrames = 0;
-          if (focusedmonitors.size() == 0) {
-            focusedmonitors.push_back(&monitors[i]);
-          } else {
-            focusedmonitors[0] = &monitors[i];
-          }
-        }
-      } else {
-        focusCandidate = i;
-        focusFrames = 1;
-      }
-    }
+  if (center_dot_enabled) {
+    cpu_fill_rect(cpu_renderer, cpu_renderer.width / 2 - 4,
+                  cpu_renderer.height / 2 - 4, 8, 8, 0xffff0000u);
   }
+  cpu_present(cpu_renderer);
+}
+
+void render(const Glasses &pose) {
+  TRACE_SCOPE_ARG("render", render_timer.frame);
+  // if (focusedmonitors.size() > 0) {
+  //   // Suppose focusedmonitors[0] has these fields:
+  //   int x = focusedmonitors[0]->x;
+  //   int y = focusedmonitors[0]->y;
+  //   int width = focusedmonitors[0]->width;
+  //   int height = focusedmonitors[0]->height;
+
+  //  // Warp mouse to center of that monitor:
+  //  int target_x = x + width / 2;
+  //  int target_y = y + height / 2;
+
+  //  XWarpPointer(dpy, None, root, 0, 0, 0, 0, target_x, target_y);
+  //  XFlush(dpy);
+  //}
+
+  View view;
+  setupView(pose, view);
+  if (cpu_render) {
+    renderCpu(view);
+    return;
+  }
+
+  gpu_pass_begin(render_timer, GPU_PASS_PANELS);
+  bool scaled = begin_scaled_render(scaled_target, output_width,
+                                    output_height, render_scale.scale);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_TEXTURE_2D);
+  glBindTexture(GL_TEXTURE_2D, presented.tex);
+
+  glMatrixMode(GL_PROJECTION);
+  glLoadMatrixf(view.projection.m);
+  glMatrixMode(GL_MODELVIEW);
+  glLoadMatrixf(view.modelview.m);
+
+  if (render_timer.recording) {
+    render_timer.recording->imu_ts = pose.ts;
+    render_timer.recording->imu_host_ns = pose.host_ns;
+  }
+
+  if (window_mode) {
+    renderWindowPanels(view.r, view.base_z, view.focused_w, view.eye,
+                       view.ray);
+    gazeOnThumbnail = false;
+  } else {
+    buildMonitorPanels(view);
+    drawPanelQuads(view);
+  }
+
+  gpu_pass_end(render_timer, GPU_PASS_PANELS);
 
+  // The overlay is drawn at full resolution on top of the upscaled scene.
+  if (scaled) {
+    gpu_pass_begin(render_timer, GPU_PASS_UPSCALE);
+    end_scaled_render(scaled_target, output_width, output_height,
+                      render_scale.scale, render_sharpness(render_scale));
+    gpu_pass_end(render_timer, GPU_PASS_UPSCALE);
+  }
+
+  gpu_pass_begin(render_timer, GPU_PASS_OVERLAY);
   if (center_dot_enabled) {
     draw_filled_center_rect(4.0f, 4.0f);
   }
+  gpu_pass_end(render_timer, GPU_PASS_OVERLAY);
 
   glFlush();
-  glXSwapBuffers(dpy, win);
+  {
+    TRACE_SCOPE("swap");
+    glXSwapBuffers(dpy, win);
+  }
+  // Reached on the GPU once the swap has been executed, compared against the
+  // IMU sample's arrival for the motion-to-photon estimate.
+  gpu_pass_end(render_timer, GPU_PASS_SWAP);
 }
 
 void cleanup() {
@@ -828,9 +1666,24 @@ void cleanup() {
   //     glDeleteTextures(1, &m.tex);
   //   }
   // }
-  focusedmonitors.clear();
   monitors.clear();
 
+  stop_glasses_link(glasses_link);
+  stop_upload_thread(upload_thread);
+  close_frame_recorder(frame_recorder);
+  close_frame_replay(frame_replay);
+  destroy_cpu_renderer(cpu_renderer);
+  destroy_window_set(window_set);
+  destroy_desktop_damage(desktop_damage);
+  destroy_capture_client(capture_client);
+  destroy_gpu_timer(render_timer);
+  destroy_scaled_target(scaled_target);
+  close_frame_log(frame_stats);
+  close_pose_publisher(pose_publisher);
+  if (upload_glc)
+    glXDestroyContext(dpy, upload_glc);
+  if (upload_win)
+    XDestroyWindow(dpy, upload_win);
   if (glc)
     glXDestroyContext(dpy, glc);
   if (dpy)
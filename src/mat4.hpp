@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cmath>
+
+// Column-major 4x4 matrices laid out like OpenGL's, so they can be handed to
+// glLoadMatrixf directly. The builders mirror the GL/GLU calls of the same
+// name; multiplying onto a matrix works like the fixed-function stack, i.e.
+// the new transform applies first.
+
+struct Mat4 {
+  float m[16];
+};
+
+static Mat4 mat4_identity() {
+  return {{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1}};
+}
+
+static Mat4 mat4_mul(const Mat4 &a, const Mat4 &b) {
+  Mat4 r;
+  for (int c = 0; c < 4; c++) {
+    for (int row = 0; row < 4; row++) {
+      float v = 0;
+      for (int k = 0; k < 4; k++)
+        v += a.m[k * 4 + row] * b.m[c * 4 + k];
+      r.m[c * 4 + row] = v;
+    }
+  }
+  return r;
+}
+
+// gluPerspective
+static Mat4 mat4_perspective(float fovy_deg, float aspect, float z_near,
+                             float z_far) {
+  float f = 1.0f / tanf(fovy_deg * float(M_PI) / 360.0f);
+  Mat4 r{};
+  r.m[0] = f / aspect;
+  r.m[5] = f;
+  r.m[10] = (z_far + z_near) / (z_near - z_far);
+  r.m[11] = -1.0f;
+  r.m[14] = 2.0f * z_far * z_near / (z_near - z_far);
+  return r;
+}
+
+// gluLookAt
+static Mat4 mat4_look_at(const float eye[3], const float center[3],
+                         const float up[3]) {
+  float f[3] = {center[0] - eye[0], center[1] - eye[1], center[2] - eye[2]};
+  float len = sqrtf(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+  for (int i = 0; i < 3; i++)
+    f[i] /= len;
+
+  float s[3] = {f[1] * up[2] - f[2] * up[1], f[2] * up[0] - f[0] * up[2],
+                f[0] * up[1] - f[1] * up[0]};
+  len = sqrtf(s[0] * s[0] + s[1] * s[1] + s[2] * s[2]);
+  for (int i = 0; i < 3; i++)
+    s[i] /= len;
+
+  float u[3] = {s[1] * f[2] - s[2] * f[1], s[2] * f[0] - s[0] * f[2],
+                s[0] * f[1] - s[1] * f[0]};
+
+  Mat4 r = mat4_identity();
+  for (int i = 0; i < 3; i++) {
+    r.m[i * 4 + 0] = s[i];
+    r.m[i * 4 + 1] = u[i];
+    r.m[i * 4 + 2] = -f[i];
+  }
+  r.m[12] = -(s[0] * eye[0] + s[1] * eye[1] + s[2] * eye[2]);
+  r.m[13] = -(u[0] * eye[0] + u[1] * eye[1] + u[2] * eye[2]);
+  r.m[14] = f[0] * eye[0] + f[1] * eye[1] + f[2] * eye[2];
+  return r;
+}
+
+// glRotatef
+static Mat4 mat4_rotate(float angle_deg, float x, float y, float z) {
+  float len = sqrtf(x * x + y * y + z * z);
+  x /= len;
+  y /= len;
+  z /= len;
+  float a = angle_deg * float(M_PI) / 180.0f;
+  float c = cosf(a), s = sinf(a), t = 1.0f - c;
+
+  Mat4 r = mat4_identity();
+  r.m[0] = x * x * t + c;
+  r.m[1] = y * x * t + z * s;
+  r.m[2] = x * z * t - y * s;
+  r.m[4] = x * y * t - z * s;
+  r.m[5] = y * y * t + c;
+  r.m[6] = y * z * t + x * s;
+  r.m[8] = x * z * t + y * s;
+  r.m[9] = y * z * t - x * s;
+  r.m[10] = z * z * t + c;
+  return r;
+}
+
+// glTranslatef
+static Mat4 mat4_translate(float x, float y, float z) {
+  Mat4 r = mat4_identity();
+  r.m[12] = x;
+  r.m[13] = y;
+  r.m[14] = z;
+  return r;
+}
+
+// Transforms the point (x, y, z, 1).
+static void mat4_transform(const Mat4 &a, const float p[3], float out[4]) {
+  for (int row = 0; row < 4; row++) {
+    out[row] = a.m[row] * p[0] + a.m[4 + row] * p[1] + a.m[8 + row] * p[2] +
+               a.m[12 + row];
+  }
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "pose.hpp"
+#include "render_scale.hpp"
+#include "viture.h"
+
+// Command line:
+//
+//   viture_ar_desktop [options] [exclude-monitor-index]
+//
+// Without a monitor index the monitors are listed and the glasses are
+// autodetected by output name.
+enum RenderBackend {
+  RENDER_AUTO,
+  RENDER_GL,
+  RENDER_CPU,
+};
+
+enum CaptureMode {
+  // Grab the desktop ourselves.
+  CAPTURE_DIRECT,
+  // Only grab the desktop, for clients to share. See capture_shm.hpp.
+  CAPTURE_DAEMON,
+  // Take the desktop from a capture daemon.
+  CAPTURE_CLIENT,
+  // Replay frames recorded with --record. See frame_recording.hpp.
+  CAPTURE_REPLAY,
+};
+
+struct Options {
+  bool has_exclude_index = false;
+  int exclude_index = -1;
+
+  // Per-frame timing records as CSV.
+  const char *frame_log = nullptr;
+
+  PoseFilterConfig pose_filter;
+  // How far ahead of now the rendered pose is predicted, roughly the time
+  // until the frame reaches the display.
+  float prediction_ms = 8.3f;
+
+  // IMU_FREQUENCE_* to run at, or -1 to adapt the rate to head motion.
+  int imu_fq = -1;
+
+  // Skip capture and rendering while nothing changes.
+  bool idle = true;
+  float idle_threshold_deg = 0.05f;
+
+  // Show application windows as panels instead of whole monitors.
+  bool windows = false;
+
+  // Broadcast the pose to other processes, see include/pose_shm.h.
+  bool pose_shm = true;
+
+  // Auto picks the CPU renderer when GL turns out to be software only.
+  RenderBackend render = RENDER_AUTO;
+
+  // Put the output window right on the glasses' output, bypassing the
+  // window manager and compositor.
+  bool direct_output = false;
+
+  // Resolution range and GPU budget of the GL scene, see render_scale.hpp.
+  RenderScaleConfig render_scale;
+
+  // Trilinear filtering of panels from incrementally updated mipmaps, see
+  // virtual_texture.hpp, and the anisotropy on top of it (1 is off).
+  bool mipmaps = true;
+  float anisotropy = 8.0f;
+
+  CaptureMode capture = CAPTURE_DIRECT;
+  // Socket of the capture daemon, nullptr for the default.
+  const char *capture_socket = nullptr;
+  // Recording to write captured frames to, or to replay from.
+  const char *record = nullptr;
+  const char *replay = nullptr;
+  // Replay as fast as frames are taken instead of at the recorded pace.
+  bool replay_max_rate = false;
+
+  // Exit with an error if the frame loops allocate after warming up, see
+  // alloc_counter.hpp.
+  bool alloc_test = false;
+};
+
+static void print_usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [options] [exclude-monitor-index]\n"
+          "\n"
+          "  --frame-log <path>          write per-frame timing records (CSV)\n"
+          "  --pose-filter <mode>        none or one-euro (default)\n"
+          "  --filter-min-cutoff <hz>    still-head cutoff (default 1.0)\n"
+          "  --filter-beta <value>       cutoff increase per deg/s (default "
+          "0.05)\n"
+          "  --prediction-ms <ms>        pose prediction lookahead (default "
+          "8.3)\n"
+          "  --imu-rate <hz|auto>        60, 90, 120, 240 or auto (default)\n"
+          "  --no-idle                   render every frame even when "
+          "nothing changes\n"
+          "  --idle-threshold-deg <deg>  head motion that ends idling "
+          "(default 0.05)\n"
+          "  --windows                   show application windows as "
+          "separate panels\n"
+          "  --no-pose-shm               don't broadcast the pose through "
+          "shared memory\n"
+          "  --render <backend>          gl, cpu or auto (default)\n"
+          "  --direct-output             fullscreen on the glasses' output, "
+          "bypassing the\n"
+          "                              compositor\n"
+          "  --min-render-scale <s>      lowest scene resolution under load "
+          "(default 0.5)\n"
+          "  --max-render-scale <s>      highest scene resolution (default "
+          "1.0)\n"
+          "  --render-budget-ms <ms>     GPU time the scene may take "
+          "(default 5.0)\n"
+          "  --sharpness <value>         upscale sharpening at the lowest "
+          "scale (default 0.6)\n"
+          "  --no-mipmaps                sample panels without mipmaps\n"
+          "  --anisotropy <n>            anisotropic filtering, 1 is off "
+          "(default 8)\n"
+          "  --capture-daemon            only capture the desktop, for "
+          "--capture-client\n"
+          "                              instances to share\n"
+          "  --capture-client            take the desktop from a capture "
+          "daemon\n"
+          "  --capture-socket <path>     capture daemon socket (default "
+          "/tmp/viture_capture.sock)\n"
+          "  --record <path>             record captured frames for "
+          "--replay\n"
+          "  --replay <path>             show recorded frames instead of "
+          "the desktop\n"
+          "  --replay-rate <rate>        original (default) or max\n"
+          "  --alloc-test                run for a while, failing if the "
+          "frame loops allocate\n"
+          "                              once warmed up\n",
+          argv0);
+}
+
+// Returns false if the command line is malformed.
+static bool parse_options(int argc, char **argv, Options &opts) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool has_value = i + 1 < argc;
+
+    if (strcmp(arg, "--frame-log") == 0 && has_value) {
+      opts.frame_log = argv[++i];
+    } else if (strcmp(arg, "--pose-filter") == 0 && has_value) {
+      const char *mode = argv[++i];
+      if (strcmp(mode, "none") == 0) {
+        opts.pose_filter.mode = POSE_FILTER_NONE;
+      } else if (strcmp(mode, "one-euro") == 0) {
+        opts.pose_filter.mode = POSE_FILTER_ONE_EURO;
+      } else {
+        fprintf(stderr, "Unknown pose filter %s\n", mode);
+        return false;
+      }
+    } else if (strcmp(arg, "--filter-min-cutoff") == 0 && has_value) {
+      opts.pose_filter.min_cutoff_hz = strtof(argv[++i], nullptr);
+    } else if (strcmp(arg, "--filter-beta") == 0 && has_value) {
+      opts.pose_filter.beta = strtof(argv[++i], nullptr);
+    } else if (strcmp(arg, "--prediction-ms") == 0 && has_value) {
+      opts.prediction_ms = strtof(argv[++i], nullptr);
+    } else if (strcmp(arg, "--no-idle") == 0) {
+      opts.idle = false;
+    } else if (strcmp(arg, "--render") == 0 && has_value) {
+      const char *backend = argv[++i];
+      if (strcmp(backend, "auto") == 0) {
+        opts.render = RENDER_AUTO;
+      } else if (strcmp(backend, "gl") == 0) {
+        opts.render = RENDER_GL;
+      } else if (strcmp(backend, "cpu") == 0) {
+        opts.render = RENDER_CPU;
+      } else {
+        fprintf(stderr, "Unknown render backend %s\n", backend);
+        return false;
+      }
+    } else if (strcmp(arg, "--direct-output") == 0) {
+      opts.direct_output = true;
+    } else if (strcmp(arg, "--min-render-scale") == 0 && has_value) {
+      opts.render_scale.min_scale = strtof(argv[++i], nullptr);
+    } else if (strcmp(arg, "--max-render-scale") == 0 && has_value) {
+      opts.render_scale.max_scale = strtof(argv[++i], nullptr);
+    } else if (strcmp(arg, "--render-budget-ms") == 0 && has_value) {
+      opts.render_scale.budget_ms = strtof(argv[++i], nullptr);
+    } else if (strcmp(arg, "--sharpness") == 0 && has_value) {
+      opts.render_scale.sharpness = strtof(argv[++i], nullptr);
+    } else if (strcmp(arg, "--no-mipmaps") == 0) {
+      opts.mipmaps = false;
+    } else if (strcmp(arg, "--anisotropy") == 0 && has_value) {
+      opts.anisotropy = strtof(argv[++i], nullptr);
+    } else if (strcmp(arg, "--no-pose-shm") == 0) {
+      opts.pose_shm = false;
+    } else if (strcmp(arg, "--capture-daemon") == 0) {
+      opts.capture = CAPTURE_DAEMON;
+    } else if (strcmp(arg, "--capture-client") == 0) {
+      opts.capture = CAPTURE_CLIENT;
+    } else if (strcmp(arg, "--capture-socket") == 0 && has_value) {
+      opts.capture_socket = argv[++i];
+    } else if (strcmp(arg, "--record") == 0 && has_value) {
+      opts.record = argv[++i];
+    } else if (strcmp(arg, "--replay") == 0 && has_value) {
+      opts.capture = CAPTURE_REPLAY;
+      opts.replay = argv[++i];
+    } else if (strcmp(arg, "--replay-rate") == 0 && has_value) {
+      const char *rate = argv[++i];
+      if (strcmp(rate, "original") == 0) {
+        opts.replay_max_rate = false;
+      } else if (strcmp(rate, "max") == 0) {
+        opts.replay_max_rate = true;
+      } else {
+        fprintf(stderr, "Unknown replay rate %s\n", rate);
+        return false;
+      }
+    } else if (strcmp(arg, "--alloc-test") == 0) {
+      opts.alloc_test = true;
+    } else if (strcmp(arg, "--windows") == 0) {
+      opts.windows = true;
+    } else if (strcmp(arg, "--idle-threshold-deg") == 0 && has_value) {
+      opts.idle_threshold_deg = strtof(argv[++i], nullptr);
+    } else if (strcmp(arg, "--imu-rate") == 0 && has_value) {
+      const char *rate = argv[++i];
+      if (strcmp(rate, "auto") == 0) {
+        opts.imu_fq = -1;
+      } else if (strcmp(rate, "60") == 0) {
+        opts.imu_fq = IMU_FREQUENCE_60;
+      } else if (strcmp(rate, "90") == 0) {
+        opts.imu_fq = IMU_FREQUENCE_90;
+      } else if (strcmp(rate, "120") == 0) {
+        opts.imu_fq = IMU_FREQUENCE_120;
+      } else if (strcmp(rate, "240") == 0) {
+        opts.imu_fq = IMU_FREQUENCE_240;
+      } else {
+        fprintf(stderr, "Unknown IMU rate %s\n", rate);
+        return false;
+      }
+    } else if (arg[0] == '-' && arg[1] == '-') {
+      fprintf(stderr, "Unknown or incomplete option %s\n", arg);
+      print_usage(argv[0]);
+      return false;
+    } else {
+      char *end = nullptr;
+      long index = strtol(arg, &end, 10);
+      if (end == arg || *end != '\0') {
+        fprintf(stderr, "Invalid exclude monitor index %s\n", arg);
+        print_usage(argv[0]);
+        return false;
+      }
+      opts.exclude_index = int(index);
+      opts.has_exclude_index = true;
+    }
+  }
+
+  const RenderScaleConfig &rs = opts.render_scale;
+  if (!(rs.min_scale >= 0.25f && rs.min_scale <= rs.max_scale &&
+        rs.max_scale <= 2.0f)) {
+    fprintf(stderr, "Render scales must satisfy 0.25 <= min <= max <= 2\n");
+    return false;
+  }
+  return true;
+}
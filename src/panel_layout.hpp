@@ -0,0 +1,231 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+
+#include "bvh.hpp"
+#include "mat4.hpp"
+#include "scene.hpp"
+
+// Layout of the monitor panels.
+//
+// The monitors being worked with form a stack. Its top sits in the lap, the
+// rest goes around the viewer on rings of 360 / angle_deg panels each, the
+// first ring at eye level and every further one above the previous. The
+// thumbnails of all monitors come above the topmost ring, in rows of
+// PANEL_THUMBNAILS_PER_ROW.
+//
+// The stack refers to monitors by handle, their index in the monitor list,
+// so it stays valid however the list is stored. Pushing and popping at the
+// top is O(1).
+//
+// The quads of a layout are kept along with a BVH over them and only
+// computed again when the stack or the parameters change, so a frame costs
+// a cull and a pick no matter how many panels there are.
+
+#define PANEL_NONE (-1)
+#define PANEL_THUMBNAILS_PER_ROW 12
+#define PANEL_THUMBNAIL_SIZE 0.55f
+#define PANEL_THUMBNAIL_SPACING 0.6f
+// Height of the first thumbnail row above the first ring.
+#define PANEL_THUMBNAIL_Y 1.2f
+// Vertical space between two rings.
+#define PANEL_RING_GAP 0.1f
+
+// Index into the monitor list, or PANEL_NONE for an empty place.
+typedef int PanelHandle;
+
+struct PanelStack {
+  // Ring buffer, its size a power of two.
+  std::vector<PanelHandle> slots;
+  int head;
+  int count;
+  // Bumped on every change, layouts made for an older one are stale.
+  uint64_t generation;
+};
+
+static void init_panel_stack(PanelStack &s, int capacity) {
+  int size = 1;
+  while (size < capacity)
+    size *= 2;
+  s.slots.assign(size, PANEL_NONE);
+  s.head = 0;
+  s.count = 0;
+  s.generation++;
+}
+
+// Entry `i` from the top.
+static PanelHandle panel_stack_at(const PanelStack &s, int i) {
+  return s.slots[(s.head + i) & (int(s.slots.size()) - 1)];
+}
+
+static void panel_stack_set(PanelStack &s, int i, PanelHandle h) {
+  s.slots[(s.head + i) & (int(s.slots.size()) - 1)] = h;
+  s.generation++;
+}
+
+static void panel_stack_push(PanelStack &s, PanelHandle h) {
+  int size = int(s.slots.size());
+  if (s.count == size) {
+    // Unrolled into a buffer twice the size, only when full.
+    std::vector<PanelHandle> slots(size * 2, PANEL_NONE);
+    for (int i = 0; i < s.count; i++)
+      slots[i] = panel_stack_at(s, i);
+    s.slots.swap(slots);
+    s.head = 0;
+    size *= 2;
+  }
+  s.head = (s.head - 1) & (size - 1);
+  s.slots[s.head] = h;
+  s.count++;
+  s.generation++;
+}
+
+static void panel_stack_pop(PanelStack &s) {
+  if (s.count == 0)
+    return;
+  s.slots[s.head] = PANEL_NONE;
+  s.head = (s.head + 1) & (int(s.slots.size()) - 1);
+  s.count--;
+  s.generation++;
+}
+
+// What a monitor looks like as a panel.
+struct PanelSource {
+  // Height over width.
+  float aspect;
+  float u0, v0, u1, v1;
+};
+
+struct PanelLayoutParams {
+  // Width of the panels on the rings and in the lap.
+  float focused_w;
+  // Angle between neighbours on a ring.
+  float angle_deg;
+  float base_z;
+  // Rotation of the rings, from the shift commands.
+  float offset_deg;
+  // Size of the desktop texture the sources' coordinates are for.
+  int tex_w, tex_h;
+};
+
+static bool panel_layout_params_equal(const PanelLayoutParams &a,
+                                      const PanelLayoutParams &b) {
+  return a.focused_w == b.focused_w && a.angle_deg == b.angle_deg &&
+         a.base_z == b.base_z && a.offset_deg == b.offset_deg &&
+         a.tex_w == b.tex_w && a.tex_h == b.tex_h;
+}
+
+struct PanelLayout {
+  bool valid;
+  // What the layout was made from.
+  PanelLayoutParams params;
+  uint64_t stack_generation;
+
+  std::vector<TexturedQuad> quads;
+  // Per quad, the monitor it is the thumbnail of, PANEL_NONE for the others.
+  std::vector<PanelHandle> thumbnail;
+  std::vector<Aabb> boxes;
+  Bvh bvh;
+};
+
+static bool panel_layout_current(const PanelLayout &l, const PanelStack &s,
+                                 const PanelLayoutParams &params) {
+  return l.valid && l.stack_generation == s.generation &&
+         panel_layout_params_equal(l.params, params);
+}
+
+static void panel_layout_add(PanelLayout &l, const Mat4 &model, float w,
+                             float h, const PanelSource &src,
+                             PanelHandle thumbnail) {
+  TexturedQuad q =
+      make_textured_quad(model, w, h, src.u0, src.v0, src.u1, src.v1);
+  Aabb box = aabb_empty();
+  for (int c = 0; c < 4; c++)
+    aabb_grow(box, q.corners[c]);
+  l.quads.push_back(q);
+  l.thumbnail.push_back(thumbnail);
+  l.boxes.push_back(box);
+}
+
+// Lays out `s` and the thumbnails of all `count` monitors of `sources`.
+static void layout_panels(PanelLayout &l, const PanelStack &s,
+                          const PanelSource *sources, int count,
+                          const PanelLayoutParams &params) {
+  l.quads.clear();
+  l.thumbnail.clear();
+  l.boxes.clear();
+  float w = params.focused_w;
+  int per_ring = std::max(int(360.0f / params.angle_deg), 1);
+
+  // Rings are as far apart as the tallest panel on them needs.
+  float ring_h = 0;
+  for (int i = 1; i < s.count; i++) {
+    PanelHandle h = panel_stack_at(s, i);
+    if (h != PANEL_NONE)
+      ring_h = std::max(ring_h, w * sources[h].aspect);
+  }
+  float ring_pitch = ring_h + PANEL_RING_GAP;
+  int rings = 0;
+
+  for (int i = 1; i < s.count; i++) {
+    PanelHandle h = panel_stack_at(s, i);
+    if (h == PANEL_NONE)
+      continue;
+    int place = i - 1, ring = place / per_ring;
+    rings = std::max(rings, ring + 1);
+    Mat4 model = mat4_mul(
+        mat4_rotate(-(place % per_ring) * params.angle_deg + params.offset_deg,
+                    0.0f, 1.0f, 0.0f),
+        mat4_translate(0.0f, ring * ring_pitch, params.base_z));
+    panel_layout_add(l, model, w, w * sources[h].aspect, sources[h],
+                     PANEL_NONE);
+  }
+
+  PanelHandle lap = s.count > 0 ? panel_stack_at(s, 0) : PANEL_NONE;
+  if (lap != PANEL_NONE) {
+    // Tilted towards the viewer, more so the taller it is.
+    float aspect = sources[lap].aspect;
+    Mat4 model =
+        mat4_mul(mat4_rotate(-params.angle_deg * aspect, 1.0f, 0.0f, 0.0f),
+                 mat4_translate(0.0f, 0.0f, params.base_z));
+    panel_layout_add(l, model, w, w * aspect, sources[lap], PANEL_NONE);
+  }
+
+  float thumb_y =
+      PANEL_THUMBNAIL_Y + std::max(rings - 1, 0) * ring_pitch;
+  for (int i = 0; i < count; i++) {
+    int row = i / PANEL_THUMBNAILS_PER_ROW;
+    int row_count =
+        std::min(count - row * PANEL_THUMBNAILS_PER_ROW,
+                 PANEL_THUMBNAILS_PER_ROW);
+    float x = (i % PANEL_THUMBNAILS_PER_ROW - (row_count - 1) / 2.0f) *
+              PANEL_THUMBNAIL_SPACING;
+    float y = thumb_y + row * PANEL_THUMBNAIL_SPACING;
+    panel_layout_add(l, mat4_translate(x, y, params.base_z),
+                     PANEL_THUMBNAIL_SIZE, PANEL_THUMBNAIL_SIZE, sources[i],
+                     i);
+  }
+
+  build_bvh(l.bvh, l.boxes.data(), int(l.boxes.size()));
+  l.params = params;
+  l.stack_generation = s.generation;
+  l.valid = true;
+}
+
+// Ray test against a quad facing +z, like the thumbnails. `t` is the
+// distance along the ray.
+static bool panel_facing_hit(const TexturedQuad &q, const float eye[3],
+                             const float ray[3], float &t) {
+  if (fabs(ray[2]) < 1e-5)
+    return false;
+  t = (q.corners[0][2] - eye[2]) / ray[2];
+  if (t < 0)
+    return false;
+  float ix = eye[0] + ray[0] * t;
+  float iy = eye[1] + ray[1] * t;
+  return ix >= q.corners[0][0] && ix <= q.corners[1][0] &&
+         iy >= q.corners[2][1] && iy <= q.corners[0][1];
+}
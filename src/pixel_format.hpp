@@ -0,0 +1,221 @@
+#pragma once
+
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/Xfixes.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstring>
+
+// Pixel layouts of the X visuals we can capture from.
+//
+// Each layout is a traits struct describing where its channels sit and how
+// GL takes it as is. The per-pixel kernels are templates over those traits,
+// so every format gets its own specialized loop with the shifts and widths
+// folded in. A PixelFormat is picked once from the visual, after which the
+// frame path just calls through it.
+
+struct FormatBgra8888 {
+  static constexpr const char *NAME = "bgra8888";
+  typedef uint32_t Pixel;
+  static constexpr int BITS_PER_PIXEL = 32;
+  static constexpr int R_SHIFT = 16, R_BITS = 8;
+  static constexpr int G_SHIFT = 8, G_BITS = 8;
+  static constexpr int B_SHIFT = 0, B_BITS = 8;
+  static constexpr Pixel OPAQUE = 0xff000000u;
+  static constexpr GLenum TEX_INTERNAL = GL_RGBA8;
+  static constexpr GLenum TEX_FORMAT = GL_BGRA;
+  static constexpr GLenum TEX_TYPE = GL_UNSIGNED_INT_8_8_8_8_REV;
+};
+
+// 30-bit desktops, 10 bits per channel.
+struct FormatBgra2101010 {
+  static constexpr const char *NAME = "bgra2101010";
+  typedef uint32_t Pixel;
+  static constexpr int BITS_PER_PIXEL = 32;
+  static constexpr int R_SHIFT = 20, R_BITS = 10;
+  static constexpr int G_SHIFT = 10, G_BITS = 10;
+  static constexpr int B_SHIFT = 0, B_BITS = 10;
+  static constexpr Pixel OPAQUE = 0xc0000000u;
+  static constexpr GLenum TEX_INTERNAL = GL_RGB10_A2;
+  static constexpr GLenum TEX_FORMAT = GL_BGRA;
+  static constexpr GLenum TEX_TYPE = GL_UNSIGNED_INT_2_10_10_10_REV;
+};
+
+// 16-bit sessions, typically VNC.
+struct FormatRgb565 {
+  static constexpr const char *NAME = "rgb565";
+  typedef uint16_t Pixel;
+  static constexpr int BITS_PER_PIXEL = 16;
+  static constexpr int R_SHIFT = 11, R_BITS = 5;
+  static constexpr int G_SHIFT = 5, G_BITS = 6;
+  static constexpr int B_SHIFT = 0, B_BITS = 5;
+  static constexpr Pixel OPAQUE = 0;
+  static constexpr GLenum TEX_INTERNAL = GL_RGB5;
+  static constexpr GLenum TEX_FORMAT = GL_RGB;
+  static constexpr GLenum TEX_TYPE = GL_UNSIGNED_SHORT_5_6_5;
+};
+
+struct PixelFormat {
+  const char *name;
+  int bytes_per_pixel;
+  GLenum gl_internal, gl_format, gl_type;
+  // Blends an ARGB cursor image into `img`, whose top left corner is at
+  // (`origin_x`, `origin_y`) in root coordinates.
+  void (*blend_cursor)(XImage *img, const XFixesCursorImage *ci, int origin_x,
+                       int origin_y);
+  // Writes `w` x `h` pixels of `src` scaled down by `step`, a power of two,
+  // into `dst`. Output pixel (i, j) averages the 2x2 pixels at the centre of
+  // the source block at ((x0 + i) * step, (y0 + j) * step), clamped to the
+  // source; the same footprint GL_LINEAR minification has.
+  void (*resample)(const uint8_t *src, int src_stride, int src_w, int src_h,
+                   int x0, int y0, int step, uint8_t *dst, int dst_stride,
+                   int w, int h);
+};
+
+template <int SHIFT, int BITS>
+static inline uint32_t blend_channel(uint32_t bg, uint32_t c8, uint32_t a) {
+  constexpr uint32_t max = (1u << BITS) - 1;
+  uint32_t b = (bg >> SHIFT) & max;
+  uint32_t c = (c8 * max + 127) / 255;
+  return ((c * a + b * (255 - a) + 127) / 255) << SHIFT;
+}
+
+template <typename F>
+static inline typename F::Pixel blend_pixel(typename F::Pixel bg,
+                                            uint32_t argb) {
+  uint32_t a = argb >> 24;
+  return typename F::Pixel(
+      blend_channel<F::R_SHIFT, F::R_BITS>(bg, (argb >> 16) & 0xff, a) |
+      blend_channel<F::G_SHIFT, F::G_BITS>(bg, (argb >> 8) & 0xff, a) |
+      blend_channel<F::B_SHIFT, F::B_BITS>(bg, argb & 0xff, a) | F::OPAQUE);
+}
+
+template <typename F>
+static void blend_cursor_kernel(XImage *img, const XFixesCursorImage *ci,
+                                int origin_x, int origin_y) {
+  typedef typename F::Pixel Pixel;
+  int x0 = ci->x - ci->xhot - origin_x;
+  int y0 = ci->y - ci->yhot - origin_y;
+
+  // Clip once instead of per pixel.
+  int cx_begin = x0 < 0 ? -x0 : 0;
+  int cy_begin = y0 < 0 ? -y0 : 0;
+  int cx_end = int(ci->width);
+  int cy_end = int(ci->height);
+  if (x0 + cx_end > img->width)
+    cx_end = img->width - x0;
+  if (y0 + cy_end > img->height)
+    cy_end = img->height - y0;
+
+  for (int cy = cy_begin; cy < cy_end; cy++) {
+    Pixel *row = (Pixel *)(img->data + (y0 + cy) * img->bytes_per_line) + x0;
+    const unsigned long *src = ci->pixels + cy * ci->width;
+    for (int cx = cx_begin; cx < cx_end; cx++) {
+      uint32_t argb = uint32_t(src[cx]);
+      if ((argb >> 24) == 0)
+        continue;
+      row[cx] = blend_pixel<F>(row[cx], argb);
+    }
+  }
+}
+
+template <int SHIFT, int BITS>
+static inline uint32_t average_channel(uint32_t a, uint32_t b, uint32_t c,
+                                       uint32_t d) {
+  constexpr uint32_t max = (1u << BITS) - 1;
+  uint32_t sum = ((a >> SHIFT) & max) + ((b >> SHIFT) & max) +
+                 ((c >> SHIFT) & max) + ((d >> SHIFT) & max);
+  return ((sum + 2) >> 2) << SHIFT;
+}
+
+template <typename F>
+static void resample_kernel(const uint8_t *src, int src_stride, int src_w,
+                            int src_h, int x0, int y0, int step, uint8_t *dst,
+                            int dst_stride, int w, int h) {
+  typedef typename F::Pixel Pixel;
+  // Offsets of the two centre pixels, both 0 at full size.
+  const int hi = step / 2, lo = step > 1 ? hi - 1 : 0;
+
+  for (int j = 0; j < h; j++) {
+    int sy = (y0 + j) * step;
+    int ya = std::min(std::max(sy + lo, 0), src_h - 1);
+    int yb = std::min(std::max(sy + hi, 0), src_h - 1);
+    const Pixel *ra = (const Pixel *)(src + ya * src_stride);
+    const Pixel *rb = (const Pixel *)(src + yb * src_stride);
+    Pixel *out = (Pixel *)(dst + j * dst_stride);
+
+    for (int i = 0; i < w; i++) {
+      int sx = (x0 + i) * step;
+      int xa = std::min(std::max(sx + lo, 0), src_w - 1);
+      if (step == 1) {
+        out[i] = ra[xa];
+        continue;
+      }
+      int xb = std::min(std::max(sx + hi, 0), src_w - 1);
+      Pixel p00 = ra[xa], p01 = ra[xb], p10 = rb[xa], p11 = rb[xb];
+      out[i] = Pixel(
+          average_channel<F::R_SHIFT, F::R_BITS>(p00, p01, p10, p11) |
+          average_channel<F::G_SHIFT, F::G_BITS>(p00, p01, p10, p11) |
+          average_channel<F::B_SHIFT, F::B_BITS>(p00, p01, p10, p11) |
+          F::OPAQUE);
+    }
+  }
+}
+
+template <typename F> static const PixelFormat *pixel_format() {
+  static const PixelFormat format = {
+      F::NAME,        F::BITS_PER_PIXEL / 8,  F::TEX_INTERNAL,
+      F::TEX_FORMAT,  F::TEX_TYPE,            blend_cursor_kernel<F>,
+      resample_kernel<F>};
+  return &format;
+}
+
+template <typename F> static bool visual_matches(const Visual *v, int bpp) {
+  constexpr unsigned long r = ((1ul << F::R_BITS) - 1) << F::R_SHIFT;
+  constexpr unsigned long g = ((1ul << F::G_BITS) - 1) << F::G_SHIFT;
+  constexpr unsigned long b = ((1ul << F::B_BITS) - 1) << F::B_SHIFT;
+  return bpp == F::BITS_PER_PIXEL && v->red_mask == r && v->green_mask == g &&
+         v->blue_mask == b;
+}
+
+static int bits_per_pixel_for_depth(Display *dpy, int depth) {
+  int n = 0, bpp = 0;
+  XPixmapFormatValues *formats = XListPixmapFormats(dpy, &n);
+  for (int i = 0; i < n; i++) {
+    if (formats[i].depth == depth)
+      bpp = formats[i].bits_per_pixel;
+  }
+  if (formats)
+    XFree(formats);
+  return bpp;
+}
+
+// The format images of `visual` at `depth` come in, or nullptr if we don't
+// handle it.
+static const PixelFormat *find_pixel_format(Display *dpy, const Visual *visual,
+                                            int depth) {
+  int bpp = bits_per_pixel_for_depth(dpy, depth);
+  if (visual_matches<FormatBgra8888>(visual, bpp))
+    return pixel_format<FormatBgra8888>();
+  if (visual_matches<FormatBgra2101010>(visual, bpp))
+    return pixel_format<FormatBgra2101010>();
+  if (visual_matches<FormatRgb565>(visual, bpp))
+    return pixel_format<FormatRgb565>();
+  return nullptr;
+}
+
+// The format called `name`, or nullptr.
+static const PixelFormat *find_pixel_format_by_name(const char *name) {
+  const PixelFormat *formats[] = {pixel_format<FormatBgra8888>(),
+                                  pixel_format<FormatBgra2101010>(),
+                                  pixel_format<FormatRgb565>()};
+  for (const PixelFormat *f : formats) {
+    if (strcmp(f->name, name) == 0)
+      return f;
+  }
+  return nullptr;
+}
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <cmath>
+#include <mutex>
+#include <stdint.h>
+
+#include "clock.hpp"
+
+// Head pose estimation from timestamped IMU samples.
+//
+// Euler angles are smoothed with a One-Euro filter: a low-pass whose cutoff
+// rises with angular speed, so a still head gets heavy smoothing while fast
+// turns pass through with almost no lag. The quaternion gets the same
+// treatment with the cutoff driven by its rotation rate.
+//
+// Consumers ask for the pose at a future host time (for example the expected
+// scanout) and get it extrapolated with the filtered angular velocity. A
+// first order low-pass trails a constant rotation by velocity * tau, so the
+// extrapolation also covers that lag and the filter adds no latency while the
+// head is turning steadily.
+
+enum PoseFilterMode {
+  POSE_FILTER_NONE,
+  POSE_FILTER_ONE_EURO,
+};
+
+struct PoseFilterConfig {
+  PoseFilterMode mode = POSE_FILTER_ONE_EURO;
+  // Cutoff while the head is still.
+  float min_cutoff_hz = 1.0f;
+  // How fast the cutoff rises with angular speed (per degree/second).
+  float beta = 0.05f;
+  // Cutoff of the velocity estimate itself.
+  float d_cutoff_hz = 1.0f;
+  // Never extrapolate further than this past the newest sample.
+  float max_prediction_s = 0.05f;
+};
+
+struct Quat {
+  float w, x, y, z;
+};
+
+static Quat quat_mul(Quat a, Quat b) {
+  return {a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z,
+          a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+          a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+          a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w};
+}
+
+static Quat quat_conj(Quat q) { return {q.w, -q.x, -q.y, -q.z}; }
+
+static Quat quat_normalize(Quat q) {
+  float len = sqrtf(q.w * q.w + q.x * q.x + q.y * q.y + q.z * q.z);
+  if (len == 0.0f)
+    return {1, 0, 0, 0};
+  return {q.w / len, q.x / len, q.y / len, q.z / len};
+}
+
+// Normalized lerp along the shorter arc, good enough for the small steps
+// between consecutive samples.
+static Quat quat_nlerp(Quat a, Quat b, float t) {
+  float dot = a.w * b.w + a.x * b.x + a.y * b.y + a.z * b.z;
+  float s = dot < 0.0f ? -1.0f : 1.0f;
+  return quat_normalize({a.w + (s * b.w - a.w) * t, a.x + (s * b.x - a.x) * t,
+                         a.y + (s * b.y - a.y) * t,
+                         a.z + (s * b.z - a.z) * t});
+}
+
+// Rotation vector (axis * angle in radians) of a unit quaternion.
+static void quat_to_rotvec(Quat q, float v[3]) {
+  if (q.w < 0.0f)
+    q = {-q.w, -q.x, -q.y, -q.z};
+  float s = sqrtf(q.x * q.x + q.y * q.y + q.z * q.z);
+  float k = s < 1e-6f ? 2.0f : 2.0f * atan2f(s, q.w) / s;
+  v[0] = q.x * k;
+  v[1] = q.y * k;
+  v[2] = q.z * k;
+}
+
+static Quat quat_from_rotvec(const float v[3]) {
+  float angle = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+  if (angle < 1e-6f)
+    return quat_normalize({1.0f, v[0] / 2, v[1] / 2, v[2] / 2});
+  float s = sinf(angle / 2) / angle;
+  return {cosf(angle / 2), v[0] * s, v[1] * s, v[2] * s};
+}
+
+// Maps an angle into (-180, 180].
+static float wrap_degrees(float a) {
+  a = fmodf(a + 180.0f, 360.0f);
+  if (a < 0.0f)
+    a += 360.0f;
+  return a - 180.0f;
+}
+
+struct ImuSample {
+  // Device timestamp and the host time the sample arrived at.
+  uint32_t ts;
+  int64_t host_ns;
+  float roll, pitch, yaw;
+  bool has_quat;
+  Quat q;
+};
+
+// Offsets from aligning, added to the filtered pose by its consumers.
+struct PoseAlignment {
+  float roll = 0.0f, pitch = 0.0f, yaw = 0.0f;
+  // Applied on the left of the pose's quaternion.
+  Quat q = {1.0f, 0.0f, 0.0f, 0.0f};
+};
+
+struct Pose {
+  float roll, pitch, yaw;
+  Quat q;
+  // Filtered angular velocity, degrees per second per Euler angle.
+  float droll, dpitch, dyaw;
+  // Host time this pose refers to.
+  int64_t host_ns;
+  // Device timestamp and arrival of the newest sample it was made from.
+  uint32_t sample_ts;
+  int64_t sample_host_ns;
+  // Alignment at the time, so the pose and its offsets always match.
+  PoseAlignment alignment;
+};
+
+struct OneEuroFilter {
+  // Filtered value, filtered derivative and last unwrapped raw input.
+  float x, dx, raw;
+  // Time constant used for the latest step, i.e. how far x trails a ramp.
+  float lag_s;
+  bool primed;
+};
+
+static float one_euro_tau(float cutoff_hz) {
+  return 1.0f / (2.0f * float(M_PI) * cutoff_hz);
+}
+
+static float one_euro_alpha(float cutoff_hz, float dt) {
+  return 1.0f / (1.0f + one_euro_tau(cutoff_hz) / dt);
+}
+
+// Filters an angle in degrees. The input is unwrapped against the previous
+// output so crossing +-180 doesn't look like a full turn.
+static float one_euro_angle(OneEuroFilter &f, const PoseFilterConfig &c,
+                            float x, float dt) {
+  if (!f.primed) {
+    f = {x, 0.0f, x, 0.0f, true};
+    return f.x;
+  }
+
+  float raw = f.raw + wrap_degrees(x - f.raw);
+  f.dx += ((raw - f.raw) / dt - f.dx) * one_euro_alpha(c.d_cutoff_hz, dt);
+  f.raw = wrap_degrees(raw);
+
+  float alpha = 1.0f;
+  f.lag_s = 0.0f;
+  if (c.mode == POSE_FILTER_ONE_EURO) {
+    float cutoff = c.min_cutoff_hz + c.beta * fabsf(f.dx);
+    alpha = one_euro_alpha(cutoff, dt);
+    f.lag_s = one_euro_tau(cutoff);
+  }
+  f.x = wrap_degrees(f.x + wrap_degrees(x - f.x) * alpha);
+  return f.x;
+}
+
+// Gaps longer than this (USB hiccup, rate switch, reconnect) restart the
+// filters instead of being read as a huge velocity.
+#define POSE_MAX_SAMPLE_GAP_S 0.1f
+// Longer gap tolerated while the report rate is being switched.
+#define POSE_MAX_SWITCH_GAP_S 0.5f
+// How long after a rate switch the longer gap is still accepted.
+#define POSE_SWITCH_GRACE_NS 200000000LL
+
+// Samples used to work out the unit of the device timestamp.
+#define POSE_TS_CALIBRATION_SAMPLES 200
+
+struct PoseEstimator {
+  std::mutex mutex;
+  PoseFilterConfig config;
+
+  OneEuroFilter roll, pitch, yaw;
+  Quat q;
+  // Filtered body rate of the quaternion, radians per second.
+  float omega[3];
+  float q_lag_s;
+  bool has_quat;
+
+  uint32_t last_ts;
+  int64_t last_host_ns;
+  uint64_t samples;
+
+  // Samples arriving up to this host time may follow a longer gap, see
+  // begin_imu_rate_switch().
+  int64_t bridge_until_ns;
+
+  // The SDK doesn't document the unit of `ts`. It is worked out by comparing
+  // device ticks against host time over the first samples; host deltas are
+  // used until then.
+  uint32_t first_ts;
+  int64_t first_host_ns;
+  uint64_t elapsed_ticks;
+  double ticks_per_second;
+
+  // Written from both the render and the IMU thread, see align_pose().
+  PoseAlignment alignment;
+};
+
+static void reset_pose_estimator(PoseEstimator &e) {
+  e.roll.primed = false;
+  e.pitch.primed = false;
+  e.yaw.primed = false;
+  e.has_quat = false;
+  e.omega[0] = e.omega[1] = e.omega[2] = 0.0f;
+  e.q_lag_s = 0.0f;
+  e.samples = 0;
+}
+
+static float sample_dt(PoseEstimator &e, const ImuSample &s) {
+  float host_dt = float(s.host_ns - e.last_host_ns) * 1e-9f;
+  // Unsigned subtraction copes with the counter wrapping.
+  uint32_t ticks = s.ts - e.last_ts;
+
+  if (e.ticks_per_second == 0.0) {
+    e.elapsed_ticks += ticks;
+    if (e.samples >= POSE_TS_CALIBRATION_SAMPLES) {
+      double seconds = double(s.host_ns - e.first_host_ns) * 1e-9;
+      double rate = double(e.elapsed_ticks) / seconds;
+      // Snap to the nearest power of ten (ms, us, ns).
+      e.ticks_per_second = pow(10.0, round(log10(rate)));
+    }
+    return host_dt;
+  }
+  return float(ticks / e.ticks_per_second);
+}
+
+// Called from the IMU callback thread.
+static void push_imu_sample(PoseEstimator &e, const ImuSample &s) {
+  std::lock_guard<std::mutex> lock(e.mutex);
+  const PoseFilterConfig &c = e.config;
+
+  float max_gap = s.host_ns <= e.bridge_until_ns ? POSE_MAX_SWITCH_GAP_S
+                                                 : POSE_MAX_SAMPLE_GAP_S;
+  float dt = e.samples == 0 ? 0.0f : sample_dt(e, s);
+  if (e.samples > 0 && (dt <= 0.0f || dt > max_gap)) {
+    reset_pose_estimator(e);
+    dt = 0.0f;
+  }
+
+  if (e.samples == 0 && e.ticks_per_second == 0.0) {
+    e.first_ts = s.ts;
+    e.first_host_ns = s.host_ns;
+    e.elapsed_ticks = 0;
+  }
+
+  if (dt == 0.0f) {
+    e.roll = {s.roll, 0.0f, s.roll, 0.0f, true};
+    e.pitch = {s.pitch, 0.0f, s.pitch, 0.0f, true};
+    e.yaw = {s.yaw, 0.0f, s.yaw, 0.0f, true};
+    e.q = s.q;
+    e.has_quat = s.has_quat;
+  } else {
+    one_euro_angle(e.roll, c, s.roll, dt);
+    one_euro_angle(e.pitch, c, s.pitch, dt);
+    one_euro_angle(e.yaw, c, s.yaw, dt);
+
+    if (s.has_quat && e.has_quat) {
+      float raw[3];
+      quat_to_rotvec(quat_mul(quat_conj(e.q), s.q), raw);
+      float speed_deg = sqrtf(raw[0] * raw[0] + raw[1] * raw[1] +
+                              raw[2] * raw[2]) /
+                        dt * float(180.0 / M_PI);
+
+      float alpha = 1.0f;
+      e.q_lag_s = 0.0f;
+      if (c.mode == POSE_FILTER_ONE_EURO) {
+        float cutoff = c.min_cutoff_hz + c.beta * speed_deg;
+        alpha = one_euro_alpha(cutoff, dt);
+        e.q_lag_s = one_euro_tau(cutoff);
+      }
+      Quat filtered = quat_nlerp(e.q, s.q, alpha);
+
+      float step[3];
+      quat_to_rotvec(quat_mul(quat_conj(e.q), filtered), step);
+      float d_alpha = one_euro_alpha(c.d_cutoff_hz, dt);
+      for (int i = 0; i < 3; i++) {
+        e.omega[i] += (step[i] / dt - e.omega[i]) * d_alpha;
+      }
+      e.q = filtered;
+    } else {
+      e.q = s.q;
+      e.has_quat = s.has_quat;
+    }
+  }
+
+  e.last_ts = s.ts;
+  e.last_host_ns = s.host_ns;
+  e.samples++;
+}
+
+// Pose extrapolated to `target_host_ns`, clamped to max_prediction_s past the
+// newest sample. Expects the lock to be held.
+static Pose predict_pose_locked(PoseEstimator &e, int64_t target_host_ns) {
+  float dt = float(target_host_ns - e.last_host_ns) * 1e-9f;
+  if (dt < 0.0f)
+    dt = 0.0f;
+  if (dt > e.config.max_prediction_s)
+    dt = e.config.max_prediction_s;
+
+  Pose p;
+  p.droll = e.roll.dx;
+  p.dpitch = e.pitch.dx;
+  p.dyaw = e.yaw.dx;
+  p.roll = wrap_degrees(e.roll.x + p.droll * (e.roll.lag_s + dt));
+  p.pitch = wrap_degrees(e.pitch.x + p.dpitch * (e.pitch.lag_s + dt));
+  p.yaw = wrap_degrees(e.yaw.x + p.dyaw * (e.yaw.lag_s + dt));
+
+  float ahead = e.q_lag_s + dt;
+  float step[3] = {e.omega[0] * ahead, e.omega[1] * ahead,
+                   e.omega[2] * ahead};
+  // Identity rather than the zero quaternion without quaternion samples, or
+  // before the first sample.
+  p.q = e.has_quat ? quat_mul(e.q, quat_from_rotvec(step))
+                   : Quat{1.0f, 0.0f, 0.0f, 0.0f};
+  p.host_ns = e.last_host_ns + int64_t(dt * 1e9f);
+  p.sample_ts = e.last_ts;
+  p.sample_host_ns = e.last_host_ns;
+  p.alignment = e.alignment;
+  return p;
+}
+
+// Safe to call from any thread.
+static Pose predict_pose(PoseEstimator &e, int64_t target_host_ns) {
+  std::lock_guard<std::mutex> lock(e.mutex);
+  return predict_pose_locked(e, target_host_ns);
+}
+
+// Sets the offsets so that the pose at the newest sample shows as `roll`,
+// `pitch`, `yaw` and `q`. The pose is read under the same lock, so aligning
+// from several threads at once can't mix up offsets from different poses.
+// Safe to call from any thread.
+static void align_pose(PoseEstimator &e, float roll, float pitch, float yaw,
+                       Quat q) {
+  std::lock_guard<std::mutex> lock(e.mutex);
+  Pose p = predict_pose_locked(e, 0);
+  e.alignment.roll = roll - p.roll;
+  e.alignment.pitch = pitch - p.pitch;
+  e.alignment.yaw = yaw - p.yaw;
+  e.alignment.q = quat_mul(q, quat_conj(p.q));
+}
+
+// Brackets a change of the IMU report rate. Reporting may pause while the
+// device reconfigures; the first sample afterwards is filtered with its real
+// dt instead of restarting the filter, so consumers see a continuous pose.
+static void begin_imu_rate_switch(PoseEstimator &e) {
+  std::lock_guard<std::mutex> lock(e.mutex);
+  e.bridge_until_ns = INT64_MAX;
+}
+
+static void end_imu_rate_switch(PoseEstimator &e) {
+  std::lock_guard<std::mutex> lock(e.mutex);
+  e.bridge_until_ns = monotonic_ns() + POSE_SWITCH_GRACE_NS;
+}
+
+// Current filtered angular speed in degrees per second.
+static float pose_angular_speed(PoseEstimator &e) {
+  std::lock_guard<std::mutex> lock(e.mutex);
+  if (e.has_quat) {
+    return sqrtf(e.omega[0] * e.omega[0] + e.omega[1] * e.omega[1] +
+                 e.omega[2] * e.omega[2]) *
+           float(180.0 / M_PI);
+  }
+  return sqrtf(e.roll.dx * e.roll.dx + e.pitch.dx * e.pitch.dx +
+               e.yaw.dx * e.yaw.dx);
+}
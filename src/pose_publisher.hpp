@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pose_shm.h"
+
+// Writer side of the pose ring described in include/pose_shm.h. Only the IMU
+// callback thread publishes, so the ring has a single writer and needs no
+// lock; readers rely on the per-record seqlock.
+
+struct PosePublisher {
+  viture_pose_shm *shm;
+};
+
+// Pid of the live process writing the existing segment, 0 if there is none
+// or it is gone.
+static pid_t pose_segment_writer() {
+  int fd = shm_open(VITURE_POSE_SHM_NAME, O_RDONLY, 0);
+  if (fd < 0)
+    return 0;
+  struct stat st;
+  void *addr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(viture_pose_shm)) {
+    addr = mmap(NULL, sizeof(viture_pose_shm), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (addr == MAP_FAILED)
+    return 0;
+  auto *shm = (const viture_pose_shm *)addr;
+  // Older layouts have no pid, and zero there.
+  pid_t pid = shm->magic == VITURE_POSE_SHM_MAGIC ? shm->writer_pid : 0;
+  munmap(addr, sizeof(viture_pose_shm));
+  if (pid <= 0 || pid == getpid() || (kill(pid, 0) < 0 && errno == ESRCH))
+    return 0;
+  return pid;
+}
+
+static bool open_pose_publisher(PosePublisher &p) {
+  int fd = shm_open(VITURE_POSE_SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0 && errno == EEXIST) {
+    pid_t writer = pose_segment_writer();
+    if (writer > 0) {
+      fprintf(stderr, "The pose is already broadcast by process %d\n",
+              int(writer));
+      return false;
+    }
+    // Left behind by an instance that is gone, possibly with an older
+    // layout. Readers still mapping it keep their copy instead of faulting
+    // on a truncated one.
+    shm_unlink(VITURE_POSE_SHM_NAME);
+    fd = shm_open(VITURE_POSE_SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0644);
+  }
+  if (fd < 0) {
+    perror("shm_open pose");
+    return false;
+  }
+  if (ftruncate(fd, sizeof(viture_pose_shm)) < 0) {
+    perror("ftruncate pose");
+    close(fd);
+    return false;
+  }
+  void *addr = mmap(NULL, sizeof(viture_pose_shm), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    perror("mmap pose");
+    return false;
+  }
+
+  p.shm = (viture_pose_shm *)addr;
+  p.shm->version = VITURE_POSE_SHM_VERSION;
+  p.shm->record_size = sizeof(viture_pose_record);
+  p.shm->ring_size = VITURE_POSE_RING_SIZE;
+  p.shm->writer_pid = getpid();
+  // Readers check the magic last, publish it once the rest is in place.
+  __atomic_store_n(&p.shm->magic, VITURE_POSE_SHM_MAGIC, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Removes the name so new readers don't attach to a stale ring. The mapping
+// stays, the IMU callback may still be running.
+static void close_pose_publisher(PosePublisher &p) {
+  if (!p.shm)
+    return;
+  shm_unlink(VITURE_POSE_SHM_NAME);
+}
+
+// `rec.seq` and `rec.index` are filled in here.
+static void publish_pose(PosePublisher &p, const viture_pose_record &rec) {
+  if (!p.shm)
+    return;
+
+  uint64_t index = p.shm->head;
+  viture_pose_record &slot =
+      p.shm->records[index & (VITURE_POSE_RING_SIZE - 1)];
+  uint32_t seq = slot.seq;
+
+  __atomic_store_n(&slot.seq, seq + 1, __ATOMIC_RELAXED);
+  // Readers must see the odd sequence before any of the new data.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot.device_ts = rec.device_ts;
+  slot.index = index;
+  slot.host_ns = rec.host_ns;
+  slot.roll = rec.roll;
+  slot.pitch = rec.pitch;
+  slot.yaw = rec.yaw;
+  slot.qw = rec.qw;
+  slot.qx = rec.qx;
+  slot.qy = rec.qy;
+  slot.qz = rec.qz;
+  slot.droll = rec.droll;
+  slot.dpitch = rec.dpitch;
+  slot.dyaw = rec.dyaw;
+  __atomic_store_n(&slot.seq, seq + 2, __ATOMIC_RELEASE);
+
+  __atomic_store_n(&p.shm->head, index + 1, __ATOMIC_RELEASE);
+}
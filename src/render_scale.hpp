@@ -0,0 +1,312 @@
+#pragma once
+
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdint.h>
+
+#include "gl_ext.hpp"
+
+// Dynamic render resolution. The panel scene is drawn into an offscreen
+// target at `scale` times the output size and then stretched onto the
+// window with a sharpening filter. The scale follows the GPU time of the
+// scene pass: when it runs over budget the resolution drops within a few
+// frames, so the display keeps up with the head at full rate and only gets
+// softer. It recovers slowly and only with plenty of headroom, so it doesn't
+// oscillate around the budget.
+//
+// Timings arrive a few frames late (see gpu_timer.hpp). After each change,
+// frames still rendered at the old scale are ignored.
+
+// Frames over budget before the scale drops.
+#define RENDER_SCALE_DOWN_FRAMES 3
+// Frames well under budget before the scale rises.
+#define RENDER_SCALE_UP_FRAMES 60
+// "Well under": the cost at the raised scale has to fit in this share of
+// the budget.
+#define RENDER_SCALE_UP_HEADROOM 0.85f
+// Largest single increase.
+#define RENDER_SCALE_UP_STEP 0.05f
+// Scales are multiples of this, so that tiny changes don't thrash.
+#define RENDER_SCALE_QUANTUM (1.0f / 64.0f)
+
+struct RenderScaleConfig {
+  float min_scale = 0.5f;
+  float max_scale = 1.0f;
+  // GPU time the scene pass may take.
+  float budget_ms = 5.0f;
+  // Sharpening at min_scale, less the closer the scale gets to 1.
+  float sharpness = 0.6f;
+};
+
+struct RenderScaleController {
+  RenderScaleConfig config;
+  float scale;
+  // Smoothed scene pass time at `scale`, -1 until the first sample.
+  float avg_ns;
+  int over_frames, under_frames;
+  // Timings of frames before this one were rendered at another scale.
+  uint64_t settle_frame;
+};
+
+static float quantize_render_scale(const RenderScaleConfig &c, float s) {
+  s = std::round(s / RENDER_SCALE_QUANTUM) * RENDER_SCALE_QUANTUM;
+  return std::min(std::max(s, c.min_scale), c.max_scale);
+}
+
+static void init_render_scale(RenderScaleController &c,
+                              const RenderScaleConfig &config) {
+  c = RenderScaleController{};
+  c.config = config;
+  c.scale = config.max_scale;
+  c.avg_ns = -1;
+}
+
+// Feeds the scene pass time of frame `frame`. `next_frame` is the number
+// the next rendered frame will get. Returns true if the scale changed.
+static bool update_render_scale(RenderScaleController &c, uint64_t frame,
+                                int64_t scene_ns, uint64_t next_frame) {
+  if (scene_ns < 0 || frame < c.settle_frame)
+    return false;
+  c.avg_ns = c.avg_ns < 0 ? scene_ns : c.avg_ns * 0.8f + scene_ns * 0.2f;
+
+  float budget_ns = c.config.budget_ms * 1e6f;
+  // Cost grows with the pixel count, i.e. the square of the scale.
+  float fit = c.scale * std::sqrt(budget_ns / std::max(c.avg_ns, 1.0f));
+
+  float target = c.scale;
+  if (c.avg_ns > budget_ns) {
+    c.under_frames = 0;
+    if (++c.over_frames >= RENDER_SCALE_DOWN_FRAMES)
+      target = fit * 0.95f;
+  } else if (fit * std::sqrt(RENDER_SCALE_UP_HEADROOM) > c.scale) {
+    c.over_frames = 0;
+    if (++c.under_frames >= RENDER_SCALE_UP_FRAMES) {
+      target = std::min(fit * std::sqrt(RENDER_SCALE_UP_HEADROOM),
+                        c.scale + RENDER_SCALE_UP_STEP);
+    }
+  } else {
+    c.over_frames = 0;
+    c.under_frames = 0;
+  }
+
+  target = quantize_render_scale(c.config, target);
+  if (target == c.scale)
+    return false;
+  c.scale = target;
+  c.avg_ns = -1;
+  c.over_frames = 0;
+  c.under_frames = 0;
+  c.settle_frame = next_frame;
+  return true;
+}
+
+static float render_sharpness(const RenderScaleController &c) {
+  if (c.scale >= 1.0f || c.config.min_scale >= 1.0f)
+    return 0.0f;
+  return c.config.sharpness * (1.0f - c.scale) / (1.0f - c.config.min_scale);
+}
+
+// Offscreen target for the scaled scene, allocated once for the largest
+// scale; smaller scales use its bottom left corner.
+struct ScaledTarget {
+  bool enabled;
+  GLuint fbo, color, depth;
+  int width, height;
+  GLuint program;
+  GLint u_tex, u_uv_max, u_texel, u_sharpness;
+};
+
+// Bilinear upscale plus an unsharp mask over the four neighbours, clamped
+// to their range so edges don't ring.
+static const char *SCALED_TARGET_VERTEX_SHADER = R"(
+#version 120
+void main() {
+  gl_TexCoord[0] = gl_MultiTexCoord0;
+  gl_Position = gl_Vertex;
+}
+)";
+
+static const char *SCALED_TARGET_FRAGMENT_SHADER = R"(
+#version 120
+uniform sampler2D tex;
+// Top right corner of the rendered part in texture coordinates.
+uniform vec2 uv_max;
+uniform vec2 texel;
+uniform float sharpness;
+
+vec3 fetch(vec2 uv) {
+  return texture2D(tex, clamp(uv, texel * 0.5, uv_max - texel * 0.5)).rgb;
+}
+
+void main() {
+  vec2 uv = gl_TexCoord[0].xy * uv_max;
+  vec3 c = fetch(uv);
+  vec3 n = fetch(uv + vec2(0.0, texel.y));
+  vec3 s = fetch(uv - vec2(0.0, texel.y));
+  vec3 e = fetch(uv + vec2(texel.x, 0.0));
+  vec3 w = fetch(uv - vec2(texel.x, 0.0));
+  vec3 lo = min(c, min(min(n, s), min(e, w)));
+  vec3 hi = max(c, max(max(n, s), max(e, w)));
+  vec3 sharp = c + sharpness * (c - (n + s + e + w) * 0.25);
+  gl_FragColor = vec4(clamp(sharp, lo, hi), 1.0);
+}
+)";
+
+static GLuint compile_shader(GLenum type, const char *source) {
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, 1, &source, nullptr);
+  glCompileShader(shader);
+  GLint ok = GL_FALSE;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[512];
+    glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+    fprintf(stderr, "Shader compile failed: %s\n", log);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+static void destroy_scaled_target(ScaledTarget &t) {
+  if (t.program)
+    glDeleteProgram(t.program);
+  if (t.fbo)
+    glDeleteFramebuffers(1, &t.fbo);
+  if (t.color)
+    glDeleteTextures(1, &t.color);
+  if (t.depth)
+    glDeleteRenderbuffers(1, &t.depth);
+  t = ScaledTarget{};
+}
+
+// Must be called with the render context current. On failure the scene is
+// simply drawn at full resolution.
+static bool init_scaled_target(ScaledTarget &t, int output_width,
+                               int output_height, float max_scale) {
+  t = ScaledTarget{};
+  if (!gl_has_extension("GL_ARB_framebuffer_object")) {
+    fprintf(stderr, "GL_ARB_framebuffer_object missing, dynamic "
+                    "resolution disabled\n");
+    return false;
+  }
+
+  GLuint vs = compile_shader(GL_VERTEX_SHADER, SCALED_TARGET_VERTEX_SHADER);
+  GLuint fs =
+      compile_shader(GL_FRAGMENT_SHADER, SCALED_TARGET_FRAGMENT_SHADER);
+  if (vs && fs) {
+    t.program = glCreateProgram();
+    glAttachShader(t.program, vs);
+    glAttachShader(t.program, fs);
+    glLinkProgram(t.program);
+  }
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+  GLint linked = GL_FALSE;
+  if (t.program)
+    glGetProgramiv(t.program, GL_LINK_STATUS, &linked);
+  if (!linked) {
+    fprintf(stderr, "Upscale shader unusable, dynamic resolution disabled\n");
+    destroy_scaled_target(t);
+    return false;
+  }
+  t.u_tex = glGetUniformLocation(t.program, "tex");
+  t.u_uv_max = glGetUniformLocation(t.program, "uv_max");
+  t.u_texel = glGetUniformLocation(t.program, "texel");
+  t.u_sharpness = glGetUniformLocation(t.program, "sharpness");
+
+  t.width = int(std::ceil(output_width * max_scale));
+  t.height = int(std::ceil(output_height * max_scale));
+  glGenTextures(1, &t.color);
+  glBindTexture(GL_TEXTURE_2D, t.color);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, t.width, t.height, 0, GL_RGBA,
+               GL_UNSIGNED_BYTE, nullptr);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glGenRenderbuffers(1, &t.depth);
+  glBindRenderbuffer(GL_RENDERBUFFER, t.depth);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, t.width,
+                        t.height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glGenFramebuffers(1, &t.fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, t.fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         t.color, 0);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                            GL_RENDERBUFFER, t.depth);
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "Offscreen target incomplete (0x%x), dynamic "
+                    "resolution disabled\n",
+            status);
+    destroy_scaled_target(t);
+    return false;
+  }
+  t.enabled = true;
+  return true;
+}
+
+static void scaled_size(const ScaledTarget &t, int output_width,
+                        int output_height, float scale, int &width,
+                        int &height) {
+  width = std::min(std::max(int(output_width * scale + 0.5f), 1), t.width);
+  height = std::min(std::max(int(output_height * scale + 0.5f), 1), t.height);
+}
+
+// Redirects drawing into the target at `scale`. Returns false if the scene
+// should go straight to the window instead, which is also the case at
+// exactly 1.
+static bool begin_scaled_render(const ScaledTarget &t, int output_width,
+                                int output_height, float scale) {
+  if (!t.enabled || scale == 1.0f)
+    return false;
+  int width, height;
+  scaled_size(t, output_width, output_height, scale, width, height);
+  glBindFramebuffer(GL_FRAMEBUFFER, t.fbo);
+  glViewport(0, 0, width, height);
+  return true;
+}
+
+// Stretches what was drawn since begin_scaled_render() over the window.
+static void end_scaled_render(const ScaledTarget &t, int output_width,
+                              int output_height, float scale,
+                              float sharpness) {
+  int width, height;
+  scaled_size(t, output_width, output_height, scale, width, height);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(0, 0, output_width, output_height);
+
+  glDisable(GL_DEPTH_TEST);
+  glEnable(GL_TEXTURE_2D);
+  glBindTexture(GL_TEXTURE_2D, t.color);
+  glUseProgram(t.program);
+  glUniform1i(t.u_tex, 0);
+  glUniform2f(t.u_uv_max, float(width) / t.width, float(height) / t.height);
+  glUniform2f(t.u_texel, 1.0f / t.width, 1.0f / t.height);
+  // Downscaling needs no sharpening.
+  glUniform1f(t.u_sharpness, scale < 1.0f ? sharpness : 0.0f);
+
+  glBegin(GL_QUADS);
+  glTexCoord2f(0, 0);
+  glVertex2f(-1, -1);
+  glTexCoord2f(1, 0);
+  glVertex2f(1, -1);
+  glTexCoord2f(1, 1);
+  glVertex2f(1, 1);
+  glTexCoord2f(0, 1);
+  glVertex2f(-1, 1);
+  glEnd();
+
+  glUseProgram(0);
+  glEnable(GL_DEPTH_TEST);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "mat4.hpp"
+
+// A textured rectangle of the scene in world space, as drawn by either
+// render backend. Texture coordinates are normalized.
+struct TexturedQuad {
+  // Top left, top right, bottom right, bottom left.
+  float corners[4][3];
+  float u0, v0, u1, v1;
+};
+
+// A `w` by `h` quad centred on the origin of `model`.
+static TexturedQuad make_textured_quad(const Mat4 &model, float w, float h,
+                                       float u0, float v0, float u1,
+                                       float v1) {
+  const float local[4][3] = {
+      {-w / 2, h / 2, 0}, {w / 2, h / 2, 0}, {w / 2, -h / 2, 0},
+      {-w / 2, -h / 2, 0}};
+  TexturedQuad q;
+  for (int c = 0; c < 4; c++) {
+    float p[4];
+    mat4_transform(model, local[c], p);
+    q.corners[c][0] = p[0];
+    q.corners[c][1] = p[1];
+    q.corners[c][2] = p[2];
+  }
+  q.u0 = u0;
+  q.v0 = v0;
+  q.u1 = u1;
+  q.v1 = v1;
+  return q;
+}
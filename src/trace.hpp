@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+// Trace spans for finding out what a hitch overlapped with.
+//
+//   TRACE_SCOPE("upload");             span until the end of the scope
+//   TRACE_SCOPE_ARG("frame", frame);   same, with a number attached
+//   TRACE_INSTANT("command");          a point in time
+//   TRACE_THREAD("render");            names the calling thread
+//
+// Only compiled in with VITURE_TRACE (cmake -DENABLE_TRACE=ON), otherwise
+// the macros expand to nothing. Each thread records into its own ring of
+// TRACE_RING_EVENTS, written without locks; the oldest events are
+// overwritten. The `trace_dump [seconds] [path]` command writes the last
+// seconds of all rings as a Chrome trace-event file, which Perfetto and
+// chrome://tracing open.
+
+#define TRACE_DEFAULT_PATH "/tmp/viture_trace.json"
+#define TRACE_DEFAULT_SECONDS 10
+
+#ifdef VITURE_TRACE
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "clock.hpp"
+
+#define TRACE_RING_EVENTS 65536
+#define TRACE_MAX_THREADS 32
+
+struct TraceEvent {
+  const char *name;
+  int64_t begin_ns;
+  // -1 for instants.
+  int64_t end_ns;
+  // -1 for none.
+  int64_t arg;
+};
+
+struct TraceRing {
+  TraceEvent events[TRACE_RING_EVENTS];
+  // Events written so far. Only the owning thread writes.
+  std::atomic<uint64_t> head{0};
+  int tid;
+  char name[16];
+};
+
+static TraceRing *trace_rings[TRACE_MAX_THREADS];
+static std::atomic<int> trace_ring_count{0};
+
+// The calling thread's ring, created on first use. Never freed, threads
+// that come and go keep their history.
+static TraceRing *trace_ring() {
+  static thread_local TraceRing *ring = nullptr;
+  static thread_local bool full = false;
+  if (ring || full)
+    return ring;
+  int index = trace_ring_count.load(std::memory_order_relaxed);
+  do {
+    if (index == TRACE_MAX_THREADS) {
+      full = true;
+      return nullptr;
+    }
+  } while (!trace_ring_count.compare_exchange_weak(index, index + 1));
+  ring = new TraceRing();
+  ring->tid = index + 1;
+  snprintf(ring->name, sizeof(ring->name), "thread %d", ring->tid);
+  // Published after it is set up, dumps only look at non-null entries.
+  __atomic_store_n(&trace_rings[index], ring, __ATOMIC_RELEASE);
+  return ring;
+}
+
+static void trace_push(const char *name, int64_t begin_ns, int64_t end_ns,
+                       int64_t arg) {
+  TraceRing *r = trace_ring();
+  if (!r)
+    return;
+  uint64_t head = r->head.load(std::memory_order_relaxed);
+  r->events[head % TRACE_RING_EVENTS] = {name, begin_ns, end_ns, arg};
+  r->head.store(head + 1, std::memory_order_release);
+}
+
+static void trace_thread_name(const char *name) {
+  TraceRing *r = trace_ring();
+  if (r && strcmp(r->name, name) != 0)
+    snprintf(r->name, sizeof(r->name), "%s", name);
+}
+
+struct TraceSpan {
+  const char *name;
+  int64_t begin_ns;
+  int64_t arg;
+
+  TraceSpan(const char *name, int64_t arg)
+      : name(name), begin_ns(monotonic_ns()), arg(arg) {}
+  ~TraceSpan() { trace_push(name, begin_ns, monotonic_ns(), arg); }
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name)                                                      \
+  TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name, -1)
+#define TRACE_SCOPE_ARG(name, arg)                                             \
+  TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name, int64_t(arg))
+#define TRACE_INSTANT(name) trace_push(name, monotonic_ns(), -1, -1)
+#define TRACE_THREAD(name) trace_thread_name(name)
+
+struct TraceSnapshotThread {
+  int tid;
+  char name[16];
+  std::vector<TraceEvent> events;
+};
+
+// Copies the events that ended after `since_ns`. Runs concurrently with
+// the writers: whatever they may have overwritten during the copy is
+// dropped.
+static std::vector<TraceSnapshotThread> trace_snapshot(int64_t since_ns) {
+  std::vector<TraceSnapshotThread> threads;
+  int count = trace_ring_count.load(std::memory_order_acquire);
+  for (int i = 0; i < count; i++) {
+    TraceRing *r = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE);
+    if (!r)
+      continue;
+    TraceSnapshotThread t;
+    t.tid = r->tid;
+    memcpy(t.name, r->name, sizeof(t.name));
+    t.name[sizeof(t.name) - 1] = '\0';
+
+    uint64_t end = r->head.load(std::memory_order_acquire);
+    uint64_t begin = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+    std::vector<TraceEvent> copy;
+    copy.reserve(end - begin);
+    for (uint64_t e = begin; e < end; e++)
+      copy.push_back(r->events[e % TRACE_RING_EVENTS]);
+    // Orders the copy before the second load of head.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t after = r->head.load(std::memory_order_relaxed);
+    // The slot of event `after` may be being rewritten, so the oldest event
+    // surely intact is the one after it.
+    uint64_t valid =
+        after >= TRACE_RING_EVENTS ? after - TRACE_RING_EVENTS + 1 : 0;
+
+    for (uint64_t e = std::max(begin, valid); e < end; e++) {
+      const TraceEvent &ev = copy[e - begin];
+      if ((ev.end_ns < 0 ? ev.begin_ns : ev.end_ns) >= since_ns)
+        t.events.push_back(ev);
+    }
+    threads.push_back(std::move(t));
+  }
+  return threads;
+}
+
+static bool
+write_chrome_trace(const char *path,
+                   const std::vector<TraceSnapshotThread> &threads) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    perror("fopen trace");
+    return false;
+  }
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  bool first = true;
+  for (const TraceSnapshotThread &t : threads) {
+    fprintf(f,
+            "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", t.tid, t.name);
+    first = false;
+    for (const TraceEvent &e : t.events) {
+      // Trace event timestamps are in microseconds.
+      fprintf(f, ",\n{\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", e.name,
+              t.tid, e.begin_ns / 1e3);
+      if (e.end_ns < 0)
+        fprintf(f, ",\"ph\":\"i\",\"s\":\"t\"");
+      else
+        fprintf(f, ",\"ph\":\"X\",\"dur\":%.3f", (e.end_ns - e.begin_ns) / 1e3);
+      if (e.arg >= 0)
+        fprintf(f, ",\"args\":{\"n\":%lld}", (long long)e.arg);
+      fprintf(f, "}");
+    }
+  }
+  fprintf(f, "\n]}\n");
+  bool ok = fclose(f) == 0;
+  if (!ok)
+    perror("write trace");
+  return ok;
+}
+
+// `trace_dump [seconds] [path]`. The rings are copied right away, the file
+// is written on a thread of its own so the dump doesn't show up as a hitch
+// itself.
+static void dump_trace_command(const char *args) {
+  char path[256] = TRACE_DEFAULT_PATH;
+  double seconds = TRACE_DEFAULT_SECONDS;
+  sscanf(args, "%lf %255s", &seconds, path);
+
+  auto threads = trace_snapshot(monotonic_ns() - int64_t(seconds * 1e9));
+  std::string out(path);
+  std::thread([threads = std::move(threads), out, seconds] {
+    size_t events = 0;
+    for (const TraceSnapshotThread &t : threads)
+      events += t.events.size();
+    if (write_chrome_trace(out.c_str(), threads)) {
+      printf("Wrote %zu trace events of the last %.1f s to %s\n", events,
+             seconds, out.c_str());
+    }
+  }).detach();
+}
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_ARG(name, arg)
+#define TRACE_INSTANT(name)
+#define TRACE_THREAD(name)
+
+static void dump_trace_command(const char *) {
+  fprintf(stderr, "Built without tracing, configure with -DENABLE_TRACE=ON\n");
+}
+
+#endif
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <GL/glx.h>
+#include <X11/Xlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <poll.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+#include "gpu_timer.hpp"
+#include "trace.hpp"
+
+// Texture uploads run on their own thread with a GLX context that shares
+// objects with the render context. Every texture that is updated that way
+// goes through a TextureMailbox, whose three slots rotate between the two
+// threads:
+//
+//   front - bound by the render thread
+//   ready - uploaded and fenced, waiting for the render thread to pick it up
+//   back  - being written by the upload thread
+//
+// The render thread only swaps `ready` into `front` once its fence has
+// signalled, so it never waits for a transfer. The other way round, a slot
+// leaving `front` gets a fence after the render thread's last draws with it,
+// which the upload context waits for on the GPU before writing it again.
+
+struct VtPool;
+
+struct UploadSlot {
+  GLuint tex;
+  // Upload finished, set by the upload thread.
+  GLsync fence;
+  // Draws from it finished, set by the render thread when it leaves `front`.
+  GLsync released;
+  int width, height;
+  // Tile table if `tex` is a virtual texture atlas, see virtual_texture.hpp.
+  VtPool *vt;
+};
+
+struct TextureMailbox {
+  std::mutex mutex;
+  UploadSlot slots[3];
+  int front = 0;
+  int ready = 1;
+  int back = 2;
+  bool has_ready = false;
+};
+
+// The slot to upload into. Never touched by the render thread.
+static UploadSlot &mailbox_back(TextureMailbox &m) { return m.slots[m.back]; }
+
+// Fences the back slot and hands it to the render thread. Upload thread only.
+static void mailbox_publish(TextureMailbox &m) {
+  UploadSlot &slot = m.slots[m.back];
+  slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  // Make sure the fence actually reaches the GPU, otherwise the render
+  // thread could poll it forever.
+  glFlush();
+
+  {
+    std::lock_guard<std::mutex> lock(m.mutex);
+    std::swap(m.ready, m.back);
+    m.has_ready = true;
+  }
+
+  // If the render thread never picked up the previous upload, its fence is
+  // still around in what is now our back slot.
+  UploadSlot &stale = m.slots[m.back];
+  if (stale.fence) {
+    glDeleteSync(stale.fence);
+    stale.fence = nullptr;
+  }
+  // Otherwise it is the render thread's old front, which the next upload
+  // must not overwrite while frames drawn with it are still in flight.
+  if (stale.released) {
+    glWaitSync(stale.released, 0, GL_TIMEOUT_IGNORED);
+    glDeleteSync(stale.released);
+    stale.released = nullptr;
+  }
+}
+
+// Returns the slot the render thread should draw with. Never blocks: if the
+// newest upload has not finished on the GPU yet the previous one is kept.
+// `updated` tells whether the returned slot differs from the last call.
+static const UploadSlot &mailbox_acquire(TextureMailbox &m, bool &updated) {
+  std::lock_guard<std::mutex> lock(m.mutex);
+  updated = false;
+  if (m.has_ready) {
+    GLenum status = glClientWaitSync(m.slots[m.ready].fence, 0, 0);
+    if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+      std::swap(m.front, m.ready);
+      m.has_ready = false;
+      updated = true;
+
+      UploadSlot &front = m.slots[m.front];
+      glDeleteSync(front.fence);
+      front.fence = nullptr;
+
+      // Follows the draws of the previous frames, flushed so the upload
+      // context's wait on it can finish.
+      UploadSlot &old = m.slots[m.ready];
+      old.released = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      glFlush();
+    }
+  }
+  return m.slots[m.front];
+}
+
+// Frees the textures and fences. Neither thread may use the mailbox anymore.
+static void mailbox_destroy(TextureMailbox &m) {
+  for (UploadSlot &slot : m.slots) {
+    if (slot.fence) {
+      glDeleteSync(slot.fence);
+      slot.fence = nullptr;
+    }
+    if (slot.released) {
+      glDeleteSync(slot.released);
+      slot.released = nullptr;
+    }
+    if (slot.tex) {
+      glDeleteTextures(1, &slot.tex);
+      slot.tex = 0;
+    }
+    slot.width = 0;
+    slot.height = 0;
+    slot.vt = nullptr;
+  }
+  m.has_ready = false;
+}
+
+struct UploadThread {
+  Display *dpy;
+  Window drawable;
+  GLXContext ctx;
+
+  // Fills the back slot of `mailbox`; runs on the upload thread with `ctx`
+  // current. Returns false if there was nothing new, in which case nothing is
+  // published and the render thread keeps its current texture.
+  bool (*produce)(UploadSlot &slot);
+  useconds_t interval_us;
+  // If set, becoming readable ends the sleep between two produce() calls
+  // early. produce() is expected to drain it.
+  int wait_fd = -1;
+  // Receives GPU timings of the upload pass, may be nullptr.
+  void (*on_timing)(const GpuFrameTiming &timing);
+  GpuTimer timer;
+
+  std::thread thread;
+  std::atomic<bool> running{false};
+
+  TextureMailbox mailbox;
+};
+
+static void upload_thread_sleep(UploadThread *ut,
+                                std::chrono::steady_clock::time_point start) {
+  auto duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+  if (ut->interval_us <= duration_us)
+    return;
+  useconds_t remaining_us = ut->interval_us - duration_us;
+  if (ut->wait_fd >= 0) {
+    pollfd p = {ut->wait_fd, POLLIN, 0};
+    timespec timeout = {remaining_us / 1000000,
+                        long(remaining_us % 1000000) * 1000};
+    ppoll(&p, 1, &timeout, nullptr);
+  } else {
+    usleep(remaining_us);
+  }
+}
+
+static void upload_thread_main(UploadThread *ut) {
+  if (!glXMakeCurrent(ut->dpy, ut->drawable, ut->ctx)) {
+    fprintf(stderr, "Failed to make upload context current\n");
+    ut->running = false;
+    return;
+  }
+  init_gpu_timer(ut->timer);
+  TRACE_THREAD("upload");
+
+  while (ut->running) {
+    auto start = std::chrono::steady_clock::now();
+
+    begin_gpu_frame(ut->timer);
+    gpu_pass_begin(ut->timer, GPU_PASS_UPLOAD);
+    bool produced = ut->produce(mailbox_back(ut->mailbox));
+    // Work published through other mailboxes, like mipmapping window panels,
+    // is still worth timing.
+    if (!produced && !gpu_pass_recorded(ut->timer, GPU_PASS_MIPS)) {
+      cancel_gpu_frame(ut->timer);
+      upload_thread_sleep(ut, start);
+      continue;
+    }
+    gpu_pass_end(ut->timer, GPU_PASS_UPLOAD);
+    if (produced) {
+      mailbox_publish(ut->mailbox);
+    }
+
+    auto duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    end_gpu_frame(ut->timer, duration_us);
+    if (ut->on_timing != nullptr) {
+      collect_gpu_timer(ut->timer, ut->on_timing);
+    }
+
+    upload_thread_sleep(ut, start);
+  }
+
+  destroy_gpu_timer(ut->timer);
+  glXMakeCurrent(ut->dpy, None, NULL);
+}
+
+static bool start_upload_thread(UploadThread &ut) {
+  ut.running = true;
+  ut.thread = std::thread(upload_thread_main, &ut);
+  return true;
+}
+
+static const UploadSlot &acquire_uploaded_slot(UploadThread &ut,
+                                               bool &updated) {
+  return mailbox_acquire(ut.mailbox, updated);
+}
+
+// Must be called from the render thread with the render context current.
+static void stop_upload_thread(UploadThread &ut) {
+  ut.running = false;
+  if (ut.thread.joinable()) {
+    ut.thread.join();
+  }
+  mailbox_destroy(ut.mailbox);
+}
@@ -0,0 +1,572 @@
+#pragma once
+
+#include <GL/gl.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+#include "damage.hpp"
+#include "gl_ext.hpp"
+#include "mat4.hpp"
+#include "pixel_format.hpp"
+#include "scene.hpp"
+#include "upload_thread.hpp"
+
+// Desktop texture split into tiles, of which only the ones on screen are
+// kept on the GPU.
+//
+// The desktop is cut into VT_TILE_SIZE tiles at every power-of-two level of
+// detail. Each mailbox slot owns a pool: one atlas texture of fixed size and
+// a table saying which tile sits in which atlas slot. The render thread
+// splits every panel into tiles at the level matching its size on screen,
+// draws the resident ones straight from the atlas (falling back to a coarser
+// resident level while a tile is missing) and hands the list of tiles it
+// wanted to the upload thread. The upload thread brings the back pool up to
+// date with that list, evicting the least recently wanted tiles when full.
+//
+// GPU memory is three atlases no matter how large the desktop is, and no
+// texture ever exceeds GL_MAX_TEXTURE_SIZE.
+//
+// Damage bumps a per-tile generation; every pool remembers the generation
+// of each tile it holds, so a pool coming around again re-uploads exactly
+// what changed since it was last published.
+//
+// With mipmaps, coarse tiles are cut from a box-filtered pyramid of the
+// desktop kept in memory, of which only the damaged parts are downsampled
+// again. The atlas has a level 1 holding every tile at half size, so GL
+// blends each tile towards the next coarser level (trilinear) instead of
+// jumping between levels, and can filter anisotropically on oblique panels.
+
+#define VT_TILE_SIZE 256
+// Copies of the neighbouring pixels around each tile, so filtering across a
+// tile edge matches one big texture. Two, so level 1 still has a whole one,
+// which anisotropic filtering needs at the tile edges. Keeps the slot size
+// even as well, so level 1 slots line up with level 0.
+#define VT_TILE_BORDER 2
+#define VT_SLOT_SIZE (VT_TILE_SIZE + 2 * VT_TILE_BORDER)
+#define VT_MAX_LEVELS 8
+// Side of each atlas, lowered to GL_MAX_TEXTURE_SIZE if needed.
+#define VT_POOL_SIZE 3072
+// Tiles newly made resident per upload, so turning around doesn't stall the
+// upload thread for long. Tiles already resident are always refreshed.
+#define VT_MAX_LOADS_PER_UPLOAD 48
+// Tiles this far outside the view (in units of half the viewport) are still
+// requested, so they're usually resident by the time they turn into view.
+#define VT_GUARD_BAND 1.5f
+
+struct VtLayout {
+  int width, height;
+  int levels;
+  int tiles_x[VT_MAX_LEVELS], tiles_y[VT_MAX_LEVELS];
+  // Index of each level's first tile.
+  int offset[VT_MAX_LEVELS];
+  int tile_count;
+};
+
+// One atlas and the tiles in it.
+struct VtPool {
+  VtLayout layout;
+  int side, slots_x, slot_count;
+  // The atlas has its half size level 1, see vt_upload_tile().
+  bool mipmapped;
+  // Per tile of the layout, the atlas slot it's in or -1.
+  std::vector<int> tile_slot;
+  // Per slot, the tile in it or -1.
+  std::vector<int> slot_tile;
+  // Per slot, the content generation of the tile it holds.
+  std::vector<uint64_t> slot_gen;
+  // Per slot, the upload that last wanted it.
+  std::vector<uint64_t> slot_used;
+};
+
+// One level of the desktop pyramid, 2^level desktop pixels per pixel.
+struct VtMipLevel {
+  int width, height, stride;
+  std::vector<uint8_t> pixels;
+};
+
+struct VirtualTexture {
+  // Set before the first vt_update().
+  bool mipmaps;
+  float anisotropy;
+
+  // Upload thread side.
+  VtPool pools[3];
+  int pool_count;
+  int pool_side;
+  VtLayout layout;
+  std::vector<uint64_t> tile_gen;
+  uint64_t gen;
+  uint64_t serial;
+  std::vector<int> wanted;
+  std::vector<uint8_t> scratch;
+  // Levels 1 and up, level 0 being the captured image itself.
+  VtMipLevel mips[VT_MAX_LEVELS];
+  // Needs a full rebuild, the desktop changed size.
+  bool mips_stale;
+
+  // Tiles the render thread wants, most important first, valid for a
+  // desktop of `requested_width` x `requested_height`.
+  std::mutex mutex;
+  std::vector<int> requested;
+  int requested_width, requested_height;
+};
+
+static bool vt_layout_equal(const VtLayout &a, const VtLayout &b) {
+  return a.width == b.width && a.height == b.height;
+}
+
+static VtLayout vt_make_layout(int width, int height) {
+  VtLayout l{};
+  l.width = width;
+  l.height = height;
+  // Down to the level where the whole desktop fits one tile.
+  l.levels = 1;
+  while (l.levels < VT_MAX_LEVELS &&
+         (VT_TILE_SIZE << (l.levels - 1)) < std::max(width, height)) {
+    l.levels++;
+  }
+  for (int level = 0; level < l.levels; level++) {
+    int size = VT_TILE_SIZE << level;
+    l.tiles_x[level] = (width + size - 1) / size;
+    l.tiles_y[level] = (height + size - 1) / size;
+    l.offset[level] = l.tile_count;
+    l.tile_count += l.tiles_x[level] * l.tiles_y[level];
+  }
+  return l;
+}
+
+static int vt_tile_index(const VtLayout &l, int level, int tx, int ty) {
+  return l.offset[level] + ty * l.tiles_x[level] + tx;
+}
+
+static void vt_tile_coords(const VtLayout &l, int index, int &level, int &tx,
+                           int &ty) {
+  level = l.levels - 1;
+  while (level > 0 && index < l.offset[level])
+    level--;
+  index -= l.offset[level];
+  tx = index % l.tiles_x[level];
+  ty = index / l.tiles_x[level];
+}
+
+// Render thread side.
+
+// All four corners beyond the same side of the (widened) view volume.
+static bool vt_outside(const float c[4][4]) {
+  const float g = VT_GUARD_BAND;
+  bool right = true, left = true, top = true, bottom = true;
+  bool near = true, far = true;
+  for (int i = 0; i < 4; i++) {
+    float x = c[i][0], y = c[i][1], z = c[i][2], w = c[i][3];
+    right = right && x > g * w;
+    left = left && x < -g * w;
+    top = top && y > g * w;
+    bottom = bottom && y < -g * w;
+    near = near && z < -w;
+    far = far && z > w;
+  }
+  return right || left || top || bottom || near || far;
+}
+
+// Level of detail for a quad showing `desk_w` x `desk_h` desktop pixels,
+// rounded like GL picks the nearest mipmap. With `trilinear` it is rounded
+// down instead, the atlas' level 1 covers the way to the next one.
+static int vt_quad_level(const float clip[4][4], float desk_w, float desk_h,
+                         float viewport_w, float viewport_h, int levels,
+                         bool trilinear) {
+  float px[4][2];
+  for (int c = 0; c < 4; c++) {
+    // Reaches behind the eye, its size on screen is meaningless.
+    if (clip[c][3] <= 1e-4f)
+      return 0;
+    px[c][0] = clip[c][0] / clip[c][3] * 0.5f * viewport_w;
+    px[c][1] = clip[c][1] / clip[c][3] * 0.5f * viewport_h;
+  }
+  auto edge = [&](int a, int b) {
+    return hypotf(px[b][0] - px[a][0], px[b][1] - px[a][1]);
+  };
+  // The nearer edge decides, it needs the most detail.
+  float screen_w = std::max(edge(0, 1), edge(3, 2));
+  float screen_h = std::max(edge(0, 3), edge(1, 2));
+  if (screen_w < 1.0f || screen_h < 1.0f)
+    return levels - 1;
+  float ratio = std::max(desk_w / screen_w, desk_h / screen_h);
+  if (ratio <= 1.0f)
+    return 0;
+  float lod = log2f(ratio);
+  return std::min(int(trilinear ? floorf(lod) : lroundf(lod)), levels - 1);
+}
+
+static void vt_lerp_corners(const float in[4][4], int n, float s0, float t0,
+                            float s1, float t1, float out[4][4]) {
+  const float st[4][2] = {{s0, t0}, {s1, t0}, {s1, t1}, {s0, t1}};
+  for (int c = 0; c < 4; c++) {
+    float s = st[c][0], t = st[c][1];
+    for (int k = 0; k < n; k++) {
+      float top = in[0][k] + (in[1][k] - in[0][k]) * s;
+      float bottom = in[3][k] + (in[2][k] - in[3][k]) * s;
+      out[c][k] = top + (bottom - top) * t;
+    }
+  }
+}
+
+// Draws the desktop rectangle [x0, x1) x [y0, y1), inside tile (tx, ty) of
+// `level`, from atlas slot `slot`.
+static void vt_emit(const VtPool &p, int slot, int level, int tx, int ty,
+                    float x0, float y0, float x1, float y1,
+                    const float corners[4][4]) {
+  float scale = 1.0f / float(1 << level);
+  float ox = (slot % p.slots_x) * VT_SLOT_SIZE + VT_TILE_BORDER -
+             tx * VT_TILE_SIZE;
+  float oy = (slot / p.slots_x) * VT_SLOT_SIZE + VT_TILE_BORDER -
+             ty * VT_TILE_SIZE;
+  float u0 = (ox + x0 * scale) / p.side, u1 = (ox + x1 * scale) / p.side;
+  float v0 = (oy + y0 * scale) / p.side, v1 = (oy + y1 * scale) / p.side;
+  glTexCoord2f(u0, v0);
+  glVertex3fv(corners[0]);
+  glTexCoord2f(u1, v0);
+  glVertex3fv(corners[1]);
+  glTexCoord2f(u1, v1);
+  glVertex3fv(corners[2]);
+  glTexCoord2f(u0, v1);
+  glVertex3fv(corners[3]);
+}
+
+// Draws `q` from `p`, inside glBegin(GL_QUADS), and appends the tiles it
+// needs to `requests`.
+static void vt_draw_quad(const VtPool &p, const TexturedQuad &q,
+                         const Mat4 &mvp, float viewport_w, float viewport_h,
+                         std::vector<int> &requests) {
+  const VtLayout &l = p.layout;
+  float world[4][4], clip[4][4];
+  for (int c = 0; c < 4; c++) {
+    for (int k = 0; k < 3; k++)
+      world[c][k] = q.corners[c][k];
+    world[c][3] = 1.0f;
+    mat4_transform(mvp, q.corners[c], clip[c]);
+  }
+  if (vt_outside(clip))
+    return;
+
+  float dx0 = q.u0 * l.width, dx1 = q.u1 * l.width;
+  float dy0 = q.v0 * l.height, dy1 = q.v1 * l.height;
+  if (dx1 <= dx0 || dy1 <= dy0)
+    return;
+  int level = vt_quad_level(clip, dx1 - dx0, dy1 - dy0, viewport_w,
+                            viewport_h, l.levels, p.mipmapped);
+  int size = VT_TILE_SIZE << level;
+  int tx0 = std::max(int(dx0) / size, 0);
+  int tx1 = std::min(int(ceilf(dx1)) / size, l.tiles_x[level] - 1);
+  int ty0 = std::max(int(dy0) / size, 0);
+  int ty1 = std::min(int(ceilf(dy1)) / size, l.tiles_y[level] - 1);
+
+  for (int ty = ty0; ty <= ty1; ty++) {
+    for (int tx = tx0; tx <= tx1; tx++) {
+      float x0 = std::max(dx0, float(tx * size));
+      float x1 = std::min(dx1, float((tx + 1) * size));
+      float y0 = std::max(dy0, float(ty * size));
+      float y1 = std::min(dy1, float((ty + 1) * size));
+      if (x1 <= x0 || y1 <= y0)
+        continue;
+      float s0 = (x0 - dx0) / (dx1 - dx0), s1 = (x1 - dx0) / (dx1 - dx0);
+      float t0 = (y0 - dy0) / (dy1 - dy0), t1 = (y1 - dy0) / (dy1 - dy0);
+
+      // Panels are flat, so clip coordinates interpolate like positions.
+      float tile_clip[4][4], tile_world[4][4];
+      vt_lerp_corners(clip, 4, s0, t0, s1, t1, tile_clip);
+      if (vt_outside(tile_clip))
+        continue;
+      vt_lerp_corners(world, 3, s0, t0, s1, t1, tile_world);
+      requests.push_back(vt_tile_index(l, level, tx, ty));
+
+      // Coarser levels stand in until the tile arrives.
+      for (int lv = level, ax = tx, ay = ty; lv < l.levels;
+           lv++, ax >>= 1, ay >>= 1) {
+        int slot = p.tile_slot[vt_tile_index(l, lv, ax, ay)];
+        if (slot >= 0) {
+          vt_emit(p, slot, lv, ax, ay, x0, y0, x1, y1, tile_world);
+          break;
+        }
+      }
+    }
+  }
+}
+
+// Hands the tiles drawn with `p` this frame to the upload thread.
+static void vt_request_tiles(VirtualTexture &vt, const VtPool &p,
+                             const std::vector<int> &requests) {
+  std::lock_guard<std::mutex> lock(vt.mutex);
+  vt.requested.assign(requests.begin(), requests.end());
+  vt.requested_width = p.layout.width;
+  vt.requested_height = p.layout.height;
+}
+
+// Upload thread side.
+
+static void vt_reset_pool(VtPool &p, const VtLayout &layout) {
+  p.layout = layout;
+  p.tile_slot.assign(layout.tile_count, -1);
+  p.slot_tile.assign(p.slot_count, -1);
+  p.slot_gen.assign(p.slot_count, 0);
+  p.slot_used.assign(p.slot_count, 0);
+}
+
+// Starts over for a desktop of a new size.
+static void vt_set_size(VirtualTexture &vt, int width, int height) {
+  if (vt.layout.width == width && vt.layout.height == height)
+    return;
+  vt.layout = vt_make_layout(width, height);
+  vt.tile_gen.assign(vt.layout.tile_count, ++vt.gen);
+  vt.mips_stale = true;
+  printf("Virtual texture: %dx%d desktop, %d levels, %d tiles\n", width,
+         height, vt.layout.levels, vt.layout.tile_count);
+}
+
+// Marks every tile whose pixels `dirty` touches as changed.
+static void vt_invalidate(VirtualTexture &vt, const DirtyRegion &dirty) {
+  const VtLayout &l = vt.layout;
+  uint64_t gen = ++vt.gen;
+  for (int i = 0; i < dirty.count; i++) {
+    const DirtyRect &r = dirty.rects[i];
+    for (int level = 0; level < l.levels; level++) {
+      // Border pixels reach one level pixel into the neighbours.
+      int step = 1 << level, size = VT_TILE_SIZE << level;
+      int x0 = std::max((r.x - step * VT_TILE_BORDER) / size, 0);
+      int y0 = std::max((r.y - step * VT_TILE_BORDER) / size, 0);
+      int x1 = std::min((r.x + r.width + step * VT_TILE_BORDER) / size,
+                        l.tiles_x[level] - 1);
+      int y1 = std::min((r.y + r.height + step * VT_TILE_BORDER) / size,
+                        l.tiles_y[level] - 1);
+      for (int ty = y0; ty <= y1; ty++) {
+        for (int tx = x0; tx <= x1; tx++)
+          vt.tile_gen[vt_tile_index(l, level, tx, ty)] = gen;
+      }
+    }
+  }
+}
+
+// Brings the pyramid up to date with `img`, the desktop as of the last
+// vt_invalidate() with `dirty`. Each level is downsampled from the one above
+// where that one changed. Upload thread.
+static void vt_update_mips(VirtualTexture &vt, const XImage *img,
+                           const PixelFormat *format,
+                           const DirtyRegion &dirty) {
+  if (!vt.mipmaps)
+    return;
+  const VtLayout &l = vt.layout;
+  int bpp = format->bytes_per_pixel;
+  DirtyRegion region = dirty;
+  if (vt.mips_stale) {
+    for (int level = 1; level < l.levels; level++) {
+      VtMipLevel &m = vt.mips[level];
+      m.width = (l.width + (1 << level) - 1) >> level;
+      m.height = (l.height + (1 << level) - 1) >> level;
+      m.stride = m.width * bpp;
+      m.pixels.assign(size_t(m.stride) * m.height, 0);
+    }
+    region.count = 0;
+    dirty_region_add(region, {0, 0, l.width, l.height});
+    vt.mips_stale = false;
+  }
+
+  const uint8_t *src = (const uint8_t *)img->data;
+  int src_stride = img->bytes_per_line, src_w = l.width, src_h = l.height;
+  for (int level = 1; level < l.levels && region.count > 0; level++) {
+    VtMipLevel &m = vt.mips[level];
+    int count = 0;
+    for (int i = 0; i < region.count; i++) {
+      // Every pixel whose 2x2 source block the rectangle touches.
+      const DirtyRect &r = region.rects[i];
+      int x0 = std::max(r.x, 0) >> 1, y0 = std::max(r.y, 0) >> 1;
+      int x1 = std::min((r.x + r.width + 1) >> 1, m.width);
+      int y1 = std::min((r.y + r.height + 1) >> 1, m.height);
+      if (x1 <= x0 || y1 <= y0)
+        continue;
+      format->resample(src, src_stride, src_w, src_h, x0, y0, 2,
+                       m.pixels.data() + size_t(y0) * m.stride + x0 * bpp,
+                       m.stride, x1 - x0, y1 - y0);
+      region.rects[count++] = {x0, y0, x1 - x0, y1 - y0};
+    }
+    region.count = count;
+    src = m.pixels.data();
+    src_stride = m.stride;
+    src_w = m.width;
+    src_h = m.height;
+  }
+}
+
+static bool vt_init_pool(VirtualTexture &vt, UploadSlot &slot,
+                         const PixelFormat *format) {
+  if (vt.pool_count == 3)
+    return false;
+  if (vt.pool_side == 0) {
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    vt.pool_side = std::min(VT_POOL_SIZE, int(max_size));
+    int slots = (vt.pool_side / VT_SLOT_SIZE) * (vt.pool_side / VT_SLOT_SIZE);
+    printf("Virtual texture pools: 3 x %dx%d, %d tiles of %d each\n",
+           vt.pool_side, vt.pool_side, slots, VT_TILE_SIZE);
+  }
+
+  VtPool &p = vt.pools[vt.pool_count++];
+  p.side = vt.pool_side;
+  p.slots_x = p.side / VT_SLOT_SIZE;
+  p.slot_count = p.slots_x * p.slots_x;
+  p.mipmapped = vt.mipmaps;
+  vt_reset_pool(p, vt.layout);
+
+  glGenTextures(1, &slot.tex);
+  glBindTexture(GL_TEXTURE_2D, slot.tex);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                  p.mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, format->gl_internal, p.side, p.side, 0,
+               format->gl_format, format->gl_type, nullptr);
+  if (p.mipmapped) {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1);
+    glTexImage2D(GL_TEXTURE_2D, 1, format->gl_internal, p.side / 2,
+                 p.side / 2, 0, format->gl_format, format->gl_type, nullptr);
+  }
+  gl_set_anisotropy(vt.anisotropy);
+  slot.vt = &p;
+  return true;
+}
+
+// A free slot, or the one least recently wanted. -1 if every slot is wanted
+// by this upload.
+static int vt_alloc_slot(VtPool &p, uint64_t serial) {
+  int best = -1;
+  for (int s = 0; s < p.slot_count; s++) {
+    if (p.slot_tile[s] < 0)
+      return s;
+    if (p.slot_used[s] < serial &&
+        (best < 0 || p.slot_used[s] < p.slot_used[best])) {
+      best = s;
+    }
+  }
+  if (best >= 0)
+    p.tile_slot[p.slot_tile[best]] = -1;
+  return best;
+}
+
+// Half a slot, the tile in the atlas' level 1.
+#define VT_HALF_SLOT_SIZE (VT_SLOT_SIZE / 2)
+
+// Rows of the half size tile, padded to GL's default unpack alignment.
+static int vt_half_slot_stride(const PixelFormat *format) {
+  return (VT_HALF_SLOT_SIZE * format->bytes_per_pixel + 3) & ~3;
+}
+
+static void vt_upload_tile(VirtualTexture &vt, VtPool &p, int slot, int tile,
+                           const XImage *img, const PixelFormat *format) {
+  int level, tx, ty;
+  vt_tile_coords(p.layout, tile, level, tx, ty);
+  int stride = VT_SLOT_SIZE * format->bytes_per_pixel;
+  const uint8_t *src = (const uint8_t *)img->data;
+  int src_stride = img->bytes_per_line;
+  int src_w = p.layout.width, src_h = p.layout.height, step = 1 << level;
+  if (p.mipmapped && level > 0) {
+    const VtMipLevel &m = vt.mips[level];
+    src = m.pixels.data();
+    src_stride = m.stride;
+    src_w = m.width;
+    src_h = m.height;
+    step = 1;
+  }
+  format->resample(src, src_stride, src_w, src_h,
+                   tx * VT_TILE_SIZE - VT_TILE_BORDER,
+                   ty * VT_TILE_SIZE - VT_TILE_BORDER, step,
+                   vt.scratch.data(), stride, VT_SLOT_SIZE, VT_SLOT_SIZE);
+  int x = slot % p.slots_x, y = slot / p.slots_x;
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x * VT_SLOT_SIZE, y * VT_SLOT_SIZE,
+                  VT_SLOT_SIZE, VT_SLOT_SIZE, format->gl_format,
+                  format->gl_type, vt.scratch.data());
+  if (!p.mipmapped)
+    return;
+
+  // Level 1 halves the slot including its border, which then is one pixel
+  // wide.
+  uint8_t *half = vt.scratch.data() + size_t(stride) * VT_SLOT_SIZE;
+  format->resample(vt.scratch.data(), stride, VT_SLOT_SIZE, VT_SLOT_SIZE, 0,
+                   0, 2, half, vt_half_slot_stride(format), VT_HALF_SLOT_SIZE,
+                   VT_HALF_SLOT_SIZE);
+  glTexSubImage2D(GL_TEXTURE_2D, 1, x * VT_HALF_SLOT_SIZE,
+                  y * VT_HALF_SLOT_SIZE, VT_HALF_SLOT_SIZE, VT_HALF_SLOT_SIZE,
+                  format->gl_format, format->gl_type, half);
+}
+
+// Brings the pool of `slot` up to date with the wanted tiles of `img`, the
+// desktop as of the last vt_invalidate(). Returns false if nothing about
+// the pool changed, in which case there is no need to publish it.
+static bool vt_update(VirtualTexture &vt, UploadSlot &slot, const XImage *img,
+                      const PixelFormat *format) {
+  bool changed = false;
+  if (slot.vt == nullptr) {
+    if (!vt_init_pool(vt, slot, format))
+      return false;
+    changed = true;
+  }
+  VtPool &p = *slot.vt;
+  if (!vt_layout_equal(p.layout, vt.layout)) {
+    vt_reset_pool(p, vt.layout);
+    changed = true;
+  }
+  slot.width = vt.layout.width;
+  slot.height = vt.layout.height;
+
+  {
+    std::lock_guard<std::mutex> lock(vt.mutex);
+    vt.wanted.clear();
+    if (vt.requested_width == vt.layout.width &&
+        vt.requested_height == vt.layout.height) {
+      vt.wanted.assign(vt.requested.begin(), vt.requested.end());
+    }
+  }
+
+  vt.scratch.resize(size_t(VT_SLOT_SIZE) * VT_SLOT_SIZE *
+                        format->bytes_per_pixel +
+                    size_t(VT_HALF_SLOT_SIZE) * vt_half_slot_stride(format));
+  glBindTexture(GL_TEXTURE_2D, slot.tex);
+  uint64_t serial = ++vt.serial;
+  int loads = 0;
+  for (int tile : vt.wanted) {
+    int s = p.tile_slot[tile];
+    if (s >= 0) {
+      p.slot_used[s] = serial;
+      if (p.slot_gen[s] == vt.tile_gen[tile])
+        continue;
+    } else {
+      if (loads == VT_MAX_LOADS_PER_UPLOAD)
+        continue;
+      s = vt_alloc_slot(p, serial);
+      if (s < 0)
+        continue;
+      p.slot_tile[s] = tile;
+      p.tile_slot[tile] = s;
+      p.slot_used[s] = serial;
+      loads++;
+    }
+    vt_upload_tile(vt, p, s, tile, img, format);
+    p.slot_gen[s] = vt.tile_gen[tile];
+    changed = true;
+  }
+
+  // Whatever is stale now wasn't wanted; drop it rather than show old
+  // pixels as a fallback.
+  for (int s = 0; s < p.slot_count; s++) {
+    int tile = p.slot_tile[s];
+    if (tile >= 0 && p.slot_gen[s] != vt.tile_gen[tile]) {
+      p.tile_slot[tile] = -1;
+      p.slot_tile[s] = -1;
+      changed = true;
+    }
+  }
+  return changed;
+}
@@ -0,0 +1,474 @@
+#pragma once
+
+#include <GL/gl.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xcomposite.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <atomic>
+#include <climits>
+#include <cstdio>
+#include <mutex>
+
+#include "gl_ext.hpp"
+#include "gpu_timer.hpp"
+#include "pixel_format.hpp"
+#include "upload_thread.hpp"
+
+// Application windows as individual panels.
+//
+// Top-level windows are redirected with the Composite extension so each one
+// keeps its own backing pixmap, which is read back with XShmGetImage into a
+// single shared scratch segment and uploaded into the window's own
+// TextureMailbox. Only windows the render thread reported visible during the
+// last frames are captured, so capture cost follows what is on screen rather
+// than the size of the desktop.
+//
+// With mipmaps each panel's texture gets its mip chain regenerated right
+// after it was captured, so only windows that changed pay for it, and is
+// sampled trilinearly and anisotropically.
+//
+// Panels live in a fixed array. The upload thread owns the X side of each
+// slot and moves it FREE -> LIVE -> DEAD; the render thread frees the
+// textures of DEAD slots (it may still be drawing them) and hands them back
+// as FREE.
+
+#define WINDOW_PANELS_MAX 512
+// Smaller windows (tooltips, dock applets, ...) are not worth a panel.
+#define WINDOW_PANEL_MIN_SIZE 64
+// A window counts as visible for this many frames after the render thread
+// last saw it.
+#define WINDOW_PANEL_VISIBLE_FRAMES 2
+
+enum WindowPanelState {
+  WINDOW_PANEL_FREE,
+  WINDOW_PANEL_LIVE,
+  WINDOW_PANEL_DEAD,
+};
+
+struct WindowPanel {
+  std::atomic<int> state{WINDOW_PANEL_FREE};
+
+  // Upload thread only.
+  Pixmap pixmap;
+  XImage *img;
+  Visual *visual;
+  int depth;
+  const PixelFormat *format;
+  bool seen;
+  // The published texture matches the window and it stayed visible since.
+  bool current;
+  // Captured into the back slot this round, to be published.
+  bool captured;
+
+  // Guarded by WindowSet::mutex, written by the upload thread.
+  Window window;
+  int x, y, width, height;
+  // Position in the stacking order, 0 is the bottom.
+  int stacking;
+
+  // Render frame in which the panel was last inside the view.
+  std::atomic<uint64_t> visible_frame{0};
+
+  TextureMailbox mailbox;
+};
+
+struct WindowSet {
+  Display *dpy;
+  Window root;
+  // Our own output window, never shown as a panel.
+  Window exclude;
+  bool available;
+  // Set before the upload thread starts.
+  bool mipmaps;
+  float anisotropy;
+
+  // Set by X events, tells the upload thread to re-list the windows.
+  std::atomic<bool> dirty{true};
+  // Bumped whenever windows appear, vanish or change size or stacking, so the
+  // render thread knows to redo the layout.
+  std::atomic<uint64_t> generation{0};
+  // Frames rendered so far, compared against WindowPanel::visible_frame.
+  std::atomic<uint64_t> render_frame{0};
+
+  std::mutex mutex;
+  WindowPanel panels[WINDOW_PANELS_MAX];
+
+  // Scratch segment every window is read back into, grown on demand.
+  XShmSegmentInfo shm;
+  size_t shm_size;
+};
+
+// X errors from windows vanishing between listing and capturing are expected
+// and ignored. The render thread shares the display and may be the one that
+// reads such an error off the wire, so the requests to ignore are told by
+// their serial rather than by the thread: errors of requests in
+// [window_capture_ignore_first, window_capture_ignore_last] are dropped,
+// anything else goes to the previous handler. Requests of other threads
+// issued in between fall into the range too; none of them are expected to
+// fail.
+static std::atomic<unsigned long> window_capture_ignore_first{1};
+static std::atomic<unsigned long> window_capture_ignore_last{0};
+static XErrorHandler window_capture_previous_handler = nullptr;
+
+static int window_capture_error_handler(Display *dpy, XErrorEvent *ev) {
+  if (ev->serial >= window_capture_ignore_first &&
+      ev->serial <= window_capture_ignore_last) {
+    return 0;
+  }
+  return window_capture_previous_handler ? window_capture_previous_handler(dpy,
+                                                                           ev)
+                                         : 0;
+}
+
+// Errors of the requests made from here until window_capture_end_ignore() are
+// ignored. Upload thread only.
+static void window_capture_begin_ignore(Display *dpy) {
+  XLockDisplay(dpy);
+  // In this order the range never covers earlier requests.
+  window_capture_ignore_first = NextRequest(dpy);
+  window_capture_ignore_last = ULONG_MAX;
+  XUnlockDisplay(dpy);
+}
+
+// Waits for the errors of the ignored requests, so none are left to reach
+// the previous handler, and closes the range.
+static void window_capture_end_ignore(Display *dpy) {
+  XSync(dpy, False);
+  XLockDisplay(dpy);
+  window_capture_ignore_last = NextRequest(dpy) - 1;
+  XUnlockDisplay(dpy);
+}
+
+static bool init_window_set(WindowSet &ws, Display *dpy, Window root,
+                            Window exclude) {
+  ws.dpy = dpy;
+  ws.root = root;
+  ws.exclude = exclude;
+
+  int event_base, error_base, major = 0, minor = 2;
+  if (!XCompositeQueryExtension(dpy, &event_base, &error_base) ||
+      !XCompositeQueryVersion(dpy, &major, &minor) ||
+      (major == 0 && minor < 2)) {
+    fprintf(stderr, "Composite >= 0.2 missing, window panels disabled\n");
+    ws.available = false;
+    return false;
+  }
+
+  window_capture_previous_handler =
+      XSetErrorHandler(window_capture_error_handler);
+
+  // Automatic redirection: the server still draws the desktop as usual, we
+  // just get to read every window's pixmap.
+  XCompositeRedirectSubwindows(dpy, root, CompositeRedirectAutomatic);
+  XSelectInput(dpy, root, SubstructureNotifyMask);
+  ws.available = true;
+  return true;
+}
+
+// Returns true if the event belonged to window tracking.
+static bool handle_window_set_event(WindowSet &ws, const XEvent &ev) {
+  if (!ws.available)
+    return false;
+  switch (ev.type) {
+  case CreateNotify:
+  case DestroyNotify:
+  case MapNotify:
+  case UnmapNotify:
+  case ConfigureNotify:
+  case ReparentNotify:
+  case CirculateNotify:
+    ws.dirty = true;
+    return true;
+  }
+  return false;
+}
+
+static void release_window_capture(WindowSet &ws, WindowPanel &p) {
+  p.current = false;
+  if (p.img) {
+    XDestroyImage(p.img);
+    p.img = nullptr;
+  }
+  if (p.pixmap) {
+    XFreePixmap(ws.dpy, p.pixmap);
+    p.pixmap = 0;
+  }
+}
+
+static WindowPanel *find_live_panel(WindowSet &ws, Window w) {
+  for (WindowPanel &p : ws.panels) {
+    if (p.state == WINDOW_PANEL_LIVE && p.window == w)
+      return &p;
+  }
+  return nullptr;
+}
+
+static WindowPanel *alloc_panel(WindowSet &ws) {
+  for (WindowPanel &p : ws.panels) {
+    if (p.state == WINDOW_PANEL_FREE)
+      return &p;
+  }
+  return nullptr;
+}
+
+// Re-lists the top-level windows after X reported changes. Upload thread.
+static void refresh_window_set(WindowSet &ws) {
+  if (!ws.available || !ws.dirty.exchange(false))
+    return;
+
+  Window root_ret, parent_ret;
+  Window *children = nullptr;
+  unsigned int n = 0;
+  if (!XQueryTree(ws.dpy, ws.root, &root_ret, &parent_ret, &children, &n))
+    return;
+
+  for (WindowPanel &p : ws.panels) {
+    p.seen = false;
+  }
+
+  bool changed = false;
+  window_capture_begin_ignore(ws.dpy);
+  for (unsigned int i = 0; i < n; i++) {
+    XWindowAttributes attrs;
+    if (children[i] == ws.exclude ||
+        !XGetWindowAttributes(ws.dpy, children[i], &attrs) ||
+        attrs.c_class != InputOutput || attrs.map_state != IsViewable ||
+        attrs.width < WINDOW_PANEL_MIN_SIZE ||
+        attrs.height < WINDOW_PANEL_MIN_SIZE) {
+      continue;
+    }
+
+    WindowPanel *p = find_live_panel(ws, children[i]);
+    if (p == nullptr) {
+      const PixelFormat *format =
+          find_pixel_format(ws.dpy, attrs.visual, attrs.depth);
+      if (format == nullptr)
+        continue;
+      p = alloc_panel(ws);
+      if (p == nullptr)
+        continue;
+      p->visual = attrs.visual;
+      p->depth = attrs.depth;
+      p->format = format;
+      {
+        std::lock_guard<std::mutex> lock(ws.mutex);
+        p->window = children[i];
+        p->width = 0;
+        p->height = 0;
+      }
+      p->visible_frame = 0;
+      p->state = WINDOW_PANEL_LIVE;
+      changed = true;
+    }
+    p->seen = true;
+
+    std::lock_guard<std::mutex> lock(ws.mutex);
+    if (p->width != attrs.width || p->height != attrs.height) {
+      // The old pixmap keeps the old size, name a new one on next capture.
+      release_window_capture(ws, *p);
+      changed = true;
+    }
+    if (p->stacking != int(i))
+      changed = true;
+    p->x = attrs.x;
+    p->y = attrs.y;
+    p->width = attrs.width;
+    p->height = attrs.height;
+    p->stacking = int(i);
+  }
+
+  // Freeing the pixmap of a window that is gone fails as well.
+  for (WindowPanel &p : ws.panels) {
+    if (p.state == WINDOW_PANEL_LIVE && !p.seen) {
+      release_window_capture(ws, p);
+      p.state = WINDOW_PANEL_DEAD;
+      changed = true;
+    }
+  }
+  window_capture_end_ignore(ws.dpy);
+
+  if (children)
+    XFree(children);
+  if (changed)
+    ws.generation++;
+}
+
+static bool ensure_window_shm(WindowSet &ws, size_t size) {
+  if (ws.shm_size >= size)
+    return true;
+
+  if (ws.shm_size > 0) {
+    // Every image points into the old segment.
+    for (WindowPanel &p : ws.panels) {
+      if (p.img) {
+        XDestroyImage(p.img);
+        p.img = nullptr;
+      }
+    }
+    XShmDetach(ws.dpy, &ws.shm);
+    XSync(ws.dpy, False);
+    shmdt(ws.shm.shmaddr);
+    ws.shm_size = 0;
+  }
+
+  ws.shm.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+  if (ws.shm.shmid < 0) {
+    perror("shmget window capture");
+    return false;
+  }
+  ws.shm.shmaddr = (char *)shmat(ws.shm.shmid, 0, 0);
+  // Freed once everyone detached, or right away if attaching failed.
+  shmctl(ws.shm.shmid, IPC_RMID, 0);
+  if (ws.shm.shmaddr == (char *)-1) {
+    perror("shmat window capture");
+    return false;
+  }
+  ws.shm.readOnly = False;
+  if (!XShmAttach(ws.dpy, &ws.shm)) {
+    fprintf(stderr, "XShmAttach failed for window capture\n");
+    shmdt(ws.shm.shmaddr);
+    return false;
+  }
+  ws.shm_size = size;
+  return true;
+}
+
+static bool capture_window_panel(WindowSet &ws, WindowPanel &p) {
+  int width, height;
+  Window window;
+  {
+    std::lock_guard<std::mutex> lock(ws.mutex);
+    width = p.width;
+    height = p.height;
+    window = p.window;
+  }
+
+  if (!p.pixmap) {
+    p.pixmap = XCompositeNameWindowPixmap(ws.dpy, window);
+  }
+  if (!p.img) {
+    XImage *img = XShmCreateImage(ws.dpy, p.visual, p.depth, ZPixmap, NULL,
+                                  &ws.shm, width, height);
+    if (!img)
+      return false;
+    // Growing the segment destroys the images of the other panels, this one
+    // only becomes the panel's once it has a place in the new one.
+    if (!ensure_window_shm(ws, size_t(img->bytes_per_line) * height)) {
+      XDestroyImage(img);
+      return false;
+    }
+    img->data = ws.shm.shmaddr;
+    p.img = img;
+  }
+
+  if (!XShmGetImage(ws.dpy, p.pixmap, p.img, 0, 0, AllPlanes))
+    return false;
+
+  UploadSlot &slot = mailbox_back(p.mailbox);
+  if (slot.tex == 0) {
+    glGenTextures(1, &slot.tex);
+  }
+  glBindTexture(GL_TEXTURE_2D, slot.tex);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH,
+                p.img->bytes_per_line / p.format->bytes_per_pixel);
+  if (slot.width != width || slot.height != height) {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                    ws.mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    gl_set_anisotropy(ws.anisotropy);
+    glTexImage2D(GL_TEXTURE_2D, 0, p.format->gl_internal, width, height, 0,
+                 p.format->gl_format, p.format->gl_type, p.img->data);
+    slot.width = width;
+    slot.height = height;
+  } else {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, p.format->gl_format,
+                    p.format->gl_type, p.img->data);
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  return true;
+}
+
+// Captures the live panels the render thread saw recently: all of them if
+// the desktop was damaged, otherwise only those that just came into view.
+// Upload thread, with the upload context current; mipmapping is timed with
+// `timer`. Returns true if anything was published.
+static bool capture_window_panels(WindowSet &ws, bool damaged,
+                                  GpuTimer &timer) {
+  if (!ws.available)
+    return false;
+
+  bool published = false;
+  uint64_t frame = ws.render_frame;
+  window_capture_begin_ignore(ws.dpy);
+  for (WindowPanel &p : ws.panels) {
+    if (p.state != WINDOW_PANEL_LIVE)
+      continue;
+    if (p.visible_frame + WINDOW_PANEL_VISIBLE_FRAMES < frame) {
+      // Out of view windows are not kept up to date.
+      p.current = false;
+      continue;
+    }
+    if (p.current && !damaged)
+      continue;
+    if (capture_window_panel(ws, p)) {
+      p.current = true;
+      p.captured = true;
+      published = true;
+    } else {
+      // Most likely the window went away, refresh the list.
+      release_window_capture(ws, p);
+      ws.dirty = true;
+    }
+  }
+  window_capture_end_ignore(ws.dpy);
+
+  if (published && ws.mipmaps) {
+    gpu_pass_begin(timer, GPU_PASS_MIPS);
+    for (WindowPanel &p : ws.panels) {
+      if (p.captured) {
+        glBindTexture(GL_TEXTURE_2D, mailbox_back(p.mailbox).tex);
+        glGenerateMipmap(GL_TEXTURE_2D);
+      }
+    }
+    gpu_pass_end(timer, GPU_PASS_MIPS);
+  }
+  for (WindowPanel &p : ws.panels) {
+    if (p.captured) {
+      mailbox_publish(p.mailbox);
+      p.captured = false;
+    }
+  }
+  return published;
+}
+
+// Frees textures of panels the upload thread dropped. Render thread.
+static void reap_window_panels(WindowSet &ws) {
+  for (WindowPanel &p : ws.panels) {
+    if (p.state == WINDOW_PANEL_DEAD) {
+      mailbox_destroy(p.mailbox);
+      p.state = WINDOW_PANEL_FREE;
+    }
+  }
+}
+
+// Upload thread must be stopped.
+static void destroy_window_set(WindowSet &ws) {
+  if (!ws.available)
+    return;
+  for (WindowPanel &p : ws.panels) {
+    release_window_capture(ws, p);
+    mailbox_destroy(p.mailbox);
+    p.state = WINDOW_PANEL_FREE;
+  }
+  if (ws.shm_size > 0) {
+    XShmDetach(ws.dpy, &ws.shm);
+    shmdt(ws.shm.shmaddr);
+    ws.shm_size = 0;
+  }
+  XCompositeUnredirectSubwindows(ws.dpy, ws.root, CompositeRedirectAutomatic);
+  ws.available = false;
+}